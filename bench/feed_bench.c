@@ -0,0 +1,290 @@
+/*
+ * Compares the two ways of building VIEW_FEED on a generated dataset:
+ *  - scan:  the single SQL statement the feed used before timelines
+ *           (4-way OR over two LEFT JOINs on friends, ordered by time);
+ *  - merge: feed_merge_read(), the per-author k-way merge in feed.c.
+ *
+ * Build with `make bench`, run ./feed_bench [-p posts] [-u users]
+ * [-f friends] [-n viewers] [-d pages] [-P public%] [db]. The database is
+ * recreated every run; -P sets the share of public accounts, which decides
+ * how many posts the scan must skip to fill a page.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sqlite3.h>
+
+#include "storage.h"
+#include "feed.h"
+
+#define BENCH_PAGE POSTS_PAGE_SIZE
+
+static const char *SCAN_SQL =
+    "SELECT p.id, p.author_id, u.name, p.visibility, p.content, p.created_at "
+    "FROM posts p "
+    "JOIN users u ON u.id = p.author_id "
+    "LEFT JOIN friends f1 "
+    "       ON f1.user_id = ? "
+    "      AND f1.friend_id = p.author_id "
+    "LEFT JOIN friends f2 "
+    "       ON f2.user_id = p.author_id "
+    "      AND f2.friend_id = ? "
+    "WHERE (p.created_at, p.id) < (?, ?) AND ( "
+    "      p.author_id = ? "
+    "   OR (p.visibility = ? "
+    "       AND (u.vis = ? "
+    "            OR (f1.user_id IS NOT NULL AND f2.user_id IS NOT NULL))) "
+    "   OR (p.visibility = ? "
+    "       AND (f1.user_id IS NOT NULL AND f2.user_id IS NOT NULL)) "
+    "   OR (p.visibility = ? "
+    "       AND (f2.user_id IS NOT NULL AND f2.type = ?))) "
+    "ORDER BY p.created_at DESC, p.id DESC "
+    "LIMIT ?;";
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int scan_read(int viewer_id, const struct PostCursor *after, struct Post *out, int max)
+{
+    sqlite3 *db = storage_read_begin();
+    sqlite3_stmt *stmt;
+
+    if (storage_prepare(db, SCAN_SQL, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[bench] scan prepare failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
+        return -1;
+    }
+
+    int idx = 1;
+    sqlite3_bind_int(stmt, idx++, viewer_id);
+    sqlite3_bind_int(stmt, idx++, viewer_id);
+    sqlite3_bind_int(stmt, idx++, after ? after->created_at : INT_MAX);
+    sqlite3_bind_int(stmt, idx++, after ? after->id : INT_MAX);
+    sqlite3_bind_int(stmt, idx++, viewer_id);
+    sqlite3_bind_int(stmt, idx++, VIS_PUBLIC);
+    sqlite3_bind_int(stmt, idx++, USER_PUBLIC);
+    sqlite3_bind_int(stmt, idx++, VIS_FRIENDS);
+    sqlite3_bind_int(stmt, idx++, VIS_CLOSE_FRIENDS);
+    sqlite3_bind_int(stmt, idx++, FRIEND_CLOSE);
+    sqlite3_bind_int(stmt, idx++, max);
+
+    int count = 0;
+    while (count < max && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        out[count].id = sqlite3_column_int(stmt, 0);
+        out[count].created_at = sqlite3_column_int(stmt, 5);
+        count++;
+    }
+
+    storage_finalize(stmt);
+    storage_read_end(db);
+    return count;
+}
+
+static int exec_or_die(const char *sql)
+{
+    char *errmsg = NULL;
+    if (sqlite3_exec(g_db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "[bench] %s: %s\n", sql, errmsg);
+        sqlite3_free(errmsg);
+        exit(1);
+    }
+    return 0;
+}
+
+static void populate(int users, int friends, int posts, int public_pct)
+{
+    sqlite3_stmt *stmt;
+    double t0 = now_us();
+
+    exec_or_die("BEGIN;");
+
+    sqlite3_prepare_v2(g_db, "INSERT INTO users(name, password_hash, type, vis) VALUES (?, 'x', 0, ?);",
+                       -1, &stmt, NULL);
+    for (int i = 1; i <= users; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "user%d", i);
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2, rand() % 100 < public_pct ? USER_PUBLIC : USER_PRIVATE);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    /* users * friends / 2 mutual pairs; about one edge in ten is close. */
+    sqlite3_prepare_v2(g_db, "INSERT OR IGNORE INTO friends(user_id, friend_id, type) VALUES (?, ?, ?);",
+                       -1, &stmt, NULL);
+    for (long i = 0; i < (long)users * friends / 2; i++)
+    {
+        int a = 1 + rand() % users;
+        int b = 1 + rand() % users;
+        if (a == b)
+            continue;
+        for (int dir = 0; dir < 2; dir++)
+        {
+            sqlite3_bind_int(stmt, 1, dir ? b : a);
+            sqlite3_bind_int(stmt, 2, dir ? a : b);
+            sqlite3_bind_int(stmt, 3, rand() % 10 == 0 ? FRIEND_CLOSE : FRIEND_NORMAL);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(g_db,
+                       "INSERT INTO posts(author_id, visibility, content, created_at) VALUES (?, ?, ?, ?);",
+                       -1, &stmt, NULL);
+    for (int i = 0; i < posts; i++)
+    {
+        char content[64];
+        int r = rand() % 10;
+        snprintf(content, sizeof(content), "post %d", i);
+        sqlite3_bind_int(stmt, 1, 1 + rand() % users);
+        sqlite3_bind_int(stmt, 2, r < 5 ? VIS_PUBLIC : r < 8 ? VIS_FRIENDS : VIS_CLOSE_FRIENDS);
+        sqlite3_bind_text(stmt, 3, content, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 4, 1600000000 + i / 4);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    /* The merge reads public posts of public accounts from the shared timeline. */
+    exec_or_die("INSERT INTO timeline(user_id, created_at, post_id, author_id) "
+                "SELECT 0, p.created_at, p.id, p.author_id FROM posts p "
+                "JOIN users u ON u.id = p.author_id WHERE p.visibility = 0 AND u.vis = 0;");
+
+    exec_or_die("COMMIT;");
+    exec_or_die("ANALYZE;");
+
+    printf("[bench] %d users (%d%% public), ~%d friends each, %d posts generated in %.1f s\n",
+           users, public_pct, friends, posts, (now_us() - t0) / 1e6);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef int (*feed_fn)(int, const struct PostCursor *, struct Post *, int);
+
+/* Reads `pages` consecutive pages for one viewer; returns the time of the last one. */
+static double run_pages(feed_fn fn, int viewer, int pages, struct Post *page, int *ids, int *nids)
+{
+    struct PostCursor cur;
+    const struct PostCursor *after = NULL;
+    double t = 0;
+
+    *nids = 0;
+    for (int p = 0; p < pages; p++)
+    {
+        double t0 = now_us();
+        int n = fn(viewer, after, page, BENCH_PAGE);
+        t = now_us() - t0;
+        if (n <= 0)
+            break;
+
+        for (int i = 0; i < n; i++)
+            ids[(*nids)++] = page[i].id;
+
+        cur.created_at = page[n - 1].created_at;
+        cur.id = page[n - 1].id;
+        after = &cur;
+    }
+    return t;
+}
+
+static void report(const char *name, double *samples, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    qsort(samples, (size_t)n, sizeof(*samples), cmp_double);
+    printf("  %-6s avg %9.1f us   p50 %9.1f us   p99 %9.1f us\n",
+           name, sum / n, samples[n / 2], samples[(n * 99) / 100]);
+}
+
+int main(int argc, char *argv[])
+{
+    int posts = 1000000, users = 20000, friends = 50, viewers = 200, pages = 1, public_pct = 70;
+    const char *path = "feed_bench.db";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:f:n:d:P:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p': posts = atoi(optarg); break;
+            case 'u': users = atoi(optarg); break;
+            case 'f': friends = atoi(optarg); break;
+            case 'n': viewers = atoi(optarg); break;
+            case 'd': pages = atoi(optarg); break;
+            case 'P': public_pct = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p posts] [-u users] [-f friends] [-n viewers] [-d pages] [-P public%%] [db]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (users < 1 || viewers < 1 || pages < 1)
+        return 1;
+
+    char side[600];
+    unlink(path);
+    snprintf(side, sizeof(side), "%s-wal", path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s-shm", path);
+    unlink(side);
+
+    srand(42);
+    if (storage_init(path) < 0)
+        return 1;
+    populate(users, friends, posts, public_pct);
+
+    struct Post *page = malloc(BENCH_PAGE * sizeof(*page));
+    int *scan_ids = malloc((size_t)pages * BENCH_PAGE * sizeof(int));
+    int *merge_ids = malloc((size_t)pages * BENCH_PAGE * sizeof(int));
+    double *scan_t = malloc((size_t)viewers * sizeof(double));
+    double *merge_t = malloc((size_t)viewers * sizeof(double));
+    if (!page || !scan_ids || !merge_ids || !scan_t || !merge_t)
+        return 1;
+
+    int mismatches = 0;
+    for (int v = 0; v < viewers; v++)
+    {
+        int viewer = 1 + rand() % users;
+        int nscan, nmerge;
+
+        scan_t[v] = run_pages(scan_read, viewer, pages, page, scan_ids, &nscan);
+        merge_t[v] = run_pages(feed_merge_read, viewer, pages, page, merge_ids, &nmerge);
+
+        if (nscan != nmerge || memcmp(scan_ids, merge_ids, (size_t)nscan * sizeof(int)) != 0)
+            mismatches++;
+    }
+
+    printf("[bench] page %d of VIEW_FEED (%d posts per page), %d viewers:\n", pages, BENCH_PAGE, viewers);
+    report("scan", scan_t, viewers);
+    report("merge", merge_t, viewers);
+    printf("[bench] %d result mismatches\n", mismatches);
+
+    free(page);
+    free(scan_ids);
+    free(merge_ids);
+    free(scan_t);
+    free(merge_t);
+    storage_close();
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * Compares friendship checks against the friends table with the in-memory
+ * graph in graph.c:
+ *  - sql:   the COUNT(*) pair query friends_are_mutual() used to run;
+ *  - graph: graph_are_mutual(), two binary searches in the CSR rows.
+ *
+ * Build with `make bench`, run ./graph_bench [-u users] [-f friends]
+ * [-q queries] [-c changes] [db]. After the first round -c random edge
+ * changes are applied to both sides while a second thread keeps reading
+ * the graph, then the answers are compared again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sqlite3.h>
+
+#include "storage.h"
+#include "graph.h"
+
+static const char *MUTUAL_SQL =
+    "SELECT "
+    " (SELECT COUNT(*) FROM friends WHERE user_id=? AND friend_id=?) AS c1, "
+    " (SELECT COUNT(*) FROM friends WHERE user_id=? AND friend_id=?) AS c2;";
+
+struct Pair
+{
+    int a;
+    int b;
+};
+
+static atomic_int g_stop;
+static atomic_long g_background_reads;
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int sql_are_mutual(int a, int b)
+{
+    sqlite3 *db = storage_read_begin();
+    sqlite3_stmt *stmt;
+
+    if (storage_prepare(db, MUTUAL_SQL, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[bench] mutual prepare failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, a);
+    sqlite3_bind_int(stmt, 2, b);
+    sqlite3_bind_int(stmt, 3, b);
+    sqlite3_bind_int(stmt, 4, a);
+
+    int ok = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        ok = sqlite3_column_int(stmt, 0) > 0 && sqlite3_column_int(stmt, 1) > 0;
+
+    storage_finalize(stmt);
+    storage_read_end(db);
+    return ok;
+}
+
+static int exec_or_die(const char *sql)
+{
+    char *errmsg = NULL;
+    if (sqlite3_exec(g_db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "[bench] %s: %s\n", sql, errmsg);
+        sqlite3_free(errmsg);
+        exit(1);
+    }
+    return 0;
+}
+
+/* Returns the generated pairs so half of the queries hit an existing edge. */
+static struct Pair *populate(int users, int friends, int *npairs)
+{
+    sqlite3_stmt *stmt;
+    double t0 = now_us();
+    long want = (long)users * friends / 2;
+    struct Pair *pairs = malloc((size_t)want * sizeof(*pairs));
+    if (!pairs)
+        exit(1);
+
+    exec_or_die("BEGIN;");
+
+    sqlite3_prepare_v2(g_db, "INSERT INTO users(name, password_hash, type, vis) VALUES (?, 'x', 0, 0);",
+                       -1, &stmt, NULL);
+    for (int i = 1; i <= users; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "user%d", i);
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    /* Mostly mutual pairs; one in eight is a pending one-way edge. */
+    sqlite3_prepare_v2(g_db, "INSERT OR IGNORE INTO friends(user_id, friend_id, type) VALUES (?, ?, ?);",
+                       -1, &stmt, NULL);
+    *npairs = 0;
+    for (long i = 0; i < want; i++)
+    {
+        int a = 1 + rand() % users;
+        int b = 1 + rand() % users;
+        if (a == b)
+            continue;
+        int dirs = rand() % 8 == 0 ? 1 : 2;
+        for (int dir = 0; dir < dirs; dir++)
+        {
+            sqlite3_bind_int(stmt, 1, dir ? b : a);
+            sqlite3_bind_int(stmt, 2, dir ? a : b);
+            sqlite3_bind_int(stmt, 3, rand() % 10 == 0 ? FRIEND_CLOSE : FRIEND_NORMAL);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+        pairs[*npairs].a = a;
+        pairs[*npairs].b = b;
+        (*npairs)++;
+    }
+    sqlite3_finalize(stmt);
+
+    exec_or_die("COMMIT;");
+    exec_or_die("ANALYZE;");
+
+    printf("[bench] %d users, ~%d friends each generated in %.1f s\n",
+           users, friends, (now_us() - t0) / 1e6);
+    return pairs;
+}
+
+static void make_queries(struct Pair *q, int n, const struct Pair *pairs, int npairs, int users)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (npairs > 0 && i % 2 == 0)
+        {
+            q[i] = pairs[rand() % npairs];
+        }
+        else
+        {
+            q[i].a = 1 + rand() % users;
+            q[i].b = 1 + rand() % users;
+        }
+    }
+}
+
+/* Runs every query through both paths and prints the per-call cost. */
+static int run_round(const char *label, const struct Pair *q, int n)
+{
+    int mismatches = 0, hits = 0;
+    double sql_t = 0, graph_t = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        double t0 = now_us();
+        int s = sql_are_mutual(q[i].a, q[i].b);
+        double t1 = now_us();
+        int g = graph_are_mutual(q[i].a, q[i].b);
+        double t2 = now_us();
+
+        sql_t += t1 - t0;
+        graph_t += t2 - t1;
+        hits += s;
+        if (s != g)
+            mismatches++;
+    }
+
+    printf("[bench] %s: %d mutual checks (%d mutual)\n", label, n, hits);
+    printf("  sql    avg %9.3f us\n", sql_t / n);
+    printf("  graph  avg %9.3f us\n", graph_t / n);
+    return mismatches;
+}
+
+static void *background_reader(void *arg)
+{
+    int users = *(int *)arg;
+    long reads = 0;
+    unsigned seed = 7;
+
+    while (!atomic_load(&g_stop))
+    {
+        graph_are_mutual(1 + rand_r(&seed) % users, 1 + rand_r(&seed) % users);
+        reads++;
+    }
+    atomic_store(&g_background_reads, reads);
+    return NULL;
+}
+
+/* Random adds, retypes and removals applied to the table and the graph. */
+static void apply_changes(int changes, const struct Pair *pairs, int npairs, int users)
+{
+    sqlite3_stmt *up, *del;
+    sqlite3_prepare_v2(g_db,
+                       "INSERT INTO friends(user_id, friend_id, type) VALUES (?, ?, ?) "
+                       "ON CONFLICT(user_id, friend_id) DO UPDATE SET type = excluded.type;",
+                       -1, &up, NULL);
+    sqlite3_prepare_v2(g_db, "DELETE FROM friends WHERE user_id = ? AND friend_id = ?;", -1, &del, NULL);
+
+    double graph_t = 0;
+    exec_or_die("BEGIN;");
+    for (int i = 0; i < changes; i++)
+    {
+        int a, b;
+        if (npairs > 0 && rand() % 2)
+        {
+            a = pairs[rand() % npairs].a;
+            b = pairs[rand() % npairs].b;
+        }
+        else
+        {
+            /* Ids past the loaded range make the graph grow. */
+            a = 1 + rand() % (users + users / 4);
+            b = 1 + rand() % (users + users / 4);
+        }
+        if (a == b)
+            continue;
+
+        int type = rand() % 10 == 0 ? FRIEND_CLOSE : FRIEND_NORMAL;
+        if (rand() % 3 == 0)
+        {
+            sqlite3_bind_int(del, 1, a);
+            sqlite3_bind_int(del, 2, b);
+            sqlite3_step(del);
+            sqlite3_reset(del);
+
+            double t0 = now_us();
+            graph_remove_edge(a, b);
+            graph_t += now_us() - t0;
+        }
+        else
+        {
+            sqlite3_bind_int(up, 1, a);
+            sqlite3_bind_int(up, 2, b);
+            sqlite3_bind_int(up, 3, type);
+            sqlite3_step(up);
+            sqlite3_reset(up);
+
+            double t0 = now_us();
+            graph_set_edge(a, b, (enum friend_type)type);
+            graph_t += now_us() - t0;
+        }
+    }
+    exec_or_die("COMMIT;");
+
+    sqlite3_finalize(up);
+    sqlite3_finalize(del);
+    printf("[bench] %d edge changes, graph update avg %.3f us\n", changes, changes ? graph_t / changes : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    int users = 20000, friends = 50, queries = 200000, changes = 20000;
+    const char *path = "graph_bench.db";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:f:q:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u': users = atoi(optarg); break;
+            case 'f': friends = atoi(optarg); break;
+            case 'q': queries = atoi(optarg); break;
+            case 'c': changes = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-u users] [-f friends] [-q queries] [-c changes] [db]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (users < 2 || queries < 1 || changes < 0)
+        return 1;
+
+    char side[600];
+    unlink(path);
+    snprintf(side, sizeof(side), "%s-wal", path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s-shm", path);
+    unlink(side);
+
+    srand(42);
+    if (storage_init(path) < 0)
+        return 1;
+
+    int npairs;
+    struct Pair *pairs = populate(users, friends, &npairs);
+
+    double t0 = now_us();
+    if (graph_init() < 0)
+        return 1;
+    printf("[bench] graph loaded in %.1f ms, %d edges\n", (now_us() - t0) / 1e3, graph_edge_count());
+
+    struct Pair *q = malloc((size_t)queries * sizeof(*q));
+    if (!q)
+        return 1;
+
+    make_queries(q, queries, pairs, npairs, users);
+    int mismatches = run_round("initial", q, queries);
+
+    pthread_t reader;
+    pthread_create(&reader, NULL, background_reader, &users);
+    apply_changes(changes, pairs, npairs, users);
+    atomic_store(&g_stop, 1);
+    pthread_join(reader, NULL);
+    printf("[bench] %ld concurrent graph reads during the changes\n", atomic_load(&g_background_reads));
+
+    make_queries(q, queries, pairs, npairs, users + users / 4);
+    mismatches += run_round("after changes", q, queries);
+    printf("[bench] %d result mismatches\n", mismatches);
+
+    free(q);
+    free(pairs);
+    graph_destroy();
+    storage_close();
+    return mismatches ? 1 : 0;
+}
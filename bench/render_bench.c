@@ -0,0 +1,256 @@
+/*
+ * Compares the two ways of rendering a VIEW_FEED post row into an OutBuf:
+ *  - printf:   localtime_r() + strftime() and one ANSI-laden outbuf_printf()
+ *              per row, as posts_page_row() did before render.c;
+ *  - template: render_row() with the precompiled post template and the
+ *              per-thread timestamp cache;
+ *  - compact:  the OUTPUT COMPACT row, raw TSV fields without ANSI.
+ *
+ * Build with `make bench`, run ./render_bench [-n rows] [-r rounds]
+ * [-c content bytes] [-g max gap seconds]. Rows are newest first with a
+ * random gap between timestamps, like a listing page; -g 0 puts them all
+ * in one second, a large -g makes nearly every row a different day. The
+ * printf and template outputs are captured once and compared byte for byte.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "buffer.h"
+#include "render.h"
+
+struct BenchRow
+{
+    int id;
+    const char *author;
+    const char *vis;
+    const char *content;
+    size_t content_len;
+    int created_at;
+};
+
+static const struct RenderTemplate POST_ROW = { 6, {
+    RENDER_SEG("\033[90m========== Post #"),
+    RENDER_SEG(" ==========\033[0m\n\033[35mID:\033[0m "),
+    RENDER_SEG("\n\033[35mAuthor:\033[0m \033[36m"),
+    RENDER_SEG("\033[0m\n\033[35mTime:\033[0m \033[34m"),
+    RENDER_SEG("\033[0m\n\033[35mVisibility:\033[0m \033[33m"),
+    RENDER_SEG("\033[0m\n\033[35mContent:\033[0m\n"),
+    RENDER_SEG("\n\n") } };
+
+static const struct RenderTemplate POST_ROW_COMPACT = { 6, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+/* Output captured for the comparison; NULL while timing. */
+static char *g_capture;
+static size_t g_capture_len, g_capture_cap;
+static size_t g_bytes;
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int bench_sink(int fd, const struct iovec *iov, int iovcnt)
+{
+    (void)fd;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        g_bytes += iov[i].iov_len;
+        if (!g_capture)
+            continue;
+
+        if (g_capture_len + iov[i].iov_len > g_capture_cap)
+        {
+            size_t cap = g_capture_cap ? g_capture_cap : 1 << 20;
+            while (cap < g_capture_len + iov[i].iov_len)
+                cap *= 2;
+            char *p = realloc(g_capture, cap);
+            if (!p)
+                return -1;
+            g_capture = p;
+            g_capture_cap = cap;
+        }
+        memcpy(g_capture + g_capture_len, iov[i].iov_base, iov[i].iov_len);
+        g_capture_len += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static void render_printf(struct OutBuf *ob, const struct BenchRow *row)
+{
+    char timebuf[64] = {0};
+    time_t t = (time_t)row->created_at;
+    struct tm tm_info;
+    localtime_r(&t, &tm_info);
+    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm_info);
+
+    outbuf_printf(ob,
+    "\033[90m========== Post #%d ==========\033[0m\n"
+    "\033[35mID:\033[0m %d\n"
+    "\033[35mAuthor:\033[0m \033[36m%s\033[0m\n"
+    "\033[35mTime:\033[0m \033[34m%s\033[0m\n"
+    "\033[35mVisibility:\033[0m \033[33m%s\033[0m\n"
+    "\033[35mContent:\033[0m\n",
+        row->id,
+        row->id,
+        row->author,
+        timebuf,
+        row->vis);
+    outbuf_append(ob, row->content, row->content_len);
+    outbuf_append_ref(ob, "\n\n", 2);
+}
+
+static void render_template(struct OutBuf *ob, const struct BenchRow *row)
+{
+    const struct RenderArg args[] = {
+        RENDER_INT(row->id),
+        RENDER_INT(row->id),
+        RENDER_STR(row->author),
+        RENDER_TIME(row->created_at),
+        RENDER_STR(row->vis),
+        RENDER_STRN(row->content, row->content_len),
+    };
+    render_row(ob, &POST_ROW, args);
+}
+
+static void render_compact(struct OutBuf *ob, const struct BenchRow *row)
+{
+    const struct RenderArg args[] = {
+        RENDER_INT(row->id),
+        RENDER_INT(row->id % 1000),
+        RENDER_FIELD(row->author),
+        RENDER_STR(row->vis),
+        RENDER_INT(row->created_at),
+        RENDER_FIELDN(row->content, row->content_len),
+    };
+    render_row(ob, &POST_ROW_COMPACT, args);
+}
+
+typedef void (*render_fn)(struct OutBuf *, const struct BenchRow *);
+
+static double run(render_fn fn, struct OutBuf *ob, const struct BenchRow *rows, int n)
+{
+    double t0 = now_us();
+    outbuf_init(ob, -1, bench_sink);
+    for (int i = 0; i < n; i++)
+        fn(ob, &rows[i]);
+    outbuf_flush(ob);
+    return now_us() - t0;
+}
+
+static void report(const char *name, double best_us, int n, size_t bytes)
+{
+    printf("  %-8s best %9.1f ms   %11.0f records/s   %7.1f MB/s\n",
+           name, best_us / 1e3, n / (best_us / 1e6), bytes / best_us);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 100000, rounds = 10, content = 200, gap = 90;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:c:g:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': n = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'c': content = atoi(optarg); break;
+            case 'g': gap = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rows] [-r rounds] [-c content bytes] [-g max gap seconds]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (n < 1 || rounds < 1 || content < 0 || gap < 0)
+        return 1;
+
+    static const char *authors[] = { "alice", "bob", "carol_the_longer_name", "dave" };
+    static const char *vis[] = { "Public", "Friends", "Close Friends" };
+
+    struct BenchRow *rows = malloc((size_t)n * sizeof(*rows));
+    char *text = malloc((size_t)content + 1);
+    struct OutBuf *ob = malloc(sizeof(*ob));
+    if (!rows || !text || !ob)
+        return 1;
+
+    for (int i = 0; i < content; i++)
+        text[i] = (char)('a' + i % 26);
+    text[content] = '\0';
+
+    srand(42);
+    int t = (int)time(NULL);
+    for (int i = 0; i < n; i++)
+    {
+        rows[i].id = n - i;
+        rows[i].author = authors[rand() % 4];
+        rows[i].vis = vis[rand() % 3];
+        rows[i].content = text;
+        rows[i].content_len = (size_t)content;
+        rows[i].created_at = t;
+        t -= gap ? rand() % (gap + 1) : 0;
+    }
+
+    char *expect;
+    size_t expect_len;
+
+    g_capture = NULL;
+    g_capture_len = g_capture_cap = 0;
+    run(render_printf, ob, rows, n);
+    expect = g_capture;
+    expect_len = g_capture_len;
+
+    g_capture = NULL;
+    g_capture_len = g_capture_cap = 0;
+    run(render_template, ob, rows, n);
+    int mismatch = g_capture_len != expect_len || memcmp(g_capture, expect, expect_len) != 0;
+    free(g_capture);
+    free(expect);
+    g_capture = NULL;
+
+    double best_printf = 0, best_template = 0, best_compact = 0;
+    size_t bytes = 0, compact_bytes = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+        g_bytes = 0;
+        double a = run(render_printf, ob, rows, n);
+        bytes = g_bytes;
+        double b = run(render_template, ob, rows, n);
+        g_bytes = 0;
+        double c = run(render_compact, ob, rows, n);
+        compact_bytes = g_bytes;
+        if (r == 0 || a < best_printf)
+            best_printf = a;
+        if (r == 0 || b < best_template)
+            best_template = b;
+        if (r == 0 || c < best_compact)
+            best_compact = c;
+    }
+
+    printf("[bench] %d post rows, %d content bytes, up to %d s between rows, best of %d:\n",
+           n, content, gap, rounds);
+    report("printf", best_printf, n, bytes);
+    report("template", best_template, n, bytes);
+    report("compact", best_compact, n, compact_bytes);
+    printf("[bench] speedup %.2fx, output %s; compact is %.0f%% of the decorated bytes\n",
+           best_printf / best_template, mismatch ? "DIFFERS" : "identical",
+           100.0 * (double)compact_bytes / (double)bytes);
+
+    free(rows);
+    free(text);
+    free(ob);
+    return mismatch ? 1 : 0;
+}
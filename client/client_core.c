@@ -30,13 +30,14 @@ static void print_help(void)
     printf("Available commands:\n");
     printf("  register <user> <pass>\n");
     printf("  login <user> <pass>\n");
+    printf("  resume <token>\n");
     printf("  logout\n");
     printf("  post\n");
-    printf("  view_public\n");
-    printf("  view_feed\n");
-    printf("  view_user <user>\n");
+    printf("  view_public [cursor]\n");
+    printf("  view_feed [cursor]\n");
+    printf("  view_user <user> [cursor]\n");
     printf("  send <user>\n");
-    printf("  messages <user>\n");
+    printf("  messages <user> [before_id] [limit]\n");
     printf("  add <user>\n");
     printf("  friends\n");
     printf("  change_vis <PUBLIC|PRIVATE>\n");
@@ -235,6 +236,13 @@ void client_loop(int sockfd)
                 continue;
             }
 
+            if (strcmp(cmd, "resume") == 0) {
+                if (!arg1 || arg2) { printf("Usage: resume <token>\n"); print_prompt(); continue; }
+                cmd_resume(sockfd, arg1);
+                print_prompt();
+                continue;
+            }
+
             if (strcmp(cmd, "logout") == 0) {
                 if (arg1 || arg2) { printf("Usage: logout\n"); print_prompt(); continue; }
                 cmd_logout(sockfd);
@@ -273,22 +281,22 @@ void client_loop(int sockfd)
             }
 
             if (strcmp(cmd, "view_public") == 0) {
-                if (arg1 || arg2) { printf("Usage: view_public\n"); print_prompt(); continue; }
-                cmd_view_public(sockfd);
+                if (arg2) { printf("Usage: view_public [cursor]\n"); print_prompt(); continue; }
+                cmd_view_public(sockfd, arg1);
                 print_prompt();
                 continue;
             }
 
             if (strcmp(cmd, "view_feed") == 0) {
-                if (arg1 || arg2) { printf("Usage: view_feed\n"); print_prompt(); continue; }
-                cmd_view_feed(sockfd);
+                if (arg2) { printf("Usage: view_feed [cursor]\n"); print_prompt(); continue; }
+                cmd_view_feed(sockfd, arg1);
                 print_prompt();
                 continue;
             }
 
             if (strcmp(cmd, "view_user") == 0) {
-                if (!arg1) { printf("Usage: view_user <user>\n"); print_prompt(); continue; }
-                cmd_view_user(sockfd, arg1);
+                if (!arg1) { printf("Usage: view_user <user> [cursor]\n"); print_prompt(); continue; }
+                cmd_view_user(sockfd, arg1, arg2);
                 print_prompt();
                 continue;
             }
@@ -308,8 +316,8 @@ void client_loop(int sockfd)
             }
 
             if (strcmp(cmd, "messages") == 0) {
-                if (!arg1) { printf("Usage: messages <username>\n"); print_prompt(); continue; }
-                cmd_list_messages(sockfd, arg1);
+                if (!arg1) { printf("Usage: messages <username> [before_id] [limit]\n"); print_prompt(); continue; }
+                cmd_list_messages(sockfd, arg1, arg2);
                 print_prompt();
                 continue;
             }
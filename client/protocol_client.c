@@ -50,6 +50,13 @@ void cmd_login(int sockfd, char *arg1, char *arg2)
     send_and_print(sockfd, req);
 }
 
+void cmd_resume(int sockfd, char *arg1)
+{
+    char req[MAX_CMD_LEN];
+    snprintf(req, sizeof(req), "%s %s\n", CMD_RESUME, arg1);
+    send_and_print(sockfd, req);
+}
+
 void cmd_logout(int sockfd)
 {
     char req[MAX_CMD_LEN];
@@ -64,17 +71,23 @@ void cmd_post(int sockfd, char vis_str[], char content[])
     send_and_print(sockfd, req);
 }
 
-void cmd_view_public(int sockfd)
+void cmd_view_public(int sockfd, const char *cursor)
 {
     char req[MAX_CMD_LEN];
-    snprintf(req, sizeof(req), "%s\n", CMD_VIEW_PUBLIC_POSTS);
+    if (cursor)
+        snprintf(req, sizeof(req), "%s %s\n", CMD_VIEW_PUBLIC_POSTS, cursor);
+    else
+        snprintf(req, sizeof(req), "%s\n", CMD_VIEW_PUBLIC_POSTS);
     send_and_print(sockfd, req);
 }
 
-void cmd_view_feed(int sockfd)
+void cmd_view_feed(int sockfd, const char *cursor)
 {
     char req[MAX_CMD_LEN];
-    snprintf(req, sizeof(req), "%s\n", CMD_VIEW_FEED);
+    if (cursor)
+        snprintf(req, sizeof(req), "%s %s\n", CMD_VIEW_FEED, cursor);
+    else
+        snprintf(req, sizeof(req), "%s\n", CMD_VIEW_FEED);
     send_and_print(sockfd, req);
 }
 
@@ -85,10 +98,13 @@ void cmd_send_message(int sockfd, char *arg1, char msg[])
     send_and_print(sockfd, req);
 }
 
-void cmd_list_messages(int sockfd, char *arg1)
+void cmd_list_messages(int sockfd, char *arg1, char *arg2)
 {
     char req[MAX_CMD_LEN];
-    snprintf(req, sizeof(req), "%s %s\n", CMD_LIST_MESSAGES, arg1);
+    if (arg2)
+        snprintf(req, sizeof(req), "%s %s %s\n", CMD_LIST_MESSAGES, arg1, arg2);
+    else
+        snprintf(req, sizeof(req), "%s %s\n", CMD_LIST_MESSAGES, arg1);
     send_and_print(sockfd, req);
 }
 
@@ -134,10 +150,13 @@ void cmd_delete_post(int sockfd, const char *arg1)
     send_and_print(sockfd, req);
 }
 
-void cmd_view_user(int sockfd, const char *arg1)
+void cmd_view_user(int sockfd, const char *arg1, const char *cursor)
 {
     char req[MAX_CMD_LEN];
-    snprintf(req, sizeof(req), "%s %s\n", CMD_VIEW_USER_POSTS, arg1);
+    if (cursor)
+        snprintf(req, sizeof(req), "%s %s %s\n", CMD_VIEW_USER_POSTS, arg1, cursor);
+    else
+        snprintf(req, sizeof(req), "%s %s\n", CMD_VIEW_USER_POSTS, arg1);
     send_and_print(sockfd, req);
 }
 
@@ -0,0 +1,243 @@
+#include "common.h"
+#include "buffer.h"
+
+#include <stdarg.h>
+#include <netinet/tcp.h>
+
+/*
+ * Looks for the next '\n' in buf[*pos..len). On success the line is
+ * NUL-terminated in place (a trailing '\r' is dropped as well), *pos moves
+ * past the newline and the line start is returned. NULL means there is no
+ * complete line yet and *pos is left untouched.
+ */
+char *buffer_next_line(char *buf, size_t len, size_t *pos, size_t *line_len)
+{
+    if (*pos >= len)
+        return NULL;
+
+    char *start = buf + *pos;
+    char *nl = memchr(start, '\n', len - *pos);
+    if (!nl)
+        return NULL;
+
+    *pos = (size_t)(nl - buf) + 1;
+
+    char *end = nl;
+    if (end > start && end[-1] == '\r')
+        end--;
+    *end = '\0';
+
+    if (line_len)
+        *line_len = (size_t)(end - start);
+    return start;
+}
+
+/*
+ * Same contract as Parser(), without copying: cmd is the first word, arg1 the
+ * second and arg2 the rest of the line. The pieces point into line, which is
+ * cut with NULs in place. Missing or empty arguments come back as NULL.
+ */
+void buffer_split_command(char *line, size_t len, char **cmd, char **arg1, char **arg2)
+{
+    char *end = line + len;
+
+    while (end > line && (end[-1] == ' ' || end[-1] == '\r' || end[-1] == '\n'))
+        end--;
+    *end = '\0';
+
+    *cmd = line;
+    *arg1 = NULL;
+    *arg2 = NULL;
+
+    char *sp = memchr(line, ' ', (size_t)(end - line));
+    if (!sp)
+        return;
+    *sp = '\0';
+
+    char *p = sp + 1;
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end)
+        return;
+    *arg1 = p;
+
+    sp = memchr(p, ' ', (size_t)(end - p));
+    if (!sp)
+        return;
+    *sp = '\0';
+
+    p = sp + 1;
+    while (p < end && *p == ' ')
+        p++;
+    if (p < end)
+        *arg2 = p;
+}
+
+void outbuf_init(struct OutBuf *ob, int fd, outbuf_sink_fn sink)
+{
+    ob->fd = fd;
+    ob->sink = sink;
+    ob->corked = 0;
+    ob->failed = 0;
+    ob->niov = 0;
+    ob->used = 0;
+}
+
+static void outbuf_cork(struct OutBuf *ob, int on)
+{
+    if (ob->corked == on)
+        return;
+    /* Fails harmlessly on anything that is not a TCP socket. */
+    setsockopt(ob->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    ob->corked = on;
+}
+
+int outbuf_flush(struct OutBuf *ob)
+{
+    if (ob->niov > 0 && !ob->failed && ob->sink(ob->fd, ob->iov, ob->niov) < 0)
+        ob->failed = 1;
+
+    ob->niov = 0;
+    ob->used = 0;
+    return ob->failed ? -1 : 0;
+}
+
+/*
+ * Final flush of a response. Only responses that needed more than one flush
+ * were corked; uncorking pushes out the last partial segment right away.
+ */
+int outbuf_end(struct OutBuf *ob)
+{
+    int rc = outbuf_flush(ob);
+    outbuf_cork(ob, 0);
+    return rc;
+}
+
+/* Makes room for one more iovec (and arena bytes, when need > 0). */
+static void outbuf_reserve(struct OutBuf *ob, size_t need)
+{
+    if (ob->niov < OUTBUF_IOV && ob->used + need <= OUTBUF_ARENA)
+        return;
+
+    outbuf_cork(ob, 1);
+    outbuf_flush(ob);
+}
+
+/* Records arena bytes [used, used + len), merging with the previous piece when contiguous. */
+static void outbuf_commit(struct OutBuf *ob, size_t len)
+{
+    char *p = ob->arena + ob->used;
+    struct iovec *last = ob->niov > 0 ? &ob->iov[ob->niov - 1] : NULL;
+
+    if (last && (char *)last->iov_base + last->iov_len == p)
+    {
+        last->iov_len += len;
+    }
+    else
+    {
+        ob->iov[ob->niov].iov_base = p;
+        ob->iov[ob->niov].iov_len = len;
+        ob->niov++;
+    }
+    ob->used += len;
+}
+
+int outbuf_append_ref(struct OutBuf *ob, const void *data, size_t len)
+{
+    if (ob->failed)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    outbuf_reserve(ob, 0);
+    ob->iov[ob->niov].iov_base = (void *)data;
+    ob->iov[ob->niov].iov_len = len;
+    ob->niov++;
+    return 0;
+}
+
+/*
+ * Lends the caller up to max bytes of arena space to fill in place;
+ * outbuf_commit_span() then records how many were written. NULL when max
+ * can never fit the arena or the buffer has failed.
+ */
+char *outbuf_reserve_span(struct OutBuf *ob, size_t max)
+{
+    if (ob->failed || max > OUTBUF_ARENA)
+        return NULL;
+
+    outbuf_reserve(ob, max);
+    return ob->failed ? NULL : ob->arena + ob->used;
+}
+
+void outbuf_commit_span(struct OutBuf *ob, size_t len)
+{
+    if (len > 0)
+        outbuf_commit(ob, len);
+}
+
+int outbuf_append(struct OutBuf *ob, const void *data, size_t len)
+{
+    if (ob->failed)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    if (len > OUTBUF_ARENA)
+    {
+        /* Too big to stage: send what is queued, then the data itself. */
+        outbuf_cork(ob, 1);
+        outbuf_append_ref(ob, data, len);
+        return outbuf_flush(ob);
+    }
+
+    outbuf_reserve(ob, len);
+    memcpy(ob->arena + ob->used, data, len);
+    outbuf_commit(ob, len);
+    return 0;
+}
+
+int outbuf_printf(struct OutBuf *ob, const char *fmt, ...)
+{
+    if (ob->failed)
+        return -1;
+
+    va_list ap;
+    size_t space = ob->niov < OUTBUF_IOV ? OUTBUF_ARENA - ob->used : 0;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(ob->arena + ob->used, space, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+
+    if ((size_t)n < space)
+    {
+        outbuf_commit(ob, (size_t)n);
+        return 0;
+    }
+
+    outbuf_reserve(ob, (size_t)n + 1);
+    if ((size_t)n < OUTBUF_ARENA - ob->used)
+    {
+        va_start(ap, fmt);
+        vsnprintf(ob->arena + ob->used, OUTBUF_ARENA - ob->used, fmt, ap);
+        va_end(ap);
+        outbuf_commit(ob, (size_t)n);
+        return 0;
+    }
+
+    char *tmp = malloc((size_t)n + 1);
+    if (!tmp)
+    {
+        ob->failed = 1;
+        return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(tmp, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+
+    int rc = outbuf_append(ob, tmp, (size_t)n);
+    free(tmp);
+    return rc;
+}
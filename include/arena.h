@@ -0,0 +1,31 @@
+#pragma once
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for memory that lives exactly as long as one command.
+ * Allocations come out of chunks and are never freed one by one; the owner
+ * calls arena_reset() when the command is done. A reset keeps one standard
+ * chunk for the next command and returns everything else to malloc, so an
+ * idle owner holds at most ARENA_CHUNK_SIZE bytes.
+ */
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+struct ArenaChunk;
+
+struct Arena
+{
+    struct ArenaChunk *head;    /* chunk being filled, newest first */
+    size_t used;                /* bytes taken from head */
+};
+
+void *arena_alloc(struct Arena *a, size_t size);
+void *arena_calloc(struct Arena *a, size_t count, size_t size);
+char *arena_strndup(struct Arena *a, const char *s, size_t len);
+void *arena_grow(struct Arena *a, void *p, int count, int *cap, size_t size);
+void  arena_reset(struct Arena *a);
+void  arena_destroy(struct Arena *a);
+
+#endif
@@ -15,7 +15,9 @@
 
 
 int auth_register(const char *username, const char* password);
-int auth_login(int client_fd, const char *username, const char* password);
+int auth_login(int client_fd, const char *username, const char* password,
+               char *token, size_t token_size);
+int auth_resume(int client_fd, const char *token);
 int auth_logout(int client_fd);
 
 int auth_get_user_id(int client_fd);
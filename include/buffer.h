@@ -0,0 +1,42 @@
+#pragma once
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define OUTBUF_ARENA 32768
+#define OUTBUF_IOV   64
+
+typedef int (*outbuf_sink_fn)(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Collects the pieces of one response and hands them to the sink in as few
+ * writev() calls as possible. Rendered text goes into the arena, referenced
+ * data is queued without copying and must stay valid until the next flush.
+ */
+struct OutBuf
+{
+    int            fd;
+    outbuf_sink_fn sink;
+    int            corked;
+    int            failed;
+    int            niov;
+    size_t         used;
+    struct iovec   iov[OUTBUF_IOV];
+    char           arena[OUTBUF_ARENA];
+};
+
+char *buffer_next_line(char *buf, size_t len, size_t *pos, size_t *line_len);
+void  buffer_split_command(char *line, size_t len, char **cmd, char **arg1, char **arg2);
+
+void outbuf_init(struct OutBuf *ob, int fd, outbuf_sink_fn sink);
+int  outbuf_append(struct OutBuf *ob, const void *data, size_t len);
+int  outbuf_append_ref(struct OutBuf *ob, const void *data, size_t len);
+char *outbuf_reserve_span(struct OutBuf *ob, size_t max);
+void outbuf_commit_span(struct OutBuf *ob, size_t len);
+int  outbuf_printf(struct OutBuf *ob, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int  outbuf_flush(struct OutBuf *ob);
+int  outbuf_end(struct OutBuf *ob);
+
+#endif
@@ -1,3 +1,10 @@
 #pragma once
 
-void command_dispatch(int client);
\ No newline at end of file
+#include <stddef.h>
+
+#define DISPATCH_DONE   0
+#define DISPATCH_PARKED 1   /* the command finishes elsewhere and calls server_resume() */
+
+struct Conn;
+int command_dispatch(struct Conn *conn, char *buffer, size_t len);
+int command_dispatch_frame(struct Conn *conn, char *frame, size_t len);
@@ -0,0 +1,106 @@
+#pragma once
+#ifndef CONNECTIONS_H
+#define CONNECTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include "protocol.h"
+#include "models.h"
+#include "render.h"
+#include "frames.h"
+
+#define MAX_CONNECTIONS 65536
+#define CONN_RBUF_SIZE  (MAX_CMD_LEN * 4)
+
+#define CONN_DRAINED        0
+#define CONN_LINE           1
+#define CONN_LINE_TOO_LONG  2
+#define CONN_FRAME          3
+#define CONN_FRAME_TOO_LONG 4
+
+_Static_assert(FRAME_MAX <= CONN_RBUF_SIZE, "a request frame must fit in rbuf");
+
+/*
+ * Who is logged in on a connection, copied out of the user directory so
+ * commands read it without any lookup. version is userdir_version() at the
+ * time of the copy; a newer directory means the copy must be refreshed.
+ * Only the thread running the connection's current command touches it.
+ */
+struct ConnIdentity
+{
+    int      user_id;       /* -1 = not logged in */
+    int      admin;
+    enum user_vis vis;
+    unsigned version;
+    char     username[64];
+};
+
+/*
+ * One per accepted socket. The reactor appends to rbuf, the single worker that
+ * currently owns the connection (scheduled == 1) consumes lines from it, so
+ * commands of one client still run one at a time and in order. Once the
+ * client switches to frames the owner may hand requests to other workers;
+ * inflight counts those. Everything except refs is protected by lock; framed
+ * is only written by the owner, which may read it without the lock.
+ */
+struct Conn
+{
+    int    fd;
+    uint32_t addr;      /* peer IPv4 address, network order */
+    pthread_mutex_t lock;
+    atomic_int refs;
+    int    closed;
+    int    registered;
+
+    char   rbuf[CONN_RBUF_SIZE];
+    size_t rstart;
+    size_t rlen;
+    int    scheduled;
+    int    read_paused;
+    int    eof;
+    int    discarding;
+    int    framed;      /* binary frames instead of lines, set by HELLO BINARY */
+    size_t skip;        /* rest of an oversized frame still to throw away */
+    int    inflight;    /* requests of this connection running on other workers */
+    int    waiting;     /* the owner parked until inflight drops to 0 */
+
+    char  *wbuf;
+    size_t woff;
+    size_t wlen;
+    size_t wcap;
+    int    want_write;
+
+    struct ConnIdentity me;
+    enum output_mode output;    /* listing layout, set by OUTPUT */
+};
+
+int  conns_init(int epoll_fd);
+struct Conn *conn_open(int fd, uint32_t addr);
+struct Conn *conn_acquire(int fd);
+void conn_release(struct Conn *c);
+void conn_close(int fd);
+
+int   conn_fill(struct Conn *c, int hangup);
+int   conn_next_line(struct Conn *c, char **line, size_t *len, int *eof);
+int   conn_reject(struct Conn *c, int *eof, struct FrameHead *frames, int max);
+int   conn_set_framed(struct Conn *c, const void *reply, size_t len);
+
+int   conn_requests_begin(struct Conn *c, int max);
+int   conn_requests_end(struct Conn *c);
+int   conn_requests_wait(struct Conn *c, size_t len);
+
+struct FrameReply;
+struct FrameReply *conn_reply_open(struct Conn *c, uint32_t id, uint16_t op);
+struct FrameReply *conn_reply_detach(void);
+void  conn_reply_attach(struct FrameReply *r);
+void  conn_reply_close(struct FrameReply *r);
+
+int  conn_send(int fd, const void *buf, size_t len);
+int  conn_sendv(int fd, const struct iovec *iov, int iovcnt);
+int  conn_send_many(const int *fds, int count, const void *buf, size_t len);
+int  conn_flush(struct Conn *c);
+
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Grace periods for lock-free readers of copy-on-write data. A reader
+ * brackets its accesses with epoch_enter()/epoch_exit(); a writer that has
+ * unpublished an object calls epoch_synchronize() before freeing it.
+ */
+unsigned epoch_enter(void);
+void     epoch_exit(unsigned e);
+void     epoch_synchronize(void);
+
+#endif
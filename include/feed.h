@@ -0,0 +1,25 @@
+#pragma once
+#ifndef FEED_H
+#define FEED_H
+
+#include "models.h"
+#include "posts.h"
+
+/* How VIEW_FEED is assembled. */
+enum feed_mode
+{
+    FEED_TIMELINE,  /* materialized timelines, see timeline.c */
+    FEED_MERGE      /* k-way merge over per-author post ranges */
+};
+
+void feed_set_mode(enum feed_mode mode);
+int  feed_mode_from_string(const char *s, enum feed_mode *out);
+
+int feed_for_each(int viewer_id, const struct PostCursor *after, int max_size, post_visit_fn fn, void *ctx);
+int feed_merge_for_each(int viewer_id, const struct PostCursor *after, int max_size,
+                        post_visit_fn fn, void *ctx);
+
+/* Array form of feed_merge_for_each, for the benchmark. */
+int feed_merge_read(int viewer_id, const struct PostCursor *after, struct Post *out_array, int max_size);
+
+#endif
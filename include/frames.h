@@ -0,0 +1,89 @@
+#pragma once
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * Binary framing, switched on per connection by "HELLO BINARY". A frame is a
+ * fixed header followed by its body; all integers are big-endian.
+ *
+ *   u32 len      bytes after this field, FRAME_HEADER - 4 + body
+ *   u32 id       request id chosen by the client and echoed by the server;
+ *                0 in a server frame is a push (NOTIF and the like)
+ *   u16 op       command opcode from COMMAND_LIST, FRAME_OP_PUSH for pushes
+ *   u8  flags    FRAME_MORE on every response frame of a request but the last
+ *   u8  nfields  fields in a request body, 0 in server frames
+ *
+ * A request body holds typed fields: FRAME_FIELD_STR (u16 length + bytes) or
+ * FRAME_FIELD_INT (i32). The first field is the command's first argument and
+ * the others are joined by spaces into the second, so text may carry newlines.
+ * A response body is exactly what the text protocol sends for the command, in
+ * the connection's output mode; the frame length replaces scanning for END.
+ * Responses carry their request's id and may come back in any order.
+ */
+#define FRAME_HEADER     12
+#define FRAME_MAX        (MAX_CMD_LEN * 4)      /* whole request frame, length field included */
+#define FRAME_CHUNK      (32 * 1024)            /* response bytes per frame */
+#define FRAME_MORE       0x01
+#define FRAME_OP_PUSH    0
+#define FRAME_FIELD_STR  1
+#define FRAME_FIELD_INT  2
+
+struct FrameHead
+{
+    uint32_t len;
+    uint32_t id;
+    uint16_t op;
+    uint8_t  flags;
+    uint8_t  nfields;
+};
+
+static inline uint32_t frame_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t frame_get16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void frame_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static inline void frame_put16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static inline void frame_head_get(const void *buf, struct FrameHead *h)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    h->len = frame_get32(p);
+    h->id = frame_get32(p + 4);
+    h->op = frame_get16(p + 8);
+    h->flags = p[10];
+    h->nfields = p[11];
+}
+
+/* Header of a server frame with body_len bytes of body. */
+static inline void frame_head_put(void *buf, size_t body_len, uint32_t id, uint16_t op, uint8_t flags)
+{
+    unsigned char *p = (unsigned char *)buf;
+    frame_put32(p, (uint32_t)(FRAME_HEADER - 4 + body_len));
+    frame_put32(p + 4, id);
+    frame_put16(p + 8, op);
+    p[10] = flags;
+    p[11] = 0;
+}
+
+#endif
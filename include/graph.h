@@ -0,0 +1,21 @@
+#pragma once
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "models.h"
+
+#define GRAPH_NO_EDGE (-1)
+
+int  graph_init(void);
+void graph_destroy(void);
+
+/* Lock-free reads; safe from any thread. */
+int graph_edge_type(int user_id, int friend_id);
+int graph_are_mutual(int a, int b);
+int graph_edge_count(void);
+
+/* Writes mirror the friends table and are serialized internally. */
+int graph_set_edge(int user_id, int friend_id, enum friend_type type);
+int graph_remove_edge(int user_id, int friend_id);
+
+#endif
@@ -3,6 +3,7 @@
 #define GROUPS_H
 
 #include "messages.h"
+#include "arena.h"
 
 #define GROUP_OK                  0
 #define GROUP_ERR_EXISTS          (-1)
@@ -13,17 +14,18 @@
 #define GROUP_ERR_NO_REQUEST      (-6)
 #define GROUP_ERR_NO_PERMISSION   (-7)
 
+/* Listing rows; the strings live in the arena the listing was given. */
 struct GroupMemberInfo
 {
     int  user_id;
-    char username[64];
+    const char *username;
     int  is_admin;
 };
 
 struct GroupInfo
 {
     int  group_id;
-    char name[64];
+    const char *name;
     int  is_public;
     int  is_admin;
 };
@@ -31,7 +33,7 @@ struct GroupInfo
 struct GroupRequestInfo
 {
     int user_id;
-    char username[64];
+    const char *username;
 };
 
 int groups_create(int owner_id, const char *name, int is_public);
@@ -40,18 +42,17 @@ int groups_request_join(int user_id, const char *group_name);
 int groups_approve_member(int admin_id, const char *group_name, const char *username);
 int groups_send_group_msg(int sender_id, const char *group_name, const char *text);
 int groups_leave(int user_id, const char *group_name);
-int groups_view_members(int requester_id, const char *group_name, struct GroupMemberInfo *out_array, int max_size);
-int groups_list_for_user(int user_id, struct GroupInfo *out_array, int max_size);
-int groups_get_group_history(int requester_id, const char *group_name, struct Message *out_array, int max_size);
+int groups_view_members(int requester_id, const char *group_name, struct Arena *arena, int max_size,
+                        struct GroupMemberInfo **out);
+int groups_list_for_user(int user_id, struct Arena *arena, int max_size, struct GroupInfo **out);
+int groups_for_each_group_message(int requester_id, const char *group_name, int max_size,
+                                  message_visit_fn fn, void *ctx);
 void format_group_messages_for_client(char *buf, int buf_size, const char *group_name, struct Message *msgs, int count, int current_user_id);
 int groups_set_visibility(int admin_id, const char *group_name, int is_public);
 int groups_kick_member(int admin_id, const char *group_name, const char *username);
-int groups_list_requests(int admin_id, const char *group_name, struct GroupRequestInfo *out_array, int max_size);
+int groups_list_requests(int admin_id, const char *group_name, struct Arena *arena, int max_size,
+                         struct GroupRequestInfo **out);
 int groups_reject_request(int admin_id, const char *group_name, const char *username);
-int groups_list_member_ids(const char *group_name, int *out_ids, int max_ids);
-void group_messages_send_for_client(int client_fd,
-                                    const char *group_name,
-                                    struct Message *msgs, int count,
-                                    int current_user_id);
+int groups_list_member_ids(const char *group_name, int **out_ids);
 
 #endif
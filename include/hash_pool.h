@@ -0,0 +1,23 @@
+#pragma once
+#ifndef HASH_POOL_H
+#define HASH_POOL_H
+
+#include <stdint.h>
+
+/*
+ * Password hashing runs here instead of on the command workers. Each Argon2
+ * call holds crypto_pwhash_MEMLIMIT_INTERACTIVE (64 MB), so the thread count
+ * caps both the CPU and the memory that logins can take.
+ */
+#define HASH_POOL_DEFAULT_THREADS 2
+#define HASH_POOL_MAX_THREADS     32
+#define HASH_QUEUE_DEPTH          128
+#define HASH_QUEUE_PER_PEER       32
+
+typedef void (*hash_job_fn)(void *arg);
+
+int  hash_pool_start(int nthreads);
+int  hash_pool_submit(uint32_t peer, hash_job_fn fn, void *arg);
+void hash_pool_stop(void);
+
+#endif
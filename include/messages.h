@@ -3,25 +3,47 @@
 #define MESSAGES_H
 
 #include <time.h>
+#include <sqlite3.h>
+
+#include "buffer.h"
+#include "render.h"
 
 struct Message
 {
     int   id;
     int   conversation_id;
     int   sender_id;
-    char  sender_name[64];
-    char  content[1024];
+    const char *sender_name;    /* owned by the statement, valid inside the visitor */
+    const char *content;
     time_t created_at;
 };
 
+/* Called once per row; a nonzero return stops the walk. */
+typedef int (*message_visit_fn)(const struct Message *m, void *ctx);
+
+/* A DM or group listing being rendered straight into its response. */
+struct MessagePage
+{
+    struct OutBuf ob;
+    enum output_mode mode;
+    int viewer_id;
+    const char *group_name;     /* NULL for a DM */
+    int count;
+    int first_id;
+};
+
 int messages_find_or_create_dm(int user1_id, int user2_id);
 int messages_add(int conversation_id, int sender_id, const char *content);
-int messages_get_history_dm(int user1_id, int user2_id, struct Message *out_array, int max_size);
+int messages_visit_stmt(sqlite3_stmt *stmt, int max_size, message_visit_fn fn, void *ctx);
+int messages_for_each_dm(int user1_id, int user2_id, int before_id, int max_size,
+                         message_visit_fn fn, void *ctx);
 void format_messages_for_client(char *buf, size_t buf_size, struct Message *msgs, int count, int current_user_id);
 const char* msg_side_label(int sender_id, int current_user_id);
 const char* msg_sender_color(int sender_id, int current_user_id);
-void messages_send_for_client(int client_fd,
-                              struct Message *msgs, int count,
-                              int current_user_id);
+
+void messages_page_begin(struct MessagePage *pg, int client_fd, enum output_mode mode,
+                         int viewer_id, const char *group_name);
+int  messages_page_row(const struct Message *m, void *pg);
+void messages_page_end(struct MessagePage *pg, int page_size, int failed);
 
 #endif
@@ -0,0 +1,10 @@
+#pragma once
+#ifndef MIGRATIONS_H
+#define MIGRATIONS_H
+
+#include <sqlite3.h>
+
+int storage_migrate(sqlite3 *db);
+int storage_schema_version(sqlite3 *db);
+
+#endif
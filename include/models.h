@@ -2,7 +2,7 @@
 #define MODELS_H
 
 #define MAX_POSTS 100
-#define MAX_ID_THREADS 100
+#define POSTS_PAGE_SIZE 50
 #define MAX_USERS 100
 #define MAX_SESSIONS 100
 #define MAX_SESSIONS 100
@@ -51,15 +51,15 @@ struct Notification
 {
     int id;
     int user_id;
-    char type[MAX_NOTIF_TYPE];
-    char payload[MAX_NOTIF_PAYLOAD];
+    const char *type;       /* owned by the statement, valid inside the visitor */
+    const char *payload;
     int created_at;
 };
 
 struct FriendRequestInfo
 {
     int from_id;
-    char from_name[64];
+    const char *from_name;
     int created_at;
 };
 
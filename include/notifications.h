@@ -2,13 +2,30 @@
 #define VIRTUALSOC_NOTIFICATIONS_H
 #pragma once
 #include "models.h"
+#include "buffer.h"
+#include "render.h"
+
+/* Called once per row; a nonzero return stops the walk. */
+typedef int (*notification_visit_fn)(const struct Notification *n, void *ctx);
+
+/* A NOTIFS listing being rendered straight into its response. */
+struct NotifPage
+{
+    struct OutBuf ob;
+    enum output_mode mode;
+    int count;
+};
 
 int notifications_add(int user_id, const char *type, const char *payload);
+int notifications_add_for_group(const char *group_name, int exclude_user_id,
+                                const char *type, const char *payload);
 
-int notifications_list(int user_id, struct Notification *out, int max_size);
+int notifications_for_each(int user_id, int max_size, notification_visit_fn fn, void *ctx);
 
 int notifications_delete_all(int user_id);
 
-void notifications_send_for_client(int client_fd, struct Notification *ns, int count);
+void notifications_page_begin(struct NotifPage *pg, int client_fd, enum output_mode mode);
+int  notifications_page_row(const struct Notification *n, void *pg);
+void notifications_page_end(struct NotifPage *pg, int failed);
 
 #endif
\ No newline at end of file
@@ -1,3 +1,4 @@
 #pragma once
 
 void notify_user(int user_id, const char *line);
+void notify_group(int sender_id, const char *group_name, const char *line);
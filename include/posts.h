@@ -2,16 +2,77 @@
 #ifndef POSTS_H
 #define POSTS_H
 
+#include <stddef.h>
+#include <sqlite3.h>
 #include "models.h"
+#include "buffer.h"
+#include "render.h"
+
+/*
+ * Position in a newest-first post listing: the (created_at, id) of the last
+ * post already shown. Travels over the wire as an opaque NEXT token.
+ */
+struct PostCursor
+{
+    int created_at;
+    int id;
+};
+
+#define POST_CURSOR_LEN 17
+
+/*
+ * A post as it comes off the statement. The strings belong to SQLite and
+ * are only valid while the visitor runs; copy what has to outlive it.
+ */
+struct PostRow
+{
+    int id;
+    int author_id;
+    const char *author_name;
+    enum post_visibility vis;
+    const char *content;
+    size_t content_len;
+    int created_at;
+};
+
+/* Called once per row, newest first; a nonzero return stops the listing. */
+typedef int (*post_visit_fn)(const struct PostRow *row, void *ctx);
+
+/* Visitor that copies rows into out[count++]; out needs room for the whole page. */
+struct PostCollect
+{
+    struct Post *out;
+    int count;
+};
+
+/* Renders visited rows straight into the client's output; see posts.c. */
+struct PostPage
+{
+    struct OutBuf ob;
+    enum output_mode mode;
+    int count;
+    struct PostCursor last;
+};
 
 int posts_add(int author_id, int visibility, const char *content);
-int posts_get_public(struct Post *out_array, int max_size);
-int posts_get_feed_for_user(int user_id, struct Post *out_array, int max_size);
+int posts_for_each_public(const struct PostCursor *after, int max_size, post_visit_fn fn, void *ctx);
+int posts_for_each_feed(int user_id, const struct PostCursor *after, int max_size,
+                        post_visit_fn fn, void *ctx);
+int posts_for_each_of_user(int viewer_id, int target_user_id, const struct PostCursor *after,
+                           int max_size, post_visit_fn fn, void *ctx);
+int posts_visit_stmt(sqlite3_stmt *stmt, int max_size, post_visit_fn fn, void *ctx);
+int posts_collect_row(const struct PostRow *row, void *ctx);
+
 static const char* visibility_to_string(enum post_visibility v);
 void format_posts_for_client(char *buf, int buf_size, struct Post *posts, int count);
 int posts_delete(int requester_id, int post_id);
-int posts_get_for_user(int viewer_id, int target_user_id, struct Post *out_array, int max_size);
-void posts_send_for_client(int client_fd, struct Post *posts, int count);
+
+void posts_page_begin(struct PostPage *pg, int client_fd, enum output_mode mode);
+int  posts_page_row(const struct PostRow *row, void *pg);
+void posts_page_end(struct PostPage *pg, int page_size, int failed);
+
+int  posts_cursor_parse(const char *token, struct PostCursor *out);
+void posts_cursor_format(const struct PostCursor *cur, char *buf, size_t size);
 
 #endif
 
@@ -4,6 +4,7 @@
 #define MAX_CMD_LEN 1024
 #define MAX_CONTENT_LEN 1024
 #define MAX_MESSAGE_LIST 512
+#define MESSAGE_PAGE_SIZE 50
 #define MAX_FRIENDS_LIST 8192
 #define MAX_FEED        640
 
@@ -13,12 +14,16 @@
 #define CMD_REGISTER            "REGISTER"
 #define CMD_LOGIN               "LOGIN"
 #define CMD_LOGOUT              "LOGOUT"
+#define CMD_RESUME              "RESUME"
+#define CMD_OUTPUT              "OUTPUT"
+#define CMD_HELLO               "HELLO"
 
 #define CMD_SET_PROFILE_VIS     "SET_PROFILE_VIS"
 
 #define CMD_MAKE_ADMIN      "MAKE_ADMIN"
 #define CMD_DELETE_USER     "DELETE_USER"
 #define CMD_DELETE_POST     "DELETE_POST"
+#define CMD_REBUILD_TIMELINES "REBUILD_TIMELINES"
 
 #define CMD_ADD_FRIEND          "ADD_FRIEND"
 #define CMD_LIST_FRIENDS        "LIST_FRIENDS"
@@ -54,6 +59,56 @@
 #define CMD_ACCEPT_FRIEND          "ACCEPT_FRIEND"
 #define CMD_REJECT_FRIEND          "REJECT_FRIEND"
 
+/*
+ * Every command the server accepts: X(name, handler, opcode, arity, flags, usage).
+ * opcode is the command's number in binary frames and never changes once
+ * given out; arity is how many leading arguments must be present and usage is
+ * sent when arity fails. The server builds its dispatch table from this list.
+ */
+#define CMDF_AUTH     1     /* needs a logged-in session */
+#define CMDF_SESSION  2     /* changes connection state, never overlaps other requests */
+
+#define COMMAND_LIST(X) \
+    X(CMD_REGISTER,             register_user,         1, 2, CMDF_SESSION, "Usage: REGISTER <username> <password>") \
+    X(CMD_LOGIN,                login,                 2, 2, CMDF_SESSION, "Usage: LOGIN <username> <password>") \
+    X(CMD_RESUME,               resume,                3, 1, CMDF_SESSION, "Usage: RESUME <token>") \
+    X(CMD_LOGOUT,               logout,                4, 0, CMDF_SESSION, "Usage: LOGOUT") \
+    X(CMD_OUTPUT,               output,                5, 1, CMDF_SESSION, "Usage: OUTPUT <PRETTY|COMPACT>") \
+    X(CMD_SET_PROFILE_VIS,      set_profile_vis,       6, 1, CMDF_AUTH,    "Usage: SET_PROFILE_VIS <PUBLIC|PRIVATE>") \
+    X(CMD_MAKE_ADMIN,           make_admin,            7, 1, CMDF_AUTH,    "Usage: MAKE_ADMIN <username>") \
+    X(CMD_DELETE_USER,          delete_user,           8, 1, CMDF_AUTH,    "Usage: DELETE_USER <username>") \
+    X(CMD_DELETE_POST,          delete_post,           9, 1, CMDF_AUTH,    "Usage: DELETE_POST <post_id>") \
+    X(CMD_REBUILD_TIMELINES,    rebuild_timelines,    10, 0, CMDF_AUTH,    "Usage: REBUILD_TIMELINES") \
+    X(CMD_ADD_FRIEND,           add_friend,           11, 1, CMDF_AUTH,    "Usage: ADD_FRIEND <username>") \
+    X(CMD_LIST_FRIENDS,         list_friends,         12, 0, CMDF_AUTH,    "Usage: LIST_FRIENDS") \
+    X(CMD_DELETE_FRIEND,        delete_friend,        13, 1, CMDF_AUTH,    "Usage: DELETE_FRIEND <username>") \
+    X(CMD_SET_FRIEND_STATUS,    set_friend_status,    14, 2, CMDF_AUTH,    "Usage: SET_FRIEND_STATUS <user> <NORMAL|CLOSE>") \
+    X(CMD_POST,                 post,                 15, 2, CMDF_AUTH,    "Usage: POST <public|friends|close> <text>") \
+    X(CMD_VIEW_PUBLIC_POSTS,    view_public_posts,    16, 0, 0,            "Usage: VIEW_PUBLIC_POSTS [cursor]") \
+    X(CMD_VIEW_FEED,            view_feed,            17, 0, CMDF_AUTH,    "Usage: VIEW_FEED [cursor]") \
+    X(CMD_VIEW_USER_POSTS,      view_user_posts,      18, 1, 0,            "Usage: VIEW_USER_POSTS <username> [cursor]") \
+    X(CMD_SEND_MESSAGE,         send_message,         19, 2, CMDF_AUTH,    "Usage: SEND_MESSAGE <username> <text>") \
+    X(CMD_LIST_MESSAGES,        list_messages,        20, 1, CMDF_AUTH,    "Usage: LIST_MESSAGES <user> [before_id] [limit]") \
+    X(CMD_CREATE_GROUP,         create_group,         21, 2, CMDF_AUTH,    "Usage: CREATE_GROUP <name> <PUBLIC|PRIVATE>") \
+    X(CMD_JOIN_GROUP,           join_group,           22, 1, CMDF_AUTH,    "Usage: JOIN_GROUP <group_name>") \
+    X(CMD_SEND_GROUP_MSG,       send_group_msg,       23, 2, CMDF_AUTH,    "Usage: SEND_GROUP_MSG <group_name> <message...>") \
+    X(CMD_MEMBERS_GROUP,        members_group,        24, 1, CMDF_AUTH,    "Usage: MEMBERS_GROUP <group_name>") \
+    X(CMD_REQUEST_GROUP,        request_group,        25, 1, CMDF_AUTH,    "Usage: REQUEST_GROUP <group_name>") \
+    X(CMD_APPROVE_GROUP_MEMBER, approve_group_member, 26, 2, CMDF_AUTH,    "Usage: APPROVE_GROUP_MEMBER <group_name> <username>") \
+    X(CMD_LEAVE_GROUP,          leave_group,          27, 1, CMDF_AUTH,    "Usage: LEAVE_GROUP <group_name>") \
+    X(CMD_LIST_GROUPS,          list_groups,          28, 0, CMDF_AUTH,    "Usage: LIST_GROUPS (no arguments)") \
+    X(CMD_GROUP_MESSAGES,       group_messages,       29, 1, CMDF_AUTH,    "Usage: GROUP_MESSAGES <group_name>") \
+    X(CMD_SET_GROUP_VIS,        set_group_vis,        30, 2, CMDF_AUTH,    "Usage: SET_GROUP_VIS <group_name> <PUBLIC|PRIVATE>") \
+    X(CMD_KICK_GROUP_MEMBER,    kick_group_member,    31, 2, CMDF_AUTH,    "Usage: KICK_GROUP_MEMBER <group_name> <username>") \
+    X(CMD_LIST_GROUP_REQUESTS,  list_group_requests,  32, 1, CMDF_AUTH,    "Usage: LIST_GROUP_REQUESTS <group_name>") \
+    X(CMD_REJECT_GROUP_REQUEST, reject_group_request, 33, 2, CMDF_AUTH,    "Usage: REJECT_GROUP_REQUEST <group> <username>") \
+    X(CMD_VIEW_NOTIFS,          view_notifs,          34, 0, CMDF_AUTH,    "Usage: VIEW_NOTIFS") \
+    X(CMD_DELETE_NOTIFS,        delete_notifs,        35, 0, CMDF_AUTH,    "Usage: DELETE_NOTIFS") \
+    X(CMD_VIEW_FRIEND_REQUESTS, view_friend_requests, 36, 0, CMDF_AUTH,    "Usage: VIEW_FRIEND_REQUESTS") \
+    X(CMD_ACCEPT_FRIEND,        accept_friend,        37, 1, CMDF_AUTH,    "Usage: ACCEPT_FRIEND <username>") \
+    X(CMD_REJECT_FRIEND,        reject_friend,        38, 1, CMDF_AUTH,    "Usage: REJECT_FRIEND <username>") \
+    X(CMD_HELLO,                hello,                39, 0, CMDF_SESSION, "Usage: HELLO [BINARY]")
+
 #define ERR_UNKNOWN_CMD             "UNKNOWN_COMMAND"
 #define ERR_NOT_AUTH                "NOT_AUTHENTICATED"
 #define ERR_BAD_ARGS                "BAD_ARGUMENTS"
@@ -66,5 +121,6 @@
 #define ERR_FRIENDSHIP_NOT_FOUND    "FRIENDSHIP_NOT_FOUND"
 #define ERR_GROUP_NOT_FOUND         "GROUP_NOT_FOUND"
 #define ERR_REQ_NOT_FOUND           "REQ_NOT_FOUND"
+#define ERR_SERVER_BUSY             "SERVER_BUSY"
 
 #endif
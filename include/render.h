@@ -0,0 +1,79 @@
+#pragma once
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "buffer.h"
+
+/*
+ * Row templates for listing responses. A template is the row text cut at
+ * its holes into literal segments whose lengths are fixed at compile time.
+ * render_row() sizes the row once and copies segments and values straight
+ * into the OutBuf arena, so no format string is parsed per row.
+ */
+#define RENDER_MAX_HOLES 8
+#define RENDER_TIME_LEN  19     /* "YYYY-MM-DD HH:MM:SS" */
+
+struct RenderSeg
+{
+    const char *text;
+    size_t len;
+};
+
+#define RENDER_SEG(s) { (s), sizeof(s) - 1 }
+
+/* seg[0] hole 0 seg[1] hole 1 ... hole n-1 seg[n] */
+struct RenderTemplate
+{
+    int nholes;
+    struct RenderSeg seg[RENDER_MAX_HOLES + 1];
+};
+
+enum render_kind
+{
+    RENDER_K_INT,
+    RENDER_K_STR,
+    RENDER_K_TIME,
+    RENDER_K_FIELD          /* string with \\ \t \n \r escaped, for COMPACT */
+};
+
+struct RenderArg
+{
+    enum render_kind kind;
+    long num;               /* the int, or the time_t */
+    const char *str;
+    size_t len;
+};
+
+#define RENDER_INT(v)       ((struct RenderArg){ RENDER_K_INT, (long)(v), NULL, 0 })
+#define RENDER_STR(s)       ((struct RenderArg){ RENDER_K_STR, 0, (s), strlen(s) })
+#define RENDER_STRN(s, n)   ((struct RenderArg){ RENDER_K_STR, 0, (s), (n) })
+#define RENDER_FIELD(s)     ((struct RenderArg){ RENDER_K_FIELD, 0, (s), strlen(s) })
+#define RENDER_FIELDN(s, n) ((struct RenderArg){ RENDER_K_FIELD, 0, (s), (n) })
+#define RENDER_TIME(t)      ((struct RenderArg){ RENDER_K_TIME, (long)(t), NULL, 0 })
+
+/* args holds tpl->nholes values, in hole order. */
+int render_row(struct OutBuf *ob, const struct RenderTemplate *tpl, const struct RenderArg *args);
+
+/*
+ * Local "YYYY-MM-DD HH:MM:SS" for t. Each thread keeps the last result and
+ * the day it fell in, so rows from the same second cost nothing and rows
+ * from the same day skip localtime_r(). Valid until the thread's next call.
+ */
+const char *render_time(time_t t);
+
+/*
+ * What a connection wants listings to look like: PRETTY is the colourised
+ * layout client_app prints as is, COMPACT is one tab-separated line per
+ * record with raw fields and no ANSI, for scripts. Chosen with OUTPUT.
+ */
+enum output_mode
+{
+    OUTPUT_PRETTY,
+    OUTPUT_COMPACT
+};
+
+#endif
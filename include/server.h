@@ -1,10 +1,7 @@
 #pragma once
 
-struct thData
-{
-    int id_thread;
-    int client;
-};
-
 int server_start(int port);
-void server_run(int sd);
\ No newline at end of file
+void server_run(int sd, int workers, int hashers);
+
+struct Conn;
+void server_resume(struct Conn *c);
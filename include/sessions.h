@@ -2,10 +2,25 @@
 #ifndef SESSIONS_H
 #define SESSIONS_H
 
+#include <stddef.h>
+
+#define SESSIONS_MAX_PER_USER 32
+
+#define SESSION_TOKEN_BYTES 32
+#define SESSION_TOKEN_HEX   (SESSION_TOKEN_BYTES * 2 + 1)
+#define SESSION_TOKEN_TTL   (7 * 24 * 3600)
+#define SESSION_TOKENS_MAX  65536
+
 int sessions_init(void);
 int sessions_set(int client_fd, int user_id);
 int sessions_clear(int client_fd);
 int sessions_get_user_id(int client_fd);
 int sessions_find_fd_by_user_id(int user_id);
+int sessions_find_fds_by_user_id(int user_id, int *out_fds, int max_fds);
+
+int sessions_token_issue(int client_fd, int user_id, char *out_hex, size_t out_size);
+int sessions_token_resume(int client_fd, const char *token_hex);
+int sessions_token_revoke_fd(int client_fd);
+int sessions_token_revoke_user(int user_id);
 
 #endif
@@ -10,4 +10,15 @@ extern pthread_mutex_t db_mutex;
 int storage_init(const char *path);
 void storage_close(void);
 
+sqlite3 *storage_read_begin(void);
+void storage_read_end(sqlite3 *db);
+
+int  storage_write_begin(void);
+int  storage_write_end(int rc);
+
+int  storage_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt);
+int  storage_finalize(sqlite3_stmt *stmt);
+void storage_stmt_stats(unsigned long *hits, unsigned long *misses);
+void storage_log_stats(void);
+
 #endif
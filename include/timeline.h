@@ -0,0 +1,26 @@
+#pragma once
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <sqlite3.h>
+#include "models.h"
+#include "posts.h"
+
+/* Authors followed by more users than this are merged into feeds at read time. */
+#ifndef TIMELINE_FANOUT_MAX
+#define TIMELINE_FANOUT_MAX 1000
+#endif
+
+/* Write side; the caller holds db_mutex and owns the transaction. */
+int timeline_add_post(int post_id);
+int timeline_remove_post(int post_id);
+int timeline_refresh_pair(int user_a, int user_b);
+int timeline_refresh_author(int author_id);
+int timeline_check_degree(int author_id);
+int timeline_remove_user(int user_id);
+int timeline_rebuild(sqlite3 *db);
+
+int timeline_rebuild_all(void);
+int timeline_for_each(int viewer_id, const struct PostCursor *after, int max_size, post_visit_fn fn, void *ctx);
+
+#endif
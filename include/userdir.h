@@ -0,0 +1,33 @@
+#pragma once
+#ifndef USERDIR_H
+#define USERDIR_H
+
+#include <stddef.h>
+#include "models.h"
+
+/* Everything the directory keeps about a user but the name, which is only copied out by userdir_get_name(). */
+struct UserInfo
+{
+    int id;
+    enum user_type type;
+    enum user_vis vis;
+};
+
+int  userdir_init(void);
+void userdir_destroy(void);
+
+/* Lock-free lookups; safe from any thread. */
+int userdir_find_id(const char *name);
+int userdir_get(int user_id, struct UserInfo *out);
+int userdir_get_name(int user_id, char *out, size_t out_size);
+
+/* Bumped whenever an existing user changes or disappears. */
+unsigned userdir_version(void);
+
+/* Writes mirror the users table; call them where the row changes. */
+int userdir_put(const struct UserInfo *info, const char *name);
+int userdir_set_type(int user_id, enum user_type type);
+int userdir_set_vis(int user_id, enum user_vis vis);
+int userdir_remove(int user_id);
+
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#define WORKER_POOL_MAX_THREADS 256
+#define WORKER_QUEUE_DEPTH      1024
+
+typedef void (*worker_job_fn)(void *arg);
+
+int  worker_pool_default_size(void);
+int  worker_pool_start(int nthreads);
+int  worker_pool_submit(worker_job_fn fn, void *arg);
+void worker_pool_stop(void);
+
+#endif
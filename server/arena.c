@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t size;                /* usable bytes in data */
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+static struct ArenaChunk *chunk_new(size_t size, struct ArenaChunk *next)
+{
+    struct ArenaChunk *c = malloc(sizeof(*c) + size);
+    if (!c)
+        return NULL;
+    c->next = next;
+    c->size = size;
+    return c;
+}
+
+void *arena_alloc(struct Arena *a, size_t size)
+{
+    if (size > ARENA_CHUNK_SIZE / 2)
+    {
+        /* Big blocks get a chunk of their own behind head, which stays in use. */
+        struct ArenaChunk *c = chunk_new(size, a->head ? a->head->next : NULL);
+        if (!c)
+            return NULL;
+        if (a->head)
+            a->head->next = c;
+        else
+        {
+            a->head = c;
+            a->used = size;
+        }
+        return c->data;
+    }
+
+    size_t at = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!a->head || at > a->head->size || size > a->head->size - at)
+    {
+        struct ArenaChunk *c = chunk_new(ARENA_CHUNK_SIZE, a->head);
+        if (!c)
+            return NULL;
+        a->head = c;
+        at = 0;
+    }
+
+    a->used = at + size;
+    return a->head->data + at;
+}
+
+void *arena_calloc(struct Arena *a, size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+
+    void *p = arena_alloc(a, count * size);
+    if (p)
+        memset(p, 0, count * size);
+    return p;
+}
+
+char *arena_strndup(struct Arena *a, const char *s, size_t len)
+{
+    char *p = arena_alloc(a, len + 1);
+    if (!p)
+        return NULL;
+    if (len)
+        memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/*
+ * Grows p, the latest allocation, in place when the head chunk has room;
+ * otherwise copies it to a new block and leaves the old one to the reset.
+ */
+static void *arena_realloc(struct Arena *a, void *p, size_t old_size, size_t new_size)
+{
+    if (p && new_size <= old_size)
+        return p;
+
+    if (p && a->head && (unsigned char *)p + old_size == a->head->data + a->used &&
+        new_size <= ARENA_CHUNK_SIZE / 2 && new_size - old_size <= a->head->size - a->used)
+    {
+        a->used += new_size - old_size;
+        return p;
+    }
+
+    void *n = arena_alloc(a, new_size);
+    if (n && p && old_size)
+        memcpy(n, p, old_size);
+    return n;
+}
+
+/*
+ * Array of count elements of size bytes with room for one more, for rows
+ * read one at a time. The capacity doubles from 16; returns NULL when out
+ * of memory.
+ */
+void *arena_grow(struct Arena *a, void *p, int count, int *cap, size_t size)
+{
+    if (p && count < *cap)
+        return p;
+
+    int ncap = *cap > 0 ? *cap * 2 : 16;
+    if ((size_t)ncap > SIZE_MAX / size)
+        return NULL;
+
+    void *n = arena_realloc(a, p, (size_t)*cap * size, (size_t)ncap * size);
+    if (n)
+        *cap = ncap;
+    return n;
+}
+
+void arena_reset(struct Arena *a)
+{
+    struct ArenaChunk *keep = NULL;
+    struct ArenaChunk *c = a->head;
+
+    while (c)
+    {
+        struct ArenaChunk *next = c->next;
+        if (!keep && c->size == ARENA_CHUNK_SIZE)
+        {
+            keep = c;
+            keep->next = NULL;
+        }
+        else
+        {
+            free(c);
+        }
+        c = next;
+    }
+
+    a->head = keep;
+    a->used = 0;
+}
+
+void arena_destroy(struct Arena *a)
+{
+    arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
@@ -4,42 +4,22 @@
 #include "models.h"
 #include "storage.h"
 #include "sessions.h"
+#include "timeline.h"
+#include "userdir.h"
 
-static void init_auth_once()
-{
-    static int initialized = 0;
-    if (initialized)
-        return;
-    initialized = 1;
+static pthread_once_t auth_once = PTHREAD_ONCE_INIT;
 
+static void init_auth_admin(void)
+{
     pthread_mutex_lock(&db_mutex);
 
-    char *errmsg = NULL;
     int rc;
 
-    const char *sql_users =
-        "CREATE TABLE IF NOT EXISTS users ("
-        "  id            INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  name          TEXT UNIQUE NOT NULL,"
-        "  password_hash TEXT NOT NULL,"
-        "  type          INTEGER NOT NULL,"
-        "  vis           INTEGER NOT NULL"
-        ");";
-
-    rc = sqlite3_exec(g_db, sql_users, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[auth] Cannot create users table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
-
     const char *sql_count_admin =
         "SELECT COUNT(*) FROM users WHERE type = ?;";
 
     sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(g_db, sql_count_admin, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_count_admin, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[auth] prepare count admin failed: %s\n", sqlite3_errmsg(g_db));
@@ -53,7 +33,7 @@ static void init_auth_once()
     if ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
         admin_count = sqlite3_column_int(stmt, 0);
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (admin_count == 0)
     {
@@ -75,7 +55,7 @@ static void init_auth_once()
                 "INSERT INTO users(name, password_hash, type, vis) "
                 "VALUES (?, ?, ?, ?);";
 
-            rc = sqlite3_prepare_v2(g_db, sql_ins, -1, &stmt, NULL);
+            rc = storage_prepare(g_db, sql_ins, &stmt);
             if (rc == SQLITE_OK) {
                 sqlite3_bind_text(stmt, 1, initial_user, -1, SQLITE_TRANSIENT);
                 sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_TRANSIENT);
@@ -86,11 +66,13 @@ static void init_auth_once()
                 if (rc != SQLITE_DONE) {
                     fprintf(stderr, "[auth] insert initial admin failed: %s\n", sqlite3_errmsg(g_db));
                 } else {
+                    struct UserInfo info = {(int)sqlite3_last_insert_rowid(g_db), USER_ADMIN, USER_PRIVATE};
+                    userdir_put(&info, initial_user);
                     fprintf(stderr,
                             "[auth] Initial admin created: username='%s' password='%s' (CHANGE IT!)\n",
                             initial_user, initial_pass);
                 }
-                sqlite3_finalize(stmt);
+                storage_finalize(stmt);
             } else {
                 fprintf(stderr, "[auth] prepare insert initial admin failed: %s\n", sqlite3_errmsg(g_db));
             }
@@ -100,33 +82,9 @@ static void init_auth_once()
     pthread_mutex_unlock(&db_mutex);
 }
 
-static int db_find_user_id_by_name(const char *username)
+static void init_auth_once(void)
 {
-    const char *sql = "SELECT id FROM users WHERE name = ? LIMIT 1;";
-    sqlite3_stmt *stmt;
-    int id = -1;
-
-    pthread_mutex_lock(&db_mutex);
-
-    if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL) != SQLITE_OK)
-    {
-        fprintf(stderr, "[auth] prepare find user failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-
-    int rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW)
-        id = sqlite3_column_int(stmt, 0);
-    else if (rc != SQLITE_DONE)
-        fprintf(stderr, "[auth] find user error: %s\n", sqlite3_errmsg(g_db));
-
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-    return id;
+    pthread_once(&auth_once, init_auth_admin);
 }
 
 int auth_register(const char *username, const char *password)
@@ -136,7 +94,7 @@ int auth_register(const char *username, const char *password)
     if (!username || !password || username[0] == '\0' || password[0] == '\0')
         return AUTH_ERR_UNKNOWN;
 
-    if (db_find_user_id_by_name(username) >= 0)
+    if (userdir_find_id(username) >= 0)
         return AUTH_ERR_EXISTS;
 
     char hash[crypto_pwhash_STRBYTES];
@@ -161,7 +119,7 @@ int auth_register(const char *username, const char *password)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[auth] prepare insert user failed: %s\n", sqlite3_errmsg(g_db));
@@ -178,18 +136,26 @@ int auth_register(const char *username, const char *password)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[auth] insert user failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return AUTH_ERR_UNKNOWN;
     }
 
-    sqlite3_finalize(stmt);
+    struct UserInfo info = {(int)sqlite3_last_insert_rowid(g_db), USER_NORMAL, USER_PUBLIC};
+    userdir_put(&info, username);
+
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return AUTH_OK;
 }
 
-int auth_login(int client_fd, const char *username, const char *password)
+/*
+ * On success *token receives a resume token for RESUME, or an empty string
+ * when none could be issued (the login itself still stands).
+ */
+int auth_login(int client_fd, const char *username, const char *password,
+               char *token, size_t token_size)
 {
     init_auth_once();
 
@@ -203,11 +169,11 @@ int auth_login(int client_fd, const char *username, const char *password)
     int user_id = -1;
     char stored_hash[crypto_pwhash_STRBYTES];
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "[auth] prepare login failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+    if (storage_prepare(db, sql, &stmt) != SQLITE_OK) {
+        fprintf(stderr, "[auth] prepare login failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
         return AUTH_ERR_UNKNOWN;
     }
 
@@ -219,8 +185,8 @@ int auth_login(int client_fd, const char *username, const char *password)
         user_id = sqlite3_column_int(stmt, 0);
         const unsigned char *h = sqlite3_column_text(stmt, 1);
         if (!h) {
-            sqlite3_finalize(stmt);
-            pthread_mutex_unlock(&db_mutex);
+            storage_finalize(stmt);
+            storage_read_end(db);
             return AUTH_ERR_UNKNOWN;
         }
         strncpy(stored_hash, (const char *)h, sizeof(stored_hash) - 1);
@@ -228,20 +194,20 @@ int auth_login(int client_fd, const char *username, const char *password)
     }
     else if (rc == SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        storage_finalize(stmt);
+        storage_read_end(db);
         return AUTH_ERR_USER_NOT_FOUND;
     }
     else
     {
-        fprintf(stderr, "[auth] login select error: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[auth] login select error: %s\n", sqlite3_errmsg(db));
+        storage_finalize(stmt);
+        storage_read_end(db);
         return AUTH_ERR_UNKNOWN;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
 
     if (crypto_pwhash_str_verify(stored_hash, password, strlen(password)) != 0)
         return AUTH_ERR_WRONG_PASS;
@@ -249,11 +215,26 @@ int auth_login(int client_fd, const char *username, const char *password)
     if (sessions_set(client_fd, user_id) != 0)
         return AUTH_ERR_UNKNOWN;
 
+    if (token && token_size > 0 && sessions_token_issue(client_fd, user_id, token, token_size) != 0)
+        token[0] = '\0';
+
+    return AUTH_OK;
+}
+
+int auth_resume(int client_fd, const char *token)
+{
+    init_auth_once();
+
+    if (!token)
+        return AUTH_ERR_UNKNOWN;
+    if (sessions_token_resume(client_fd, token) < 0)
+        return AUTH_ERR_USER_NOT_FOUND;
     return AUTH_OK;
 }
 
 int auth_logout(int client_fd)
 {
+    sessions_token_revoke_fd(client_fd);
     if (sessions_clear(client_fd) != 0)
         return AUTH_ERR_UNKNOWN;
     return AUTH_OK;
@@ -268,7 +249,7 @@ int auth_get_user_id(int client_fd)
 int auth_get_user_id_by_name(const char *username)
 {
     init_auth_once();
-    return db_find_user_id_by_name(username);
+    return userdir_find_id(username);
 }
 
 int auth_get_username_by_id(int user_id, char *out, size_t out_size)
@@ -276,46 +257,7 @@ int auth_get_username_by_id(int user_id, char *out, size_t out_size)
     if (!out || out_size == 0)
         return -1;
 
-    const char *sql =
-        "SELECT name FROM users WHERE id = ? LIMIT 1;";
-
-    sqlite3_stmt *stmt;
-    int rc;
-
-    pthread_mutex_lock(&db_mutex);
-
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[auth] prepare get username by id failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_int(stmt, 1, user_id);
-
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW)
-    {
-        const unsigned char *name = sqlite3_column_text(stmt, 0);
-        if (name)
-        {
-            strncpy(out, (const char *)name, out_size - 1);
-            out[out_size - 1] = '\0';
-        }
-        else
-        {
-            out[0] = '\0';
-        }
-    }
-    else
-    {
-        out[0] = '\0';
-    }
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-
+    userdir_get_name(user_id, out, out_size);
     return 0;
 }
 
@@ -332,10 +274,17 @@ int auth_set_profile_visibility(int user_id, enum user_vis vis)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    if (storage_write_begin() < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[auth] prepare set vis failed: %s\n", sqlite3_errmsg(g_db));
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
@@ -347,12 +296,19 @@ int auth_set_profile_visibility(int user_id, enum user_vis vis)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[auth] set vis failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+    if (storage_write_end(timeline_refresh_author(user_id)) < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+    userdir_set_vis(user_id, vis);
     pthread_mutex_unlock(&db_mutex);
 
     return AUTH_OK;
@@ -362,41 +318,10 @@ int auth_is_admin(int user_id)
 {
     if (user_id <= 0) return -1;
 
-    const char *sql =
-        "SELECT type FROM users WHERE id = ? LIMIT 1;";
-
-    sqlite3_stmt *stmt;
-    int rc;
-    int is_admin = 0;
-
-    pthread_mutex_lock(&db_mutex);
-
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[auth] prepare is_admin failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_int(stmt, 1, user_id);
-
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW)
-    {
-        int type = sqlite3_column_int(stmt, 0);
-        is_admin = (type == USER_ADMIN) ? 1 : 0;
-    }
-    else if (rc != SQLITE_DONE)
-    {
-        fprintf(stderr, "[auth] is_admin select error: %s\n", sqlite3_errmsg(g_db));
-        is_admin = -1;
-    }
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-
-    return is_admin;
+    struct UserInfo info;
+    if (userdir_get(user_id, &info) < 0)
+        return 0;
+    return info.type == USER_ADMIN ? 1 : 0;
 }
 
 int auth_make_admin(int requester_id, const char *target_username)
@@ -413,10 +338,11 @@ int auth_make_admin(int requester_id, const char *target_username)
 
     sqlite3_stmt *stmt;
     int rc;
+    int target_id = auth_get_user_id_by_name(target_username);
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[auth] prepare make_admin failed: %s\n", sqlite3_errmsg(g_db));
@@ -431,13 +357,15 @@ int auth_make_admin(int requester_id, const char *target_username)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[auth] make_admin update failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return AUTH_ERR_UNKNOWN;
     }
 
     int changes = sqlite3_changes(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+    if (changes > 0 && target_id > 0)
+        userdir_set_type(target_id, USER_ADMIN);
     pthread_mutex_unlock(&db_mutex);
 
     if (changes == 0)
@@ -459,13 +387,21 @@ int auth_delete_user(int requester_id, const char *target_username)
 
     sqlite3_stmt *stmt;
     int rc;
+    int target_id = auth_get_user_id_by_name(target_username);
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    if (storage_write_begin() < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return AUTH_ERR_UNKNOWN;
+    }
+
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[auth] prepare delete_user failed: %s\n", sqlite3_errmsg(g_db));
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return AUTH_ERR_UNKNOWN;
     }
@@ -476,13 +412,26 @@ int auth_delete_user(int requester_id, const char *target_username)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[auth] delete_user failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return AUTH_ERR_UNKNOWN;
     }
 
     int changes = sqlite3_changes(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+
+    rc = (changes > 0 && target_id > 0) ? timeline_remove_user(target_id) : 0;
+    if (storage_write_end(rc) < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return AUTH_ERR_UNKNOWN;
+    }
+    if (changes > 0 && target_id > 0)
+    {
+        userdir_remove(target_id);
+        sessions_token_revoke_user(target_id);
+    }
     pthread_mutex_unlock(&db_mutex);
 
     if (changes == 0)
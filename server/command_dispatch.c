@@ -5,7 +5,7 @@
 #include "friends.h"
 #include "messages.h"
 #include "posts.h"
-#include "utils_client.h"
+#include "buffer.h"
 #include "protocol.h"
 #include "groups.h"
 #include "server.h"
@@ -13,1254 +13,1278 @@
 #include "sessions.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "response.h"
 #include "helpers.h"
 #include "notifications.h"
+#include "connections.h"
+#include "timeline.h"
+#include "hash_pool.h"
+#include "userdir.h"
+#include "arena.h"
+#include "worker_pool.h"
+
+/*
+ * Scratch memory for the running command, reset after it. It belongs to the
+ * worker thread rather than the connection so that two requests of one framed
+ * connection can run at the same time; each worker keeps one chunk for the
+ * next command.
+ */
+static _Thread_local struct Arena t_scratch;
+
+enum posts_listing
+{
+    POSTS_PUBLIC,
+    POSTS_FEED,
+    POSTS_USER
+};
+
+/*
+ * Streams one POSTS_PAGE_SIZE page after the cursor straight from the query
+ * into the response. A full page carries a NEXT token pointing at its last
+ * post so the client can continue.
+ */
+static void send_posts_page(struct Conn *conn, enum posts_listing which, int user_id, int target_id,
+                            const struct PostCursor *after)
+{
+    struct PostPage pg;
+    int count;
+
+    posts_page_begin(&pg, conn->fd, conn->output);
 
-void command_dispatch(int client)
+    if (which == POSTS_PUBLIC)
+        count = posts_for_each_public(after, POSTS_PAGE_SIZE, posts_page_row, &pg);
+    else if (which == POSTS_FEED)
+        count = posts_for_each_feed(user_id, after, POSTS_PAGE_SIZE, posts_page_row, &pg);
+    else
+        count = posts_for_each_of_user(user_id, target_id, after, POSTS_PAGE_SIZE, posts_page_row, &pg);
+
+    if (count < 0 && pg.count == 0)
+    {
+        char response[256];
+        build_error(response, sizeof(response), ERR_INTERNAL,
+                    which == POSTS_USER ? "Could not load user posts." : "Public feed failed");
+        conn_send(conn->fd, response, strlen(response));
+        return;
+    }
+
+    posts_page_end(&pg, POSTS_PAGE_SIZE, count < 0);
+}
+
+/*
+ * Brings conn->me in line with the session table and the user directory.
+ * When neither changed since the last command this is two atomic loads; a
+ * login, logout, promotion, visibility change or deletion makes it copy the
+ * user's record again. A session whose user no longer exists counts as
+ * logged out.
+ */
+static const struct ConnIdentity *identity_refresh(struct Conn *conn)
 {
-    char buffer[MAX_CMD_LEN];
-    char response[MAX_CONTENT_LEN];
+    struct ConnIdentity *me = &conn->me;
+    int user_id = auth_get_user_id(conn->fd);
+    unsigned version = userdir_version();
 
-    while (1)
+    if (user_id == me->user_id && version == me->version)
+        return me;
+
+    struct UserInfo info;
+    if (user_id <= 0 || userdir_get(user_id, &info) < 0)
     {
-        int n = read(client, buffer, sizeof(buffer) - 1);
-        if (n < 0)
-        {
-            perror("[server] read");
-            break;
-        }
+        memset(me, 0, sizeof(*me));
+        me->user_id = -1;
+    }
+    else
+    {
+        me->user_id = user_id;
+        me->admin = info.type == USER_ADMIN;
+        me->vis = info.vis;
+        userdir_get_name(user_id, me->username, sizeof(me->username));
+    }
+    me->version = version;
+    return me;
+}
+
+/*
+ * REGISTER and LOGIN spend most of their time in Argon2, so they run on the
+ * hashing pool instead of a command worker. The arguments are copied, the
+ * connection parks, and the hashing thread answers and resumes it, which
+ * keeps the client's later commands in order behind the login.
+ */
+struct AuthRequest
+{
+    struct Conn *conn;
+    struct FrameReply *reply;   /* binary request being answered, NULL for a line */
+    int   login;
+    char *username;
+    char *password;
+};
+
+static void auth_request_free(struct AuthRequest *req)
+{
+    if (req->password)
+    {
+        sodium_memzero(req->password, strlen(req->password));
+        free(req->password);
+    }
+    free(req->username);
+    free(req);
+}
+
+static void auth_request_run(void *arg)
+{
+    struct AuthRequest *req = (struct AuthRequest *)arg;
+    struct Conn *conn = req->conn;
+    char response[256];
 
-        if (n == 0)
+    if (req->login)
+    {
+        char token[SESSION_TOKEN_HEX];
+        int ok = auth_login(conn->fd, req->username, req->password, token, sizeof(token));
+        identity_refresh(conn);
+        if (ok == 0 && token[0])
         {
-            printf("[server] client disconnected\n");
-            break;
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Login successful TOKEN %s", token);
+            build_ok(response, sizeof(response), msg);
         }
+        else if (ok == 0)
+            build_ok(response, sizeof(response), "Login successful");
+        else if (ok == 1)
+            build_error(response, sizeof(response), ERR_USER_EXISTS, "User already exists");
+        else
+            build_error(response, sizeof(response), ERR_INTERNAL, "Login failed");
+    }
+    else
+    {
+        int ok = auth_register(req->username, req->password);
+        if (ok == 0)
+            build_ok(response, sizeof(response), "Register successful");
+        else if (ok == 1)
+            build_error(response, sizeof(response), ERR_USER_EXISTS, "User already exists");
+        else
+            build_error(response, sizeof(response), ERR_INTERNAL, "Register failed");
+    }
 
-        buffer[n] = '\0';
+    conn_reply_attach(req->reply);
+    conn_send(conn->fd, response, strlen(response));
+    conn_reply_close(req->reply);
+    auth_request_free(req);
+    server_resume(conn);
+}
 
-        printf("[Thread]Message received...%s\n", buffer);
+static int auth_request_submit(struct Conn *conn, int login, const char *username, const char *password)
+{
+    struct AuthRequest *req = calloc(1, sizeof(*req));
+    if (!req)
+        return -1;
+
+    req->conn = conn;
+    req->login = login;
+    req->username = username ? strdup(username) : NULL;
+    req->password = password ? strdup(password) : NULL;
+    req->reply = conn_reply_detach();
+
+    if ((username && !req->username) || (password && !req->password) ||
+        hash_pool_submit(conn->addr, auth_request_run, req) < 0)
+    {
+        conn_reply_attach(req->reply);
+        auth_request_free(req);
+        return -1;
+    }
+    return 0;
+}
 
-        char *cmd = NULL;
-        char *arg1 = NULL;
-        char *arg2 = NULL;
-        Parser(buffer, &cmd, &arg1, &arg2);
+static int reply_error(int client, const char *code, const char *msg)
+{
+    char response[512];
+    build_error(response, sizeof(response), code, msg);
+    conn_send(client, response, strlen(response));
+    return DISPATCH_DONE;
+}
 
-        printf("%s, %s, %s\n", cmd, arg1, arg2);
+static int reply_ok(int client, const char *msg)
+{
+    char response[512];
+    build_ok(response, sizeof(response), msg);
+    conn_send(client, response, strlen(response));
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_REGISTER) == 0)
-        {
-            int ok = auth_register(arg1, arg2);
-            if (ok == 0)
-                build_ok(response, sizeof(response), "Register successful");
-            else if (ok == 1)
-                build_error(response, sizeof(response), ERR_USER_EXISTS, "User already exists");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Register failed");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static int reply_info(int client, const char *msg)
+{
+    char response[512];
+    build_info(response, sizeof(response), msg);
+    conn_send(client, response, strlen(response));
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_LOGIN) == 0)
-        {
-            int ok = auth_login(client, arg1, arg2);
-            if (ok == 0)
-                build_ok(response, sizeof(response), "Login successful");
-            else if (ok == 1)
-                build_error(response, sizeof(response), ERR_USER_EXISTS, "User already exists");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Login failed");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_auth(struct Conn *conn, int login, char *arg1, char *arg2)
+{
+    if (auth_request_submit(conn, login, arg1, arg2) == 0)
+        return DISPATCH_PARKED;
 
-        if (strcmp(cmd, CMD_LOGOUT) == 0)
-        {
-            int ok = auth_logout(client);
-            if (ok == 0)
-                build_ok(response, sizeof(response), "Logout successful");
-            else
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "Not auth");
+    return reply_error(conn->fd, ERR_SERVER_BUSY, "Too many logins in progress, try again later.");
+}
 
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_register_user(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me;
+    return cmd_auth(conn, 0, arg1, arg2);
+}
 
-        if (strcmp(cmd, CMD_POST) == 0)
-        {
-            int author_id = auth_get_user_id(client);
-            if (author_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "Not auth");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int vis = 0;
-            if (arg1 && strcmp(arg1, "public") == 0) vis = 0;
-            else if (arg1 && strcmp(arg1, "friends") == 0) vis = 1;
-            else if (arg1 && strcmp(arg1, "close") == 0) vis = 2;
-
-            int ok = posts_add(author_id, vis, arg2);
-
-            if (ok >= 0)
-                build_ok(response, sizeof(response), "Posts successful");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Posts failed");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_login(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me;
+    return cmd_auth(conn, 1, arg1, arg2);
+}
 
-        if (strcmp(cmd, CMD_VIEW_PUBLIC_POSTS) == 0)
-        {
-            struct Post out_array[MAX_POSTS];
-            int count = posts_get_public(out_array, MAX_POSTS);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Public feed failed");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            posts_send_for_client(client, out_array, count);
-            continue;
-        }
+static int cmd_resume(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me;
+    if (arg2)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: RESUME <token>");
+
+    int ok = auth_resume(conn->fd, arg1);
+    identity_refresh(conn);
+    if (ok == 0)
+        return reply_ok(conn->fd, "Session resumed");
+    return reply_error(conn->fd, ERR_NOT_AUTH, "Invalid or expired token.");
+}
 
-        if (strcmp(cmd, CMD_VIEW_FEED) == 0)
-        {
-            struct Post out_array[MAX_POSTS];
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int count = posts_get_feed_for_user(user_id, out_array, MAX_POSTS);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Public feed failed");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            posts_send_for_client(client, out_array, count);
-            continue;
-        }
+static int cmd_logout(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me; (void)arg1; (void)arg2;
+    int ok = auth_logout(conn->fd);
+    identity_refresh(conn);
+    if (ok == 0)
+        return reply_ok(conn->fd, "Logout successful");
+    return reply_error(conn->fd, ERR_NOT_AUTH, "Not auth");
+}
 
-        if (strcmp(cmd, CMD_SEND_MESSAGE) == 0)
-        {
-            int sender_id = auth_get_user_id(client);
-            if (sender_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char sender_name[64];
-            int ok = auth_get_username_by_id(sender_id, sender_name, sizeof(sender_name));
-            if (ok < 0)
-            {
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "Sender doesn't exist.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int target_id = auth_get_user_id_by_name(arg1);
-            if (target_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User doesn't exist.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int conv_id = messages_find_or_create_dm(sender_id, target_id);
-            if (conv_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Internal error (msg).");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int msg_id = messages_add(conv_id, sender_id, arg2);
-            if (msg_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Internal error at (msg).");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char payload[1800];
-            snprintf(payload, sizeof(payload), "%s", sender_name);
-            char notif[2048];
-            build_notif(notif, sizeof(notif), "DM", payload);
-            notify_user(target_id, notif);
-
-            build_ok(response, sizeof(response), "Message sent");
-            write(client, response, strlen(response));
-            continue;
-        }
+/*
+ * HELLO lists what the server speaks; HELLO BINARY switches the connection
+ * to frames (see frames.h) right after this reply line.
+ */
+static int cmd_hello(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me;
+    if (!arg1)
+        return reply_ok(conn->fd, "HELLO TEXT BINARY");
+    if (arg2 || strcmp(arg1, "BINARY") != 0)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: HELLO [BINARY]");
+    if (conn->framed)
+        return reply_ok(conn->fd, "HELLO BINARY");
+
+    char response[64];
+    build_ok(response, sizeof(response), "HELLO BINARY");
+    conn_set_framed(conn, response, strlen(response));
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_LIST_MESSAGES) == 0)
-        {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int target_id = auth_get_user_id_by_name(arg1);
-            if (target_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User doesn't exist.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct Message msgs[MAX_MESSAGE_LIST];
-            int count = messages_get_history_dm(me_id, target_id, msgs, MAX_MESSAGE_LIST);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Internal error (msg).");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            messages_send_for_client(client, msgs, count, me_id);
-            continue;
-        }
+/* Only the layout of listings changes; plain OK/ERROR/INFO/NOTIF lines look the same in both. */
+static int cmd_output(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me;
+    if (arg2)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: OUTPUT <PRETTY|COMPACT>");
+
+    if (strcmp(arg1, "PRETTY") == 0)
+        conn->output = OUTPUT_PRETTY;
+    else if (strcmp(arg1, "COMPACT") == 0)
+        conn->output = OUTPUT_COMPACT;
+    else
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: OUTPUT <PRETTY|COMPACT>");
+
+    return reply_ok(conn->fd, conn->output == OUTPUT_COMPACT ? "Output mode COMPACT" : "Output mode PRETTY");
+}
 
-        if (strcmp(cmd, CMD_ADD_FRIEND) == 0)
-        {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: ADD_FRIEND <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int other_id = auth_get_user_id_by_name(arg1);
-            if (other_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User doesn't exist.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int acc = friends_request_accept(me_id, arg1);
-            if (acc == 1)
-            {
-                build_ok(response, sizeof(response), "Friend request accepted.");
-                write(client, response, strlen(response));
-
-                char me_name[64];
-                if (auth_get_username_by_id(me_id, me_name, sizeof(me_name)) >= 0)
-                {
-                    char payload[256];
-                    snprintf(payload, sizeof(payload), "%s", me_name);
-
-                    char notif[512];
-                    build_notif(notif, sizeof(notif), "FRIEND_ACCEPTED", payload);
-                    notify_user(other_id, notif);
-                }
-
-                continue;
-            }
-            if (acc == 2)
-            {
-                build_info(response, sizeof(response), "Already friends.");
-                write(client, response, strlen(response));
-                continue;
-            }
-            if (acc < 0 && acc != 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Internal error.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = friends_request_send(me_id, other_id);
-
-            if (rc == 0)
-            {
-                build_ok(response, sizeof(response), "Friend request sent.");
-                write(client, response, strlen(response));
-
-                char me_name[64];
-                if (auth_get_username_by_id(me_id, me_name, sizeof(me_name)) >= 0)
-                {
-                    char payload[256];
-                    snprintf(payload, sizeof(payload), "%s", me_name);
-
-                    char notif[512];
-                    build_notif(notif, sizeof(notif), "FRIEND_REQUEST", payload);
-                    notify_user(other_id, notif);
-                }
-                continue;
-            }
-
-            if (rc == 1) build_info(response, sizeof(response), "Already friends.");
-            else if (rc == 2) build_info(response, sizeof(response), "Request already pending.");
-            else if (rc == 3) build_info(response, sizeof(response),
-                                         "They already requested you. Use add <user> to accept.");
-            else build_error(response, sizeof(response), ERR_INTERNAL, "Could not create request.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_post(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int vis = 0;
+    if (strcmp(arg1, "public") == 0) vis = 0;
+    else if (strcmp(arg1, "friends") == 0) vis = 1;
+    else if (strcmp(arg1, "close") == 0) vis = 2;
+
+    if (posts_add(me->user_id, vis, arg2) >= 0)
+        return reply_ok(conn->fd, "Posts successful");
+    return reply_error(conn->fd, ERR_INTERNAL, "Posts failed");
+}
+
+static int cmd_view_public_posts(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)me; (void)arg2;
+    struct PostCursor after;
+    if (arg1 && posts_cursor_parse(arg1, &after) < 0)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Invalid cursor.");
 
+    send_posts_page(conn, POSTS_PUBLIC, -1, -1, arg1 ? &after : NULL);
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_LIST_FRIENDS) == 0)
-        {
-            struct Friendship out_friends[MAX_FRIENDS_LIST];
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int count = friends_list_for_user(user_id, out_friends, MAX_FRIENDS_LIST);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Friends list failed");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            format_friends_for_client(response, sizeof(response), out_friends, count, user_id);
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_view_feed(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    struct PostCursor after;
+    if (arg1 && posts_cursor_parse(arg1, &after) < 0)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Invalid cursor.");
 
-        if (strcmp(cmd, CMD_SET_PROFILE_VIS) == 0)
-        {
-            enum user_vis vis;
-            if (arg1 && strcmp(arg1, "PUBLIC") == 0) vis = USER_PUBLIC;
-            else if (arg1 && strcmp(arg1, "PRIVATE") == 0) vis = USER_PRIVATE;
-            else
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: SET_PROFILE_VIS <PUBLIC|PRIVATE>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int ok = auth_set_profile_visibility(user_id, vis);
-            if (ok < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not update profile visibility.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            build_ok(response, sizeof(response), "Profile visibility updated");
-            write(client, response, strlen(response));
-            continue;
-        }
+    send_posts_page(conn, POSTS_FEED, me->user_id, -1, arg1 ? &after : NULL);
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_MAKE_ADMIN) == 0)
-        {
-            int requester_id = auth_get_user_id(client);
-            if (requester_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int ok = auth_make_admin(requester_id, arg1);
-            if (ok == AUTH_ERR_NOT_ADMIN)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not admin.");
-            else if (ok == AUTH_ERR_USER_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-            else if (ok != AUTH_OK)
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not promote user.");
-            else
-                build_ok(response, sizeof(response), "User promoted to admin.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_send_message(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int client = conn->fd;
 
-        if (strcmp(cmd, CMD_DELETE_USER) == 0)
-        {
-            int requester_id = auth_get_user_id(client);
-            if (requester_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int ok = auth_delete_user(requester_id, arg1);
-            if (ok == AUTH_ERR_NOT_ADMIN)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not admin.");
-            else if (ok == AUTH_ERR_USER_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-            else if (ok != AUTH_OK)
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not remove user.");
-            else
-                build_ok(response, sizeof(response), "User deleted.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    int target_id = auth_get_user_id_by_name(arg1);
+    if (target_id < 0)
+        return reply_error(client, ERR_USER_NOT_FOUND, "User doesn't exist.");
 
-        if (strcmp(cmd, CMD_DELETE_POST) == 0)
-        {
-            int requester_id = auth_get_user_id(client);
-            if (requester_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int post_id = arg1 ? atoi(arg1) : 0;
-            int ok = posts_delete(requester_id, post_id);
-
-            if (ok == 1)
-                build_ok(response, sizeof(response), "Post deleted.");
-            else if (ok == 0)
-                build_error(response, sizeof(response), ERR_POST_NOT_FOUND, "Post not found.");
-            else if (ok == -2)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION,
-                            "You can only delete your own posts (unless you are admin).");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not delete post.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    int conv_id = messages_find_or_create_dm(me->user_id, target_id);
+    if (conv_id < 0)
+        return reply_error(client, ERR_INTERNAL, "Internal error (msg).");
 
-        if (strcmp(cmd, CMD_VIEW_USER_POSTS) == 0)
-        {
-            const char *target_username = arg1;
-            int viewer_id = auth_get_user_id(client);
-
-            int target_id = auth_get_user_id_by_name(target_username);
-            if (target_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct Post posts[MAX_POSTS];
-            int count = posts_get_for_user(viewer_id, target_id, posts, MAX_POSTS);
-
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not load user posts.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            posts_send_for_client(client, posts, count);
-            continue;
-        }
+    if (messages_add(conv_id, me->user_id, arg2) < 0)
+        return reply_error(client, ERR_INTERNAL, "Internal error at (msg).");
 
-        if (strcmp(cmd, CMD_DELETE_FRIEND) == 0)
-        {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int ok = friends_delete(user_id, arg1);
-            if (ok == 1)
-                build_ok(response, sizeof(response), "Friendship deleted.");
-            else if (ok == 0)
-                build_error(response, sizeof(response), ERR_FRIENDSHIP_NOT_FOUND, "You are not friends.");
-            else if (ok == -2)
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Failed to delete friendship.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    char payload[1800];
+    snprintf(payload, sizeof(payload), "%s", me->username);
+    char notif[2048];
+    build_notif(notif, sizeof(notif), "DM", payload);
+    notify_user(target_id, notif);
 
-        if (strcmp(cmd, CMD_SET_FRIEND_STATUS) == 0)
-        {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int friend_id = auth_get_user_id_by_name(arg1);
-            if (friend_id <= 0)
-            {
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            enum friend_type new_type;
-            if (arg2 && strcmp(arg2, "NORMAL") == 0) new_type = FRIEND_NORMAL;
-            else if (arg2 && strcmp(arg2, "CLOSE") == 0) new_type = FRIEND_CLOSE;
-            else
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: SET_FRIEND_STATUS <user> <NORMAL|CLOSE>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = friends_change_status(me_id, friend_id, new_type);
-            if (rc < 0)
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not change friend status.");
-            else if (rc == 0)
-                build_error(response, sizeof(response), ERR_FRIENDSHIP_NOT_FOUND,
-                            "You are not friends in this direction yet. Use add <user> first.");
-            else
-                build_ok(response, sizeof(response), "Friend status updated.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    return reply_ok(client, "Message sent");
+}
 
-        if (strcmp(cmd, CMD_CREATE_GROUP) == 0)
-        {
-            if (!arg1 || !arg2)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: CREATE_GROUP <name> <PUBLIC|PRIVATE>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int owner_id = auth_get_user_id(client);
-            if (owner_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int is_public;
-            if (strcmp(arg2, "PUBLIC") == 0) is_public = 1;
-            else if (strcmp(arg2, "PRIVATE") == 0) is_public = 0;
-            else
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Visibility must be PUBLIC or PRIVATE.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_create(owner_id, arg1, is_public);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "Group created.");
-            else if (rc == GROUP_ERR_EXISTS)
-                build_error(response, sizeof(response), ERR_INTERNAL, "Group already exists.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not create group.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static int cmd_list_messages(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int client = conn->fd;
 
-        if (strcmp(cmd, CMD_JOIN_GROUP) == 0)
-        {
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: JOIN_GROUP <group_name>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_join_public(user_id, arg1);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "Joined group.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-            else if (rc == GROUP_ERR_NOT_PUBLIC)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "Group is private. Use REQUEST_GROUP.");
-            else if (rc == GROUP_ERR_ALREADY_MEMBER)
-                build_error(response, sizeof(response), ERR_INTERNAL, "You are already a member.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not join group.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    int target_id = auth_get_user_id_by_name(arg1);
+    if (target_id < 0)
+        return reply_error(client, ERR_USER_NOT_FOUND, "User doesn't exist.");
 
-        if (strcmp(cmd, CMD_REQUEST_GROUP) == 0)
-        {
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: REQUEST_GROUP <group_name>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_request_join(user_id, arg1);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "Join request sent.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-            else if (rc == GROUP_ERR_ALREADY_MEMBER)
-                build_error(response, sizeof(response), ERR_INTERNAL, "You are already a member.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not send join request.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    /* arg2 = "[before_id] [limit]" */
+    long before_id = 0;
+    long limit = MESSAGE_PAGE_SIZE;
+    if (arg2)
+    {
+        char *end;
+        before_id = strtol(arg2, &end, 10);
+        while (*end == ' ')
+            end++;
+        if (*end)
+            limit = strtol(end, &end, 10);
+
+        if (*end || before_id < 0 || before_id > INT_MAX || limit <= 0)
+            return reply_error(client, ERR_BAD_ARGS, "Usage: LIST_MESSAGES <user> [before_id] [limit]");
+        if (limit > MAX_MESSAGE_LIST)
+            limit = MAX_MESSAGE_LIST;
+    }
 
-        if (strcmp(cmd, CMD_APPROVE_GROUP_MEMBER) == 0)
-        {
-            if (!arg1 || !arg2)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: APPROVE_GROUP_MEMBER <group_name> <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int admin_id = auth_get_user_id(client);
-            if (admin_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_approve_member(admin_id, arg1, arg2);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "Member approved.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group or user/request not found.");
-            else if (rc == GROUP_ERR_NOT_ADMIN)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not group admin/owner.");
-            else if (rc == GROUP_ERR_NO_REQUEST)
-                build_error(response, sizeof(response), ERR_REQ_NOT_FOUND, "No pending join request for this user.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not approve member.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+    struct MessagePage pg;
+    messages_page_begin(&pg, client, conn->output, me->user_id, NULL);
 
-        if (strcmp(cmd, CMD_SEND_GROUP_MSG) == 0)
-        {
-            if (!arg1 || !arg2)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: SEND_GROUP_MSG <group_name> <message...>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            const char *group_name = arg1;
-            const char *text = arg2;
-
-            int sender_id = auth_get_user_id(client);
-            if (sender_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char sender_name[64];
-            if (auth_get_username_by_id(sender_id, sender_name, sizeof(sender_name)) < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not resolve sender name.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_send_group_msg(sender_id, group_name, text);
-
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "Group message sent.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-            else if (rc == GROUP_ERR_NO_PERMISSION)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not a member of this group.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not send group message.");
-
-            write(client, response, strlen(response));
-
-            if (rc != GROUP_OK)
-                continue;
-
-            int member_ids[2048];
-            int member_count = groups_list_member_ids(group_name, member_ids,
-                                                      (int) (sizeof(member_ids) / sizeof(member_ids[0])));
-            if (member_count < 0)
-                continue;
-
-            for (int i = 0; i < member_count; i++)
-            {
-                int uid = member_ids[i];
-                if (uid == sender_id) continue;
-
-                char payload[1800];
-                snprintf(payload, sizeof(payload), "%s %s", group_name, sender_name);
-
-                char notif[2048];
-                build_notif(notif, sizeof(notif), "GROUP_MSG", payload);
-                notify_user(uid, notif);
-            }
+    int count = messages_for_each_dm(me->user_id, target_id, (int)before_id, (int)limit,
+                                     messages_page_row, &pg);
+    if (count < 0 && pg.count == 0)
+        return reply_error(client, ERR_INTERNAL, "Internal error (msg).");
 
-            continue;
-        }
+    messages_page_end(&pg, (int)limit, count < 0);
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_LEAVE_GROUP) == 0)
-        {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: LEAVE_GROUP <group_name>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_leave(user_id, arg1);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "You have left the group.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group does not exist.");
-            else if (rc == GROUP_ERR_NO_PERMISSION)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not a member of this group.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not leave the group.");
-
-            write(client, response, strlen(response));
-            continue;
-        }
+static void notify_friend_event(const struct ConnIdentity *me, int other_id, const char *type)
+{
+    char payload[256];
+    snprintf(payload, sizeof(payload), "%s", me->username);
 
-        if (strcmp(cmd, CMD_MEMBERS_GROUP) == 0)
+    char notif[512];
+    build_notif(notif, sizeof(notif), type, payload);
+    notify_user(other_id, notif);
+}
+
+static int cmd_add_friend(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int client = conn->fd;
+
+    int other_id = auth_get_user_id_by_name(arg1);
+    if (other_id < 0)
+        return reply_error(client, ERR_USER_NOT_FOUND, "User doesn't exist.");
+
+    int acc = friends_request_accept(me->user_id, arg1);
+    if (acc == 1)
+    {
+        reply_ok(client, "Friend request accepted.");
+        notify_friend_event(me, other_id, "FRIEND_ACCEPTED");
+        return DISPATCH_DONE;
+    }
+    if (acc == 2)
+        return reply_info(client, "Already friends.");
+    if (acc < 0)
+        return reply_error(client, ERR_INTERNAL, "Internal error.");
+
+    int rc = friends_request_send(me->user_id, other_id);
+    if (rc == 0)
+    {
+        reply_ok(client, "Friend request sent.");
+        notify_friend_event(me, other_id, "FRIEND_REQUEST");
+        return DISPATCH_DONE;
+    }
+
+    if (rc == 1) return reply_info(client, "Already friends.");
+    if (rc == 2) return reply_info(client, "Request already pending.");
+    if (rc == 3) return reply_info(client, "They already requested you. Use add <user> to accept.");
+    return reply_error(client, ERR_INTERNAL, "Could not create request.");
+}
+
+static int cmd_list_friends(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg1; (void)arg2;
+    struct Friendship *out_friends;
+    int count = friends_list_for_user(me->user_id, &t_scratch, MAX_FRIENDS_LIST, &out_friends);
+    if (count < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Friends list failed");
+
+    friends_send_for_client(conn->fd, conn->output, out_friends, count, me->user_id);
+    return DISPATCH_DONE;
+}
+
+static int cmd_set_profile_vis(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    enum user_vis vis;
+    if (strcmp(arg1, "PUBLIC") == 0) vis = USER_PUBLIC;
+    else if (strcmp(arg1, "PRIVATE") == 0) vis = USER_PRIVATE;
+    else
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: SET_PROFILE_VIS <PUBLIC|PRIVATE>");
+
+    if (auth_set_profile_visibility(me->user_id, vis) < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not update profile visibility.");
+    return reply_ok(conn->fd, "Profile visibility updated");
+}
+
+static int cmd_make_admin(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int ok = auth_make_admin(me->user_id, arg1);
+    if (ok == AUTH_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not admin.");
+    if (ok == AUTH_ERR_USER_NOT_FOUND)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+    if (ok != AUTH_OK)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not promote user.");
+    return reply_ok(conn->fd, "User promoted to admin.");
+}
+
+static int cmd_delete_user(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int ok = auth_delete_user(me->user_id, arg1);
+    if (ok == AUTH_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not admin.");
+    if (ok == AUTH_ERR_USER_NOT_FOUND)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+    if (ok != AUTH_OK)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not remove user.");
+    return reply_ok(conn->fd, "User deleted.");
+}
+
+static int cmd_rebuild_timelines(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg1; (void)arg2;
+    if (!me->admin)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not admin.");
+    if (timeline_rebuild_all() < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not rebuild timelines.");
+    return reply_ok(conn->fd, "Timelines rebuilt.");
+}
+
+static int cmd_delete_post(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int ok = posts_delete(me->user_id, atoi(arg1));
+    if (ok == 1)
+        return reply_ok(conn->fd, "Post deleted.");
+    if (ok == 0)
+        return reply_error(conn->fd, ERR_POST_NOT_FOUND, "Post not found.");
+    if (ok == -2)
+        return reply_error(conn->fd, ERR_NO_PERMISSION,
+                           "You can only delete your own posts (unless you are admin).");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not delete post.");
+}
+
+static int cmd_view_user_posts(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int target_id = auth_get_user_id_by_name(arg1);
+    if (target_id < 0)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+
+    struct PostCursor after;
+    if (arg2 && posts_cursor_parse(arg2, &after) < 0)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Invalid cursor.");
+
+    send_posts_page(conn, POSTS_USER, me->user_id, target_id, arg2 ? &after : NULL);
+    return DISPATCH_DONE;
+}
+
+static int cmd_delete_friend(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int ok = friends_delete(me->user_id, arg1);
+    if (ok == 1)
+        return reply_ok(conn->fd, "Friendship deleted.");
+    if (ok == 0)
+        return reply_error(conn->fd, ERR_FRIENDSHIP_NOT_FOUND, "You are not friends.");
+    if (ok == -2)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Failed to delete friendship.");
+}
+
+static int cmd_set_friend_status(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int friend_id = auth_get_user_id_by_name(arg1);
+    if (friend_id <= 0)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+
+    enum friend_type new_type;
+    if (strcmp(arg2, "NORMAL") == 0) new_type = FRIEND_NORMAL;
+    else if (strcmp(arg2, "CLOSE") == 0) new_type = FRIEND_CLOSE;
+    else
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: SET_FRIEND_STATUS <user> <NORMAL|CLOSE>");
+
+    int rc = friends_change_status(me->user_id, friend_id, new_type);
+    if (rc < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not change friend status.");
+    if (rc == 0)
+        return reply_error(conn->fd, ERR_FRIENDSHIP_NOT_FOUND,
+                           "You are not friends in this direction yet. Use add <user> first.");
+    return reply_ok(conn->fd, "Friend status updated.");
+}
+
+static int cmd_create_group(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int is_public;
+    if (strcmp(arg2, "PUBLIC") == 0) is_public = 1;
+    else if (strcmp(arg2, "PRIVATE") == 0) is_public = 0;
+    else
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Visibility must be PUBLIC or PRIVATE.");
+
+    int rc = groups_create(me->user_id, arg1, is_public);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, "Group created.");
+    if (rc == GROUP_ERR_EXISTS)
+        return reply_error(conn->fd, ERR_INTERNAL, "Group already exists.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not create group.");
+}
+
+static int cmd_join_group(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int rc = groups_join_public(me->user_id, arg1);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, "Joined group.");
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (rc == GROUP_ERR_NOT_PUBLIC)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "Group is private. Use REQUEST_GROUP.");
+    if (rc == GROUP_ERR_ALREADY_MEMBER)
+        return reply_error(conn->fd, ERR_INTERNAL, "You are already a member.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not join group.");
+}
+
+static int cmd_request_group(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int rc = groups_request_join(me->user_id, arg1);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, "Join request sent.");
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (rc == GROUP_ERR_ALREADY_MEMBER)
+        return reply_error(conn->fd, ERR_INTERNAL, "You are already a member.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not send join request.");
+}
+
+static int cmd_approve_group_member(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int rc = groups_approve_member(me->user_id, arg1, arg2);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, "Member approved.");
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group or user/request not found.");
+    if (rc == GROUP_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not group admin/owner.");
+    if (rc == GROUP_ERR_NO_REQUEST)
+        return reply_error(conn->fd, ERR_REQ_NOT_FOUND, "No pending join request for this user.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not approve member.");
+}
+
+static int cmd_send_group_msg(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int client = conn->fd;
+    const char *group_name = arg1;
+    const char *text = arg2;
+
+    int rc = groups_send_group_msg(me->user_id, group_name, text);
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(client, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (rc == GROUP_ERR_NO_PERMISSION)
+        return reply_error(client, ERR_NO_PERMISSION, "You are not a member of this group.");
+    if (rc != GROUP_OK)
+        return reply_error(client, ERR_INTERNAL, "Could not send group message.");
+
+    reply_ok(client, "Group message sent.");
+
+    char payload[1800];
+    snprintf(payload, sizeof(payload), "%s %s", group_name, me->username);
+
+    char notif[2048];
+    build_notif(notif, sizeof(notif), "GROUP_MSG", payload);
+    notify_group(me->user_id, group_name, notif);
+
+    return DISPATCH_DONE;
+}
+
+static int cmd_leave_group(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int rc = groups_leave(me->user_id, arg1);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, "You have left the group.");
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group does not exist.");
+    if (rc == GROUP_ERR_NO_PERMISSION)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not a member of this group.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not leave the group.");
+}
+
+static const struct RenderTemplate MEMBER_ROW = { 2, {
+    RENDER_SEG(" - "),
+    RENDER_SEG(""),
+    RENDER_SEG("\n") } };
+
+/* user_id, username, ADMIN|MEMBER */
+static const struct RenderTemplate MEMBER_ROW_COMPACT = { 3, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static const struct RenderTemplate GROUP_ROW = { 3, {
+    RENDER_SEG(" - "),
+    RENDER_SEG(""),
+    RENDER_SEG(""),
+    RENDER_SEG("\n") } };
+
+/* group_id, name, PUBLIC|PRIVATE, ADMIN|MEMBER */
+static const struct RenderTemplate GROUP_ROW_COMPACT = { 4, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static const struct RenderTemplate JOIN_REQUEST_ROW = { 2, {
+    RENDER_SEG(" - "),
+    RENDER_SEG(" (uid: "),
+    RENDER_SEG(")\n") } };
+
+/* user_id, username */
+static const struct RenderTemplate REQUEST_ROW_COMPACT = { 2, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static const struct RenderTemplate FRIEND_REQUEST_ROW = { 1, {
+    RENDER_SEG(" - "),
+    RENDER_SEG("\n") } };
+
+/* from user_id, username, created_at */
+static const struct RenderTemplate FRIEND_REQUEST_ROW_COMPACT = { 3, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static int cmd_members_group(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    struct GroupMemberInfo *members;
+    int rc = groups_view_members(me->user_id, arg1, &t_scratch, 128, &members);
+
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (rc == GROUP_ERR_NO_PERMISSION)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not a member of this group.");
+    if (rc < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Internal error.");
+
+    int compact = conn->output == OUTPUT_COMPACT;
+    struct OutBuf ob;
+    outbuf_init(&ob, conn->fd, conn_sendv);
+    if (compact)
+        outbuf_printf(&ob, "OK MEMBERS %d\n", rc);
+    else
+        outbuf_printf(&ob, "INFO Members of group %s:\n", arg1);
+
+    for (int i = 0; i < rc; i++)
+    {
+        if (compact)
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: GROUP_MEMBERS <group_name>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct GroupMemberInfo members[128];
-            int rc = groups_view_members(user_id, arg1, members, 128);
-
-            if (rc == GROUP_ERR_NOT_FOUND)
-            {
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-                write(client, response, strlen(response));
-                continue;
-            } else if (rc == GROUP_ERR_NO_PERMISSION)
-            {
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not a member of this group.");
-                write(client, response, strlen(response));
-                continue;
-            } else if (rc < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Internal error.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char resp[MAX_CONTENT_LEN];
-            int off = 0;
-            off += snprintf(resp + off, sizeof(resp) - off, "INFO Members of group %s:\n", arg1);
-
-            for (int i = 0; i < rc && off < (int) sizeof(resp); i++)
-            {
-                off += snprintf(resp + off, sizeof(resp) - off,
-                                " - %s%s\n",
-                                members[i].username,
-                                members[i].is_admin ? " [admin]" : "");
-            }
-
-            write(client, resp, strlen(resp));
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_INT(members[i].user_id),
+                RENDER_FIELD(members[i].username),
+                RENDER_STR(members[i].is_admin ? "ADMIN" : "MEMBER"),
+            };
+            render_row(&ob, &MEMBER_ROW_COMPACT, args);
         }
-
-        if (strcmp(cmd, CMD_LIST_GROUPS) == 0)
+        else
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (arg1 != NULL || arg2 != NULL)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: LIST_GROUPS (no arguments)");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct GroupInfo groups[128];
-            int count = groups_list_for_user(user_id, groups, 128);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not list groups.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char resp[MAX_CONTENT_LEN];
-            int off = 0;
-
-            if (count == 0)
-            {
-                off += snprintf(resp + off, sizeof(resp) - off,
-                                "INFO You are not a member of any group.\n");
-            } else
-            {
-                off += snprintf(resp + off, sizeof(resp) - off,
-                                "INFO Your groups:\n");
-                for (int i = 0; i < count && off < (int) sizeof(resp); i++)
-                {
-                    off += snprintf(resp + off, sizeof(resp) - off,
-                                    " - %s%s%s\n",
-                                    groups[i].name,
-                                    groups[i].is_public ? " [public" : " [private",
-                                    groups[i].is_admin ? ", admin]" : "]");
-                }
-            }
-
-            write(client, resp, strlen(resp));
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_STR(members[i].username),
+                RENDER_STR(members[i].is_admin ? " [admin]" : ""),
+            };
+            render_row(&ob, &MEMBER_ROW, args);
         }
+    }
 
-        if (strcmp(cmd, CMD_GROUP_MESSAGES) == 0)
+    if (compact)
+        outbuf_append_ref(&ob, "END\n", 4);
+    outbuf_end(&ob);
+    return DISPATCH_DONE;
+}
+
+static int cmd_list_groups(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    if (arg1 != NULL || arg2 != NULL)
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Usage: LIST_GROUPS (no arguments)");
+
+    struct GroupInfo *groups;
+    int count = groups_list_for_user(me->user_id, &t_scratch, 128, &groups);
+    if (count < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not list groups.");
+
+    int compact = conn->output == OUTPUT_COMPACT;
+    if (count == 0 && !compact)
+        return reply_info(conn->fd, "You are not a member of any group.");
+
+    struct OutBuf ob;
+    outbuf_init(&ob, conn->fd, conn_sendv);
+    if (compact)
+        outbuf_printf(&ob, "OK GROUPS %d\n", count);
+    else
+        outbuf_append_ref(&ob, "INFO Your groups:\n", 18);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (compact)
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (arg1 == NULL)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: GROUP_MESSAGES <group_name>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct Message msgs[MAX_MESSAGE_LIST];
-            int count = groups_get_group_history(user_id, arg1, msgs, MAX_MESSAGE_LIST);
-
-            if (count < 0)
-            {
-                if (count == -2)
-                    build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-                else if (count == -3)
-                    build_error(response, sizeof(response), ERR_NO_PERMISSION, "You are not a member of this group.");
-                else
-                    build_error(response, sizeof(response), ERR_INTERNAL, "Could not load group messages.");
-
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            group_messages_send_for_client(client, arg1, msgs, count, user_id);
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_INT(groups[i].group_id),
+                RENDER_FIELD(groups[i].name),
+                RENDER_STR(groups[i].is_public ? "PUBLIC" : "PRIVATE"),
+                RENDER_STR(groups[i].is_admin ? "ADMIN" : "MEMBER"),
+            };
+            render_row(&ob, &GROUP_ROW_COMPACT, args);
         }
-
-        if (strcmp(cmd, CMD_SET_GROUP_VIS) == 0)
+        else
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (arg1 == NULL || arg2 == NULL)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: SET_GROUP_VIS <group_name> <PUBLIC|PRIVATE>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int is_public;
-            if (strcmp(arg2, "PUBLIC") == 0) is_public = 1;
-            else if (strcmp(arg2, "PRIVATE") == 0) is_public = 0;
-            else
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Visibility must be PUBLIC or PRIVATE.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_set_visibility(user_id, arg1, is_public);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response),
-                         is_public ? "Group visibility set to PUBLIC." : "Group visibility set to PRIVATE.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-            else if (rc == GROUP_ERR_NOT_ADMIN)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION,
-                            "Only group owner/admin can change visibility.");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not change group visibility.");
-
-            write(client, response, strlen(response));
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_STR(groups[i].name),
+                RENDER_STR(groups[i].is_public ? " [public" : " [private"),
+                RENDER_STR(groups[i].is_admin ? ", admin]" : "]"),
+            };
+            render_row(&ob, &GROUP_ROW, args);
         }
+    }
+
+    if (compact)
+        outbuf_append_ref(&ob, "END\n", 4);
+    outbuf_end(&ob);
+    return DISPATCH_DONE;
+}
+
+static int cmd_group_messages(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    struct MessagePage pg;
+    messages_page_begin(&pg, conn->fd, conn->output, me->user_id, arg1);
+
+    int count = groups_for_each_group_message(me->user_id, arg1, MAX_MESSAGE_LIST, messages_page_row, &pg);
+
+    if (count == -2)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (count == -3)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You are not a member of this group.");
+    if (count < 0 && pg.count == 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not load group messages.");
+
+    messages_page_end(&pg, 0, count < 0);
+    return DISPATCH_DONE;
+}
+
+static int cmd_set_group_vis(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int is_public;
+    if (strcmp(arg2, "PUBLIC") == 0) is_public = 1;
+    else if (strcmp(arg2, "PRIVATE") == 0) is_public = 0;
+    else
+        return reply_error(conn->fd, ERR_BAD_ARGS, "Visibility must be PUBLIC or PRIVATE.");
+
+    int rc = groups_set_visibility(me->user_id, arg1, is_public);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, is_public ? "Group visibility set to PUBLIC." : "Group visibility set to PRIVATE.");
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (rc == GROUP_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "Only group owner/admin can change visibility.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not change group visibility.");
+}
+
+static int cmd_kick_group_member(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int rc = groups_kick_member(me->user_id, arg1, arg2);
+    if (rc == GROUP_OK)
+        return reply_ok(conn->fd, "User removed from group.");
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "Group or user not found.");
+    if (rc == GROUP_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You must be group admin or owner.");
+    if (rc == GROUP_ERR_NO_PERMISSION)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "Cannot remove this user (owner or not in group).");
+    return reply_error(conn->fd, ERR_INTERNAL, "Could not remove user from group.");
+}
 
-        if (strcmp(cmd, CMD_KICK_GROUP_MEMBER) == 0)
+static int cmd_list_group_requests(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    struct GroupRequestInfo *reqs;
+    int count = groups_list_requests(me->user_id, arg1, &t_scratch, 128, &reqs);
+
+    if (count == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group not found.");
+    if (count == GROUP_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "You must be group admin.");
+    if (count < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not fetch requests.");
+
+    int compact = conn->output == OUTPUT_COMPACT;
+    struct OutBuf ob;
+    outbuf_init(&ob, conn->fd, conn_sendv);
+    outbuf_printf(&ob, "OK JOIN_REQUESTS %d\n", count);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (compact)
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (!arg1 || !arg2)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: KICK_GROUP_MEMBER <group_name> <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_kick_member(user_id, arg1, arg2);
-            if (rc == GROUP_OK)
-                build_ok(response, sizeof(response), "User removed from group.");
-            else if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "Group or user not found.");
-            else if (rc == GROUP_ERR_NOT_ADMIN)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You must be group admin or owner.");
-            else if (rc == GROUP_ERR_NO_PERMISSION)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION,
-                            "Cannot remove this user (owner or not in group).");
-            else
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not remove user from group.");
-
-            write(client, response, strlen(response));
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_INT(reqs[i].user_id),
+                RENDER_FIELD(reqs[i].username),
+            };
+            render_row(&ob, &REQUEST_ROW_COMPACT, args);
         }
-
-        if (strcmp(cmd, CMD_LIST_GROUP_REQUESTS) == 0)
+        else
         {
-            int admin_id = auth_get_user_id(client);
-            if (admin_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: LIST_GROUP_REQUESTS <group_name>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct GroupRequestInfo reqs[128];
-            int count = groups_list_requests(admin_id, arg1, reqs, 128);
-
-            if (count == GROUP_ERR_NOT_FOUND)
-            {
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group not found.");
-                write(client, response, strlen(response));
-                continue;
-            }
-            if (count == GROUP_ERR_NOT_ADMIN)
-            {
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "You must be group admin.");
-                write(client, response, strlen(response));
-                continue;
-            }
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not fetch requests.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char resp[4096];
-            int offset = 0;
-
-            offset += snprintf(resp + offset, sizeof(resp) - offset,
-                               "OK JOIN_REQUESTS %d\n", count);
-
-            for (int i = 0; i < count && offset < (int) sizeof(resp) - 1; i++)
-            {
-                offset += snprintf(resp + offset, sizeof(resp) - offset,
-                                   " - %s (uid: %d)\n",
-                                   reqs[i].username,
-                                   reqs[i].user_id);
-            }
-
-            write(client, resp, strlen(resp));
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_STR(reqs[i].username),
+                RENDER_INT(reqs[i].user_id),
+            };
+            render_row(&ob, &JOIN_REQUEST_ROW, args);
         }
+    }
+
+    if (compact)
+        outbuf_append_ref(&ob, "END\n", 4);
+    outbuf_end(&ob);
+    return DISPATCH_DONE;
+}
+
+static int cmd_reject_group_request(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    int rc = groups_reject_request(me->user_id, arg1, arg2);
+    if (rc == GROUP_ERR_NOT_FOUND)
+        return reply_error(conn->fd, ERR_GROUP_NOT_FOUND, "Group or user not found.");
+    if (rc == GROUP_ERR_NO_PERMISSION)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "Not allowed.");
+    if (rc == GROUP_ERR_NO_REQUEST)
+        return reply_error(conn->fd, ERR_REQ_NOT_FOUND, "User has no pending request.");
+    if (rc == GROUP_ERR_NOT_ADMIN)
+        return reply_error(conn->fd, ERR_NO_PERMISSION, "Must be admin of the group.");
+    if (rc < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Internal error.");
+    return reply_ok(conn->fd, "Join request rejected.");
+}
+
+static int cmd_view_notifs(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg1; (void)arg2;
+    struct NotifPage pg;
+    notifications_page_begin(&pg, conn->fd, conn->output);
+
+    int count = notifications_for_each(me->user_id, 256, notifications_page_row, &pg);
+    if (count < 0 && pg.count == 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not load notifications.");
+
+    notifications_page_end(&pg, count < 0);
+    return DISPATCH_DONE;
+}
 
-        if (strcmp(cmd, CMD_REJECT_GROUP_REQUEST) == 0)
+static int cmd_delete_notifs(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg1; (void)arg2;
+    if (notifications_delete_all(me->user_id) < 0)
+        return reply_error(conn->fd, ERR_INTERNAL, "Could not delete notifications.");
+    return reply_ok(conn->fd, "Notifications cleared.");
+}
+
+static int cmd_view_friend_requests(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg1; (void)arg2;
+    int client = conn->fd;
+
+    struct FriendRequestInfo *reqs;
+    int count = friends_request_list(me->user_id, &t_scratch, 128, &reqs);
+    if (count < 0)
+        return reply_error(client, ERR_INTERNAL, "Could not fetch friend requests.");
+
+    int compact = conn->output == OUTPUT_COMPACT;
+    struct OutBuf ob;
+    outbuf_init(&ob, client, conn_sendv);
+    if (compact)
+        outbuf_printf(&ob, "OK FRIEND_REQUESTS %d\n", count);
+    else
+        outbuf_printf(&ob, "OK Friend requests\nFRIEND_REQUESTS %d\n\n", count);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (compact)
         {
-            int admin_id = auth_get_user_id(client);
-            if (admin_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            if (!arg1 || !arg2)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS,
-                            "Usage: REJECT_GROUP_REQUEST <group> <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = groups_reject_request(admin_id, arg1, arg2);
-            if (rc == GROUP_ERR_NOT_FOUND)
-                build_error(response, sizeof(response), ERR_GROUP_NOT_FOUND, "Group or user not found.");
-            else if (rc == GROUP_ERR_NO_PERMISSION)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "Not allowed.");
-            else if (rc == GROUP_ERR_NO_REQUEST)
-                build_error(response, sizeof(response), ERR_REQ_NOT_FOUND, "User has no pending request.");
-            else if (rc == GROUP_ERR_NOT_ADMIN)
-                build_error(response, sizeof(response), ERR_NO_PERMISSION, "Must be admin of the group.");
-            else if (rc < 0)
-                build_error(response, sizeof(response), ERR_INTERNAL, "Internal error.");
-            else
-                build_ok(response, sizeof(response), "Join request rejected.");
-
-            write(client, response, strlen(response));
-            continue;
+            const struct RenderArg args[] = {
+                RENDER_INT(reqs[i].from_id),
+                RENDER_FIELD(reqs[i].from_name),
+                RENDER_INT(reqs[i].created_at),
+            };
+            render_row(&ob, &FRIEND_REQUEST_ROW_COMPACT, args);
         }
-
-        if (strcmp(cmd, CMD_VIEW_NOTIFS) == 0)
+        else
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct Notification ns[256];
-            int count = notifications_list(user_id, ns, 256);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not load notifications.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            notifications_send_for_client(client, ns, count);
-            continue;
+            const struct RenderArg args[] = { RENDER_STR(reqs[i].from_name) };
+            render_row(&ob, &FRIEND_REQUEST_ROW, args);
         }
+    }
+
+    outbuf_append_ref(&ob, "END\n", 4);
+    outbuf_end(&ob);
+    return DISPATCH_DONE;
+}
+
+static int cmd_accept_friend(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int rc = friends_request_accept(me->user_id, arg1);
+    if (rc == 1)
+        return reply_ok(conn->fd, "Friend request accepted.");
+    if (rc == 0)
+        return reply_error(conn->fd, ERR_REQ_NOT_FOUND, "No pending request from this user.");
+    if (rc == 2)
+        return reply_info(conn->fd, "Already friends.");
+    if (rc == -2)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Internal error.");
+}
+
+static int cmd_reject_friend(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2)
+{
+    (void)arg2;
+    int rc = friends_request_reject(me->user_id, arg1);
+    if (rc == 1)
+        return reply_ok(conn->fd, "Friend request rejected.");
+    if (rc == 0)
+        return reply_error(conn->fd, ERR_REQ_NOT_FOUND, "No pending request from this user.");
+    if (rc == -2)
+        return reply_error(conn->fd, ERR_USER_NOT_FOUND, "User not found.");
+    return reply_error(conn->fd, ERR_INTERNAL, "Internal error.");
+}
+
+/*
+ * The command table comes straight from COMMAND_LIST in protocol.h. Lookup
+ * is a perfect hash: the seed is picked once so that every command lands
+ * in its own slot, after which finding a command costs one hash and one
+ * strcmp no matter how many commands exist.
+ */
+typedef int (*command_fn)(struct Conn *conn, const struct ConnIdentity *me, char *arg1, char *arg2);
+
+struct Command
+{
+    const char *name;
+    command_fn  run;
+    int         opcode;
+    int         arity;      /* leading arguments that must be present */
+    int         flags;      /* CMDF_* */
+    const char *usage;
+};
+
+#define COMMAND_ENTRY(name, handler, opcode, arity, flags, usage) { name, cmd_##handler, opcode, arity, flags, usage },
+static const struct Command g_commands[] = { COMMAND_LIST(COMMAND_ENTRY) };
+#undef COMMAND_ENTRY
+
+#define COMMAND_COUNT      ((int)(sizeof(g_commands) / sizeof(g_commands[0])))
+#define COMMAND_SLOT_BITS  8
+#define COMMAND_SLOTS      (1 << COMMAND_SLOT_BITS)
+
+_Static_assert(sizeof(g_commands) / sizeof(g_commands[0]) < COMMAND_SLOTS / 2, "command table too dense");
+
+#define COMMAND_OPS        256
+
+static unsigned char g_command_slot[COMMAND_SLOTS];     /* index + 1, 0 = empty */
+static unsigned char g_command_op[COMMAND_OPS];         /* opcode -> index + 1 */
+static uint32_t g_command_seed;
+static pthread_once_t g_command_once = PTHREAD_ONCE_INIT;
 
-        if (strcmp(cmd, CMD_DELETE_NOTIFS) == 0)
+static uint32_t command_hash(const char *s, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    return h & (COMMAND_SLOTS - 1);
+}
+
+static void command_table_init(void)
+{
+    for (int i = 0; i < COMMAND_COUNT; i++)
+    {
+        int op = g_commands[i].opcode;
+        if (op <= FRAME_OP_PUSH || op >= COMMAND_OPS || g_command_op[op])
         {
-            int user_id = auth_get_user_id(client);
-            if (user_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = notifications_delete_all(user_id);
-            if (rc < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not delete notifications.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            build_ok(response, sizeof(response), "Notifications cleared.");
-            write(client, response, strlen(response));
+            fprintf(stderr, "[dispatch] bad or duplicate opcode %d for %s\n", op, g_commands[i].name);
             continue;
         }
+        g_command_op[op] = (unsigned char)(i + 1);
+    }
 
-        if (strcmp(cmd, CMD_VIEW_FRIEND_REQUESTS) == 0)
+    for (uint32_t seed = 0; ; seed++)
+    {
+        int i;
+        memset(g_command_slot, 0, sizeof(g_command_slot));
+        for (i = 0; i < COMMAND_COUNT; i++)
         {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            struct FriendRequestInfo reqs[128];
-            int count = friends_request_list(me_id, reqs, 128);
-            if (count < 0)
-            {
-                build_error(response, sizeof(response), ERR_INTERNAL, "Could not fetch friend requests.");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            char out[1024];
-            int off = snprintf(out, sizeof(out), "OK Friend requests\nFRIEND_REQUESTS %d\n\n", count);
-            write(client, out, (size_t) off);
-
-            for (int i = 0; i < count; i++)
-            {
-                char line[256];
-                snprintf(line, sizeof(line), " - %s\n", reqs[i].from_name);
-                write(client, line, strlen(line));
-            }
-
-            write(client, "END\n", 4);
-            continue;
+            uint32_t slot = command_hash(g_commands[i].name, seed);
+            if (g_command_slot[slot])
+                break;
+            g_command_slot[slot] = (unsigned char)(i + 1);
         }
 
-        if (strcmp(cmd, CMD_ACCEPT_FRIEND) == 0)
+        if (i == COMMAND_COUNT)
         {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: ACCEPT_FRIEND <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = friends_request_accept(me_id, arg1);
-            if (rc == 1) build_ok(response, sizeof(response), "Friend request accepted.");
-            else if (rc == 0) build_error(response, sizeof(response), ERR_REQ_NOT_FOUND,
-                                          "No pending request from this user.");
-            else if (rc == 2) build_info(response, sizeof(response), "Already friends.");
-            else if (rc == -2) build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-            else build_error(response, sizeof(response), ERR_INTERNAL, "Internal error.");
-            write(client, response, strlen(response));
-            continue;
+            g_command_seed = seed;
+            return;
         }
+    }
+}
+
+static const struct Command *command_lookup(const char *name)
+{
+    pthread_once(&g_command_once, command_table_init);
+
+    int idx = g_command_slot[command_hash(name, g_command_seed)];
+    if (idx == 0 || strcmp(g_commands[idx - 1].name, name) != 0)
+        return NULL;
+    return &g_commands[idx - 1];
+}
+
+static const struct Command *command_by_opcode(unsigned op)
+{
+    pthread_once(&g_command_once, command_table_init);
+
+    if (op >= COMMAND_OPS || g_command_op[op] == 0)
+        return NULL;
+    return &g_commands[g_command_op[op] - 1];
+}
+
+/* What a line and a frame share once the arguments are split out. */
+static int command_run(struct Conn *conn, const struct Command *c, const struct ConnIdentity *me,
+                       char *arg1, char *arg2)
+{
+    if ((c->flags & CMDF_AUTH) && me->user_id < 0)
+        return reply_error(conn->fd, ERR_NOT_AUTH, "You must login first.");
 
-        if (strcmp(cmd, CMD_REJECT_FRIEND) == 0)
+    int argc = arg1 ? (arg2 ? 2 : 1) : 0;
+    if (argc < c->arity)
+        return reply_error(conn->fd, ERR_BAD_ARGS, c->usage);
+
+    int rc = c->run(conn, me, arg1, arg2);
+
+    /* A parked command has handed its work off; nothing of it is in the arena. */
+    arena_reset(&t_scratch);
+    return rc;
+}
+
+int command_dispatch(struct Conn *conn, char *buffer, size_t len)
+{
+    int client = conn->fd;
+    char *cmd = NULL;
+    char *arg1 = NULL;
+    char *arg2 = NULL;
+    buffer_split_command(buffer, len, &cmd, &arg1, &arg2);
+
+    const struct Command *c = command_lookup(cmd);
+    if (!c)
+        return reply_error(client, ERR_BAD_ARGS, "Unknown command");
+
+    return command_run(conn, c, identity_refresh(conn), arg1, arg2);
+}
+
+/*
+ * Binary requests. Anything but a CMDF_SESSION command is handed to another
+ * worker together with a copy of the caller's identity, so a long listing
+ * does not hold up the requests behind it; responses carry the request id
+ * and leave in whatever order the commands finish. A session command waits
+ * until the requests in flight are done and then runs on the owner.
+ */
+#define FRAME_MAX_INFLIGHT 8
+
+struct FrameRequest
+{
+    struct Conn *conn;
+    const struct Command *cmd;
+    uint32_t id;
+    uint16_t op;
+    int      bad;           /* the fields did not parse */
+    struct ConnIdentity me;
+    char    *arg1;
+    char    *arg2;
+    char     args[];
+};
+
+/*
+ * Turns the typed fields into the two argument strings the handlers take.
+ * No field grows by more than 3x (an INT's 5 bytes print as at most 11
+ * characters plus a separator), which is how args is sized.
+ */
+static struct FrameRequest *frame_request_new(struct Conn *conn, const struct FrameHead *h,
+                                              const unsigned char *body, size_t len)
+{
+    struct FrameRequest *req = malloc(sizeof(*req) + len * 3 + 2);
+    if (!req)
+        return NULL;
+
+    memset(req, 0, sizeof(*req));
+    req->conn = conn;
+    req->id = h->id;
+    req->op = h->op;
+
+    char *out = req->args;
+    size_t pos = 0;
+    for (int i = 0; i < h->nfields && !req->bad; i++)
+    {
+        if (i == 0)
+            req->arg1 = out;
+        else if (i == 1)
+            req->arg2 = out;
+        else
+            *out++ = ' ';
+
+        int type = pos < len ? body[pos++] : 0;
+        size_t n = len - pos >= 2 ? frame_get16(body + pos) : 0;
+
+        if (type == FRAME_FIELD_STR && len - pos >= 2 && n <= len - pos - 2 &&
+            !memchr(body + pos + 2, '\0', n))
         {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0)
-            {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-            if (!arg1)
-            {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: REJECT_FRIEND <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = friends_request_reject(me_id, arg1);
-            if (rc == 1) build_ok(response, sizeof(response), "Friend request rejected.");
-            else if (rc == 0) build_error(response, sizeof(response), ERR_REQ_NOT_FOUND,
-                                          "No pending request from this user.");
-            else if (rc == -2) build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-            else build_error(response, sizeof(response), ERR_INTERNAL, "Internal error.");
-            write(client, response, strlen(response));
-            continue;
+            memcpy(out, body + pos + 2, n);
+            out += n;
+            pos += 2 + n;
         }
-
-        if (strcmp(cmd, CMD_ACCEPT_FRIEND) == 0)
+        else if (type == FRAME_FIELD_INT && len - pos >= 4)
         {
-            int me_id = auth_get_user_id(client);
-            if (me_id < 0) {
-                build_error(response, sizeof(response), ERR_NOT_AUTH, "You must login first.");
-                write(client, response, strlen(response));
-                continue;
-            }
-            if (!arg1) {
-                build_error(response, sizeof(response), ERR_BAD_ARGS, "Usage: ACCEPT_FRIEND <username>");
-                write(client, response, strlen(response));
-                continue;
-            }
-
-            int rc = friends_request_accept(me_id, arg1);
-            if (rc == 1) build_ok(response, sizeof(response), "Friend request accepted.");
-            else if (rc == 0) build_error(response, sizeof(response), ERR_REQ_NOT_FOUND, "No pending request from this user.");
-            else if (rc == 2) build_info(response, sizeof(response), "Already friends.");
-            else if (rc == -2) build_error(response, sizeof(response), ERR_USER_NOT_FOUND, "User not found.");
-            else build_error(response, sizeof(response), ERR_INTERNAL, "Internal error.");
-
-            write(client, response, strlen(response));
-            continue;
+            out += snprintf(out, 12, "%d", (int)(int32_t)frame_get32(body + pos));
+            pos += 4;
         }
+        else
+            req->bad = 1;
 
-        build_error(response, sizeof(response), ERR_BAD_ARGS, "Unknown command");
-        write(client, response, strlen(response));
+        if (i == 0 || i == h->nfields - 1)
+            *out++ = '\0';
     }
+
+    if (req->bad || pos != len)
+    {
+        req->bad = 1;
+        req->arg1 = req->arg2 = NULL;
+    }
+    return req;
+}
+
+/* Runs the request on this thread and frees it. */
+static int frame_request_exec(struct FrameRequest *req)
+{
+    struct Conn *conn = req->conn;
+    struct FrameReply *reply = conn_reply_open(conn, req->id, req->op);
+    int rc;
+
+    if (!req->cmd)
+        rc = reply_error(conn->fd, ERR_BAD_ARGS, "Unknown command");
+    else if (req->bad)
+        rc = reply_error(conn->fd, ERR_BAD_ARGS, "Malformed frame.");
+    else
+        rc = command_run(conn, req->cmd, &req->me, req->arg1, req->arg2);
+
+    /* A parked command took the reply along and closes it itself. */
+    if (rc == DISPATCH_DONE)
+        conn_reply_close(reply);
+    free(req);
+    return rc;
+}
+
+static void frame_request_job(void *arg)
+{
+    struct FrameRequest *req = (struct FrameRequest *)arg;
+    struct Conn *conn = req->conn;
+
+    frame_request_exec(req);
+    if (conn_requests_end(conn))
+        server_resume(conn);
+    conn_release(conn);
+}
+
+int command_dispatch_frame(struct Conn *conn, char *frame, size_t len)
+{
+    struct FrameHead h;
+    frame_head_get(frame, &h);
+
+    const struct Command *c = command_by_opcode(h.op);
+
+    if (c && (c->flags & CMDF_SESSION) && conn_requests_wait(conn, len))
+        return DISPATCH_PARKED;
+
+    struct FrameRequest *req = frame_request_new(conn, &h, (const unsigned char *)frame + FRAME_HEADER,
+                                                 len - FRAME_HEADER);
+    if (!req)
+    {
+        fprintf(stderr, "[dispatch] fd %d: no memory for frame %u\n", conn->fd, h.id);
+        return DISPATCH_DONE;
+    }
+    req->cmd = c;
+    req->me = *identity_refresh(conn);
+
+    if (c && !(c->flags & CMDF_SESSION) && !req->bad &&
+        conn_requests_begin(conn, FRAME_MAX_INFLIGHT) == 0)
+    {
+        if (worker_pool_submit(frame_request_job, req) == 0)
+            return DISPATCH_DONE;
+        conn_requests_end(conn);
+        conn_release(conn);
+    }
+
+    return frame_request_exec(req);
 }
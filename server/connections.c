@@ -0,0 +1,872 @@
+#include "common.h"
+#include "connections.h"
+#include "buffer.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#define CONN_WBUF_MAX      (8 * 1024 * 1024)
+#define CONN_IOV_BATCH     64
+#define CONN_SEND_MANY_MAX 64
+
+/*
+ * The binary response being built by this thread, if any. While it is set,
+ * whatever the running command sends to its own connection is collected here
+ * and goes out as frames carrying the request's id.
+ */
+struct FrameReply
+{
+    struct Conn *conn;
+    uint32_t id;
+    uint16_t op;
+    char    *buf;
+    size_t   len;
+    size_t   cap;
+};
+
+static _Thread_local struct FrameReply *t_reply;
+
+static struct Conn *g_conns[MAX_CONNECTIONS];
+static pthread_mutex_t g_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_epoll_fd = -1;
+
+int conns_init(int epoll_fd)
+{
+    if (epoll_fd < 0)
+        return -1;
+    g_epoll_fd = epoll_fd;
+    return 0;
+}
+
+/* Caller holds c->lock. */
+static int conn_update_events(struct Conn *c)
+{
+    if (!c->registered)
+        return 0;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (!c->read_paused)
+        ev.events = EPOLLIN | EPOLLRDHUP;
+    if (c->want_write)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = c->fd;
+
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    {
+        perror("[conn] epoll_ctl MOD");
+        return -1;
+    }
+    return 0;
+}
+
+/* Caller holds c->lock. */
+static void conn_detach(struct Conn *c)
+{
+    if (!c->registered)
+        return;
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->registered = 0;
+}
+
+struct Conn *conn_open(int fd, uint32_t addr)
+{
+    if (fd < 0 || fd >= MAX_CONNECTIONS)
+        return NULL;
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("[conn] fcntl O_NONBLOCK");
+        return NULL;
+    }
+
+    struct Conn *c = calloc(1, sizeof(struct Conn));
+    if (!c)
+        return NULL;
+    c->fd = fd;
+    c->addr = addr;
+    c->me.user_id = -1;
+    pthread_mutex_init(&c->lock, NULL);
+    atomic_init(&c->refs, 1);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("[conn] epoll_ctl ADD");
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+        return NULL;
+    }
+    c->registered = 1;
+
+    pthread_mutex_lock(&g_conns_lock);
+    g_conns[fd] = c;
+    pthread_mutex_unlock(&g_conns_lock);
+    return c;
+}
+
+struct Conn *conn_acquire(int fd)
+{
+    if (fd < 0 || fd >= MAX_CONNECTIONS)
+        return NULL;
+
+    pthread_mutex_lock(&g_conns_lock);
+    struct Conn *c = g_conns[fd];
+    if (c)
+        atomic_fetch_add(&c->refs, 1);
+    pthread_mutex_unlock(&g_conns_lock);
+    return c;
+}
+
+/*
+ * The descriptor is closed only here, when nobody references the connection
+ * anymore, so a worker still holding it can never write into a recycled fd.
+ */
+void conn_release(struct Conn *c)
+{
+    if (!c || atomic_fetch_sub(&c->refs, 1) != 1)
+        return;
+
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c->wbuf);
+    free(c);
+}
+
+void conn_close(int fd)
+{
+    if (fd < 0 || fd >= MAX_CONNECTIONS)
+        return;
+
+    pthread_mutex_lock(&g_conns_lock);
+    struct Conn *c = g_conns[fd];
+    g_conns[fd] = NULL;
+    pthread_mutex_unlock(&g_conns_lock);
+
+    if (!c)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    c->closed = 1;
+    conn_detach(c);
+    pthread_mutex_unlock(&c->lock);
+
+    conn_release(c);
+}
+
+/* Caller holds c->lock. Whether rbuf holds something for the owner to act on. */
+static int conn_has_request(struct Conn *c)
+{
+    size_t avail = c->rlen - c->rstart;
+
+    if (!c->framed)
+        return memchr(c->rbuf + c->rstart, '\n', avail) != NULL;
+    if (c->skip)
+        return avail > 0;
+    if (avail < FRAME_HEADER)
+        return 0;
+
+    size_t total = (size_t)frame_get32((const unsigned char *)c->rbuf + c->rstart) + 4;
+    return total <= avail || total > sizeof(c->rbuf) || total < FRAME_HEADER;
+}
+
+/*
+ * Reactor side: drain the socket into rbuf. Returns 1 when the connection has
+ * work and no worker owns it yet; in that case a reference was taken for the
+ * job and the caller must either submit it or hand it back via conn_reject().
+ */
+int conn_fill(struct Conn *c, int hangup)
+{
+    int schedule = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->closed || c->eof)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    while (1)
+    {
+        size_t space = sizeof(c->rbuf) - c->rlen;
+        if (space == 0)
+        {
+            if (hangup)
+            {
+                c->eof = 1;
+                conn_detach(c);
+            }
+            else if (!c->read_paused)
+            {
+                c->read_paused = 1;
+                conn_update_events(c);
+            }
+            break;
+        }
+
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, space);
+        if (n > 0)
+        {
+            c->rlen += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (n < 0)
+            perror("[conn] read");
+        c->eof = 1;
+        conn_detach(c);
+        break;
+    }
+
+    if (!c->scheduled)
+    {
+        if (conn_has_request(c) || c->eof || c->rlen == sizeof(c->rbuf))
+        {
+            c->scheduled = 1;
+            atomic_fetch_add(&c->refs, 1);
+            schedule = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    return schedule;
+}
+
+/* Caller holds c->lock. Gives the connection back to the reactor. */
+static void conn_unschedule(struct Conn *c, int *eof)
+{
+    if (c->rstart > 0)
+    {
+        memmove(c->rbuf, c->rbuf + c->rstart, c->rlen - c->rstart);
+        c->rlen -= c->rstart;
+        c->rstart = 0;
+    }
+
+    c->scheduled = 0;
+    if (c->read_paused && !c->eof && !c->closed)
+    {
+        c->read_paused = 0;
+        conn_update_events(c);
+    }
+    if (eof)
+        *eof = c->eof;
+}
+
+/*
+ * Caller holds c->lock. Frame counterpart of the line scan below: the length
+ * in the header says where the frame ends. A frame bigger than rbuf is
+ * skipped by count and reported once, with only its header, as
+ * CONN_FRAME_TOO_LONG; a length too small to be a frame ends the connection.
+ */
+static int conn_next_frame(struct Conn *c, char **frame, size_t *len)
+{
+    while (1)
+    {
+        size_t avail = c->rlen - c->rstart;
+        if (c->skip)
+        {
+            size_t n = c->skip < avail ? c->skip : avail;
+            c->rstart += n;
+            c->skip -= n;
+            if (c->skip)
+                return CONN_DRAINED;
+            continue;
+        }
+
+        if (avail < FRAME_HEADER)
+            return CONN_DRAINED;
+
+        char *p = c->rbuf + c->rstart;
+        size_t total = (size_t)frame_get32((const unsigned char *)p) + 4;
+        if (total < FRAME_HEADER)
+        {
+            fprintf(stderr, "[conn] fd %d: malformed frame, closing\n", c->fd);
+            c->rstart = c->rlen;
+            c->eof = 1;
+            conn_detach(c);
+            return CONN_DRAINED;
+        }
+
+        if (total > sizeof(c->rbuf))
+        {
+            *frame = p;
+            *len = FRAME_HEADER;
+            c->rstart = c->rlen;
+            c->skip = total - avail;
+            return CONN_FRAME_TOO_LONG;
+        }
+
+        if (total > avail)
+            return CONN_DRAINED;
+
+        *frame = p;
+        *len = total;
+        c->rstart += total;
+        return CONN_FRAME;
+    }
+}
+
+/*
+ * Worker side: hand out the next complete line, NUL-terminated in place, or
+ * the next frame once the connection is framed (CONN_FRAME). The pointer
+ * stays valid until the next call. A line that does not fit in rbuf is
+ * thrown away up to its newline and reported once as CONN_LINE_TOO_LONG.
+ * On CONN_DRAINED the worker no longer owns the connection and *eof tells
+ * whether the peer is gone.
+ */
+int conn_next_line(struct Conn *c, char **line, size_t *len, int *eof)
+{
+    int rc = CONN_DRAINED;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->framed)
+    {
+        if (c->discarding)
+        {
+            char *nl = memchr(c->rbuf + c->rstart, '\n', c->rlen - c->rstart);
+            if (!nl)
+            {
+                c->rstart = c->rlen;
+                break;
+            }
+            c->rstart = (size_t)(nl - c->rbuf) + 1;
+            c->discarding = 0;
+        }
+
+        char *l = buffer_next_line(c->rbuf, c->rlen, &c->rstart, len);
+        if (l)
+        {
+            if (*len == 0)
+                continue;
+            *line = l;
+            rc = CONN_LINE;
+            break;
+        }
+
+        if (c->rstart == 0 && c->rlen == sizeof(c->rbuf))
+        {
+            c->rstart = c->rlen;
+            c->discarding = 1;
+            rc = CONN_LINE_TOO_LONG;
+        }
+        break;
+    }
+
+    if (c->framed)
+        rc = conn_next_frame(c, line, len);
+
+    if (rc == CONN_DRAINED)
+        conn_unschedule(c, eof);
+
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+/* Caller holds c->lock. conn_reject() for a framed connection. */
+static int conn_reject_frames(struct Conn *c, struct FrameHead *frames, int max)
+{
+    int dropped = 0;
+
+    while (1)
+    {
+        size_t avail = c->rlen - c->rstart;
+        if (c->skip)
+        {
+            size_t n = c->skip < avail ? c->skip : avail;
+            c->rstart += n;
+            c->skip -= n;
+            if (c->skip)
+                break;
+            continue;
+        }
+
+        if (avail < FRAME_HEADER)
+            break;
+
+        char *p = c->rbuf + c->rstart;
+        size_t total = (size_t)frame_get32((const unsigned char *)p) + 4;
+        if (total < FRAME_HEADER || (total > avail && total <= sizeof(c->rbuf)))
+            break;
+
+        if (dropped < max)
+            frame_head_get(p, &frames[dropped++]);
+
+        if (total > avail)
+        {
+            c->rstart = c->rlen;
+            c->skip = total - avail;
+            break;
+        }
+        c->rstart += total;
+    }
+    return dropped;
+}
+
+/*
+ * The job for this connection could not be queued: throw away the complete
+ * lines that are waiting and release ownership. Returns how many commands
+ * were dropped so the caller can answer each of them; on a framed connection
+ * the headers of up to max dropped frames are copied to frames.
+ */
+int conn_reject(struct Conn *c, int *eof, struct FrameHead *frames, int max)
+{
+    int dropped = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->framed)
+    {
+        dropped = conn_reject_frames(c, frames, max);
+        conn_unschedule(c, eof);
+        pthread_mutex_unlock(&c->lock);
+        return dropped;
+    }
+
+    char *p = c->rbuf + c->rstart;
+    char *end = c->rbuf + c->rlen;
+    char *nl;
+    while (p < end && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL)
+    {
+        if (c->discarding)
+            c->discarding = 0;
+        else
+            dropped++;
+        p = nl + 1;
+    }
+    c->rstart = (size_t)(p - c->rbuf);
+
+    if (c->rstart == 0 && c->rlen == sizeof(c->rbuf))
+    {
+        if (!c->discarding)
+            dropped++;
+        c->rstart = c->rlen;
+        c->discarding = 1;
+    }
+
+    conn_unschedule(c, eof);
+    pthread_mutex_unlock(&c->lock);
+    return dropped;
+}
+
+/* Caller holds c->lock. */
+static int conn_flush_locked(struct Conn *c)
+{
+    while (c->woff < c->wlen)
+    {
+        ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+        if (n > 0)
+        {
+            c->woff += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!c->want_write)
+            {
+                c->want_write = 1;
+                conn_update_events(c);
+            }
+            return 0;
+        }
+        return -1;
+    }
+
+    c->woff = 0;
+    c->wlen = 0;
+    if (c->want_write)
+    {
+        c->want_write = 0;
+        conn_update_events(c);
+    }
+    return 0;
+}
+
+int conn_flush(struct Conn *c)
+{
+    if (!c)
+        return -1;
+
+    pthread_mutex_lock(&c->lock);
+    int rc = c->closed ? -1 : conn_flush_locked(c);
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+static int conn_queue(struct Conn *c, const char *buf, size_t len)
+{
+    if (c->woff > 0)
+    {
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+
+    if (c->wlen + len > CONN_WBUF_MAX)
+    {
+        fprintf(stderr, "[conn] fd %d: output buffer limit reached\n", c->fd);
+        return -1;
+    }
+
+    if (c->wlen + len > c->wcap)
+    {
+        size_t cap = c->wcap ? c->wcap : 4096;
+        while (cap < c->wlen + len)
+            cap *= 2;
+
+        char *p = realloc(c->wbuf, cap);
+        if (!p)
+            return -1;
+        c->wbuf = p;
+        c->wcap = cap;
+    }
+
+    memcpy(c->wbuf + c->wlen, buf, len);
+    c->wlen += len;
+    return 0;
+}
+
+/*
+ * Single write path for everything the server sends. With nothing already
+ * queued the pieces go out through writev(); whatever the socket does not
+ * take (partial write or EAGAIN) is copied to wbuf and finished by the
+ * reactor on EPOLLOUT, so the caller never blocks.
+ */
+static int conn_sendv_locked(struct Conn *c, const struct iovec *iov, int iovcnt)
+{
+    int i = 0;
+    size_t skip = 0;
+
+    if (c->woff == c->wlen)
+    {
+        while (i < iovcnt)
+        {
+            struct iovec batch[CONN_IOV_BATCH];
+            int n = 0;
+            for (int j = i; j < iovcnt && n < CONN_IOV_BATCH; j++, n++)
+            {
+                batch[n] = iov[j];
+                if (j == i)
+                {
+                    batch[n].iov_base = (char *)batch[n].iov_base + skip;
+                    batch[n].iov_len -= skip;
+                }
+            }
+
+            ssize_t w = writev(c->fd, batch, n);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (w < 0)
+                return -1;
+
+            size_t left = (size_t)w;
+            while (i < iovcnt && left >= iov[i].iov_len - skip)
+            {
+                left -= iov[i].iov_len - skip;
+                skip = 0;
+                i++;
+            }
+            skip += left;
+        }
+        if (i == iovcnt)
+            return 0;
+    }
+
+    for (; i < iovcnt; i++, skip = 0)
+    {
+        if (conn_queue(c, (const char *)iov[i].iov_base + skip, iov[i].iov_len - skip) < 0)
+            return -1;
+    }
+
+    return conn_flush_locked(c);
+}
+
+/*
+ * Caller holds c->lock. Output nobody asked for in this request: on a framed
+ * connection it goes out as a push frame, header and body under one lock
+ * hold so no other frame can land in between.
+ */
+static int conn_push_locked(struct Conn *c, const struct iovec *iov, int iovcnt)
+{
+    if (!c->framed)
+        return conn_sendv_locked(c, iov, iovcnt);
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    unsigned char head[FRAME_HEADER];
+    frame_head_put(head, len, 0, FRAME_OP_PUSH, 0);
+
+    struct iovec h;
+    h.iov_base = head;
+    h.iov_len = sizeof(head);
+    if (conn_sendv_locked(c, &h, 1) < 0)
+        return -1;
+    return conn_sendv_locked(c, iov, iovcnt);
+}
+
+/* Sends what the reply has collected as one frame; flags is 0 for the last. */
+static int conn_reply_flush(struct FrameReply *r, uint8_t flags)
+{
+    unsigned char head[FRAME_HEADER];
+    frame_head_put(head, r->len, r->id, r->op, flags);
+
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = r->len;
+
+    struct Conn *c = r->conn;
+    pthread_mutex_lock(&c->lock);
+    int rc = c->closed ? -1 : conn_sendv_locked(c, iov, r->len ? 2 : 1);
+    pthread_mutex_unlock(&c->lock);
+
+    r->len = 0;
+    return rc;
+}
+
+static int conn_reply_append(struct FrameReply *r, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if (r->len + len > r->cap)
+    {
+        size_t cap = r->cap ? r->cap : 4096;
+        while (cap < r->len + len)
+            cap *= 2;
+
+        char *p = realloc(r->buf, cap);
+        if (!p)
+            return -1;
+        r->buf = p;
+        r->cap = cap;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(r->buf + r->len, iov[i].iov_base, iov[i].iov_len);
+        r->len += iov[i].iov_len;
+    }
+
+    if (r->len >= FRAME_CHUNK)
+        return conn_reply_flush(r, FRAME_MORE);
+    return 0;
+}
+
+/*
+ * Starts the response to binary request id on this thread. Until
+ * conn_reply_close() everything the thread sends to c becomes part of it;
+ * the reply holds a reference on c. Returns NULL when out of memory, in
+ * which case the output goes out as pushes.
+ */
+struct FrameReply *conn_reply_open(struct Conn *c, uint32_t id, uint16_t op)
+{
+    struct FrameReply *r = calloc(1, sizeof(*r));
+    if (!r)
+    {
+        fprintf(stderr, "[conn] fd %d: no memory for reply %u\n", c->fd, id);
+        return NULL;
+    }
+
+    atomic_fetch_add(&c->refs, 1);
+    r->conn = c;
+    r->id = id;
+    r->op = op;
+    t_reply = r;
+    return r;
+}
+
+/* A command parking on another thread takes its reply along: detach here, attach there. */
+struct FrameReply *conn_reply_detach(void)
+{
+    struct FrameReply *r = t_reply;
+    t_reply = NULL;
+    return r;
+}
+
+void conn_reply_attach(struct FrameReply *r)
+{
+    t_reply = r;
+}
+
+/* Sends the last frame of the reply, which may be empty, and frees it. */
+void conn_reply_close(struct FrameReply *r)
+{
+    if (!r)
+        return;
+    if (t_reply == r)
+        t_reply = NULL;
+
+    conn_reply_flush(r, 0);
+    conn_release(r->conn);
+    free(r->buf);
+    free(r);
+}
+
+/*
+ * HELLO BINARY: the reply still goes out as a line and everything after it,
+ * both ways, is frames. Done under one lock hold so no push slips in between.
+ */
+int conn_set_framed(struct Conn *c, const void *reply, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)reply;
+    iov.iov_len = len;
+
+    pthread_mutex_lock(&c->lock);
+    int rc = c->closed ? -1 : conn_sendv_locked(c, &iov, 1);
+    c->framed = 1;
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+/*
+ * The owner hands a request to another worker. Fails once max requests are
+ * already out, so the owner runs it itself and stops reading meanwhile.
+ * Takes a reference for the request job.
+ */
+int conn_requests_begin(struct Conn *c, int max)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->inflight < max)
+    {
+        c->inflight++;
+        atomic_fetch_add(&c->refs, 1);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+/*
+ * A request job is done. Returns 1 when it was the last one and the owner
+ * parked on it; the caller then passes the owner's reference to
+ * server_resume(). The job's own reference is still the caller's to release.
+ */
+int conn_requests_end(struct Conn *c)
+{
+    int resume = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (--c->inflight == 0 && c->waiting)
+    {
+        c->waiting = 0;
+        resume = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return resume;
+}
+
+/*
+ * The owner got a frame, len bytes, that must not overlap the requests in
+ * flight. If there are any, the frame is put back to be read again and 1
+ * is returned: the owner parks and the last request job resumes it.
+ */
+int conn_requests_wait(struct Conn *c, size_t len)
+{
+    int wait = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->inflight > 0)
+    {
+        c->rstart -= len;
+        c->waiting = 1;
+        wait = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return wait;
+}
+
+int conn_sendv(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (!iov || iovcnt <= 0)
+        return -1;
+
+    struct FrameReply *r = t_reply;
+    if (r && r->conn->fd == fd)
+        return conn_reply_append(r, iov, iovcnt);
+
+    struct Conn *c = conn_acquire(fd);
+    if (!c)
+        return -1;
+
+    pthread_mutex_lock(&c->lock);
+    int rc = c->closed ? -1 : conn_push_locked(c, iov, iovcnt);
+    pthread_mutex_unlock(&c->lock);
+
+    conn_release(c);
+    return rc;
+}
+
+int conn_send(int fd, const void *buf, size_t len)
+{
+    if (!buf)
+        return -1;
+
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return conn_sendv(fd, &iov, 1);
+}
+
+/*
+ * Same bytes to several connections: targets are pinned in batches with one
+ * pass over the table per batch, then each gets the payload through its own
+ * write path. Returns how many connections accepted it.
+ */
+int conn_send_many(const int *fds, int count, const void *buf, size_t len)
+{
+    if (!fds || count <= 0 || !buf)
+        return 0;
+
+    struct Conn *targets[CONN_SEND_MANY_MAX];
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    int delivered = 0;
+    for (int base = 0; base < count; base += CONN_SEND_MANY_MAX)
+    {
+        int end = base + CONN_SEND_MANY_MAX < count ? base + CONN_SEND_MANY_MAX : count;
+        int n = 0;
+
+        pthread_mutex_lock(&g_conns_lock);
+        for (int i = base; i < end; i++)
+        {
+            if (fds[i] < 0 || fds[i] >= MAX_CONNECTIONS || !g_conns[fds[i]])
+                continue;
+            targets[n] = g_conns[fds[i]];
+            atomic_fetch_add(&targets[n]->refs, 1);
+            n++;
+        }
+        pthread_mutex_unlock(&g_conns_lock);
+
+        for (int i = 0; i < n; i++)
+        {
+            struct Conn *c = targets[i];
+            pthread_mutex_lock(&c->lock);
+            if (!c->closed && conn_push_locked(c, &iov, 1) == 0)
+                delivered++;
+            pthread_mutex_unlock(&c->lock);
+            conn_release(c);
+        }
+    }
+    return delivered;
+}
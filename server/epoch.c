@@ -0,0 +1,41 @@
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "epoch.h"
+
+/*
+ * Two reader counters selected by the low bit of g_epoch. Flipping the bit
+ * sends new readers to the other counter, so once the old one drains no
+ * reader can still hold anything unpublished before the flip. Writers of
+ * different structures share this, so flips are serialized.
+ */
+static atomic_uint g_epoch;
+static atomic_long g_active[2];
+static pthread_mutex_t g_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned epoch_enter(void)
+{
+    for (;;)
+    {
+        unsigned e = atomic_load(&g_epoch) & 1;
+        atomic_fetch_add(&g_active[e], 1);
+        if ((atomic_load(&g_epoch) & 1) == e)
+            return e;
+        atomic_fetch_sub(&g_active[e], 1);
+    }
+}
+
+void epoch_exit(unsigned e)
+{
+    atomic_fetch_sub(&g_active[e], 1);
+}
+
+void epoch_synchronize(void)
+{
+    pthread_mutex_lock(&g_sync_lock);
+    unsigned old = atomic_fetch_add(&g_epoch, 1) & 1;
+    while (atomic_load(&g_active[old]) > 0)
+        sched_yield();
+    pthread_mutex_unlock(&g_sync_lock);
+}
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sqlite3.h>
+
+#include "feed.h"
+#include "timeline.h"
+#include "storage.h"
+
+/*
+ * Pull-based feed assembly. The viewer's relations are read once; every
+ * author the viewer may see gets a stream over posts(author_id, created_at)
+ * restricted to the visibilities that author shows this viewer, plus the
+ * shared timeline 0 for public posts of public accounts. A max-heap on
+ * (created_at, id) merges the streams, so a page costs about
+ * page_size * log(streams) heap steps and reads each stream only as far as
+ * the page reaches.
+ *
+ * Streams are read lazily: until its first chunk is fetched, a stream sits
+ * in the heap under an upper bound on its newest post, taken from the
+ * relations query, so authors whose posts are older than the page are never
+ * read. After that a stream is refilled, in growing chunks, when the merge
+ * drains it. The merge yields post ids alone, and the page is hydrated by a
+ * single query over those ids once it is complete.
+ */
+
+#define FEED_CHUNK_MIN 4
+#define FEED_CHUNK_MAX 64
+#define FEED_JSON_INT  12       /* "-2147483648," */
+
+struct FeedStream
+{
+    int author_id;          /* 0: shared stream of public posts by public accounts */
+    int vis_mask;           /* bit per enum post_visibility */
+    int chunk;
+    int exhausted;
+    int n;
+    int pos;
+    struct PostCursor bound;    /* heap key until the first fill */
+    struct PostCursor buf[FEED_CHUNK_MAX];
+};
+
+static atomic_int g_feed_mode = FEED_TIMELINE;
+
+void feed_set_mode(enum feed_mode mode)
+{
+    atomic_store(&g_feed_mode, mode);
+}
+
+int feed_mode_from_string(const char *s, enum feed_mode *out)
+{
+    if (strcmp(s, "timeline") == 0)
+        *out = FEED_TIMELINE;
+    else if (strcmp(s, "merge") == 0)
+        *out = FEED_MERGE;
+    else
+        return -1;
+    return 0;
+}
+
+int feed_for_each(int viewer_id, const struct PostCursor *after, int max_size, post_visit_fn fn, void *ctx)
+{
+    if (atomic_load(&g_feed_mode) == FEED_MERGE)
+        return feed_merge_for_each(viewer_id, after, max_size, fn, ctx);
+    return timeline_for_each(viewer_id, after, max_size, fn, ctx);
+}
+
+static int stream_add(struct FeedStream **streams, int *count, int *cap, int author_id, int vis_mask,
+                      struct PostCursor bound)
+{
+    if (vis_mask == 0)
+        return 0;
+
+    if (*count == *cap)
+    {
+        int ncap = *cap ? *cap * 2 : 32;
+        struct FeedStream *n = realloc(*streams, (size_t)ncap * sizeof(*n));
+        if (!n)
+            return -1;
+        *streams = n;
+        *cap = ncap;
+    }
+
+    struct FeedStream *s = &(*streams)[(*count)++];
+    s->author_id = author_id;
+    s->vis_mask = vis_mask;
+    s->chunk = FEED_CHUNK_MIN;
+    s->exhausted = 0;
+    s->n = 0;
+    s->pos = 0;
+    s->bound = bound;
+    return 0;
+}
+
+/* Reads the next chunk of a stream, continuing below its last row (or the page cursor). */
+static int stream_fill(sqlite3 *db, struct FeedStream *s, struct PostCursor from)
+{
+    const char *sql_author =
+        "SELECT created_at, id FROM posts "
+        "WHERE author_id = ? AND (created_at, id) < (?, ?) "
+        "  AND visibility IN (?, ?, ?) "
+        "ORDER BY created_at DESC, id DESC "
+        "LIMIT ?;";
+
+    /*
+     * Public posts of public accounts are the one audience that is not
+     * per author; read them from the shared timeline kept by timeline.c
+     * rather than filtering posts by the author's profile on every row.
+     */
+    const char *sql_shared =
+        "SELECT created_at, post_id FROM timeline "
+        "WHERE user_id = 0 AND (created_at, post_id) < (?, ?) "
+        "ORDER BY created_at DESC, post_id DESC "
+        "LIMIT ?;";
+
+    sqlite3_stmt *stmt;
+    int rc = storage_prepare(db, s->author_id ? sql_author : sql_shared, &stmt);
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "[feed] stream prepare failed: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    int idx = 1;
+    if (s->author_id)
+    {
+        sqlite3_bind_int(stmt, idx++, s->author_id);
+        sqlite3_bind_int(stmt, idx++, from.created_at);
+        sqlite3_bind_int(stmt, idx++, from.id);
+        sqlite3_bind_int(stmt, idx++, (s->vis_mask & (1 << VIS_PUBLIC)) ? VIS_PUBLIC : -1);
+        sqlite3_bind_int(stmt, idx++, (s->vis_mask & (1 << VIS_FRIENDS)) ? VIS_FRIENDS : -1);
+        sqlite3_bind_int(stmt, idx++, (s->vis_mask & (1 << VIS_CLOSE_FRIENDS)) ? VIS_CLOSE_FRIENDS : -1);
+    }
+    else
+    {
+        sqlite3_bind_int(stmt, idx++, from.created_at);
+        sqlite3_bind_int(stmt, idx++, from.id);
+    }
+    sqlite3_bind_int(stmt, idx++, s->chunk);
+
+    s->n = 0;
+    s->pos = 0;
+    while (s->n < s->chunk && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        s->buf[s->n].created_at = sqlite3_column_int(stmt, 0);
+        s->buf[s->n].id = sqlite3_column_int(stmt, 1);
+        s->n++;
+    }
+
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "[feed] stream step failed: %s\n", sqlite3_errmsg(db));
+        storage_finalize(stmt);
+        return -1;
+    }
+    storage_finalize(stmt);
+
+    if (s->n < s->chunk)
+        s->exhausted = 1;
+    if (s->chunk < FEED_CHUNK_MAX)
+        s->chunk *= 2;
+    return s->n;
+}
+
+/* Next post of a stream, or its bound if nothing has been read yet. */
+static const struct PostCursor *stream_head(const struct FeedStream *s)
+{
+    return s->pos < s->n ? &s->buf[s->pos] : &s->bound;
+}
+
+static int head_before(const struct FeedStream *a, const struct FeedStream *b)
+{
+    const struct PostCursor *x = stream_head(a);
+    const struct PostCursor *y = stream_head(b);
+    if (x->created_at != y->created_at)
+        return x->created_at > y->created_at;
+    return x->id > y->id;
+}
+
+static void heap_down(struct FeedStream *streams, int *heap, int n, int i)
+{
+    for (;;)
+    {
+        int best = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && head_before(&streams[heap[l]], &streams[heap[best]]))
+            best = l;
+        if (r < n && head_before(&streams[heap[r]], &streams[heap[best]]))
+            best = r;
+        if (best == i)
+            return;
+        int tmp = heap[i];
+        heap[i] = heap[best];
+        heap[best] = tmp;
+        i = best;
+    }
+}
+
+/*
+ * Streams of everyone who lists the viewer as a friend, plus the viewer's
+ * own and the shared one. A friend's stream is bounded by the time of their
+ * newest post below start and left out if there is none; the other two are
+ * bounded by start itself.
+ */
+static int feed_collect_streams(sqlite3 *db, int viewer_id, struct PostCursor start,
+                                struct FeedStream **streams, int *count)
+{
+    const char *sql_rel =
+        "SELECT f2.user_id, f2.type, u.vis, "
+        "       EXISTS (SELECT 1 FROM friends f1 WHERE f1.user_id = ?1 AND f1.friend_id = f2.user_id), "
+        "       (SELECT created_at FROM posts "
+        "        WHERE author_id = f2.user_id AND (created_at, id) < (?2, ?3) "
+        "        ORDER BY created_at DESC, id DESC LIMIT 1) "
+        "FROM friends f2 "
+        "JOIN users u ON u.id = f2.user_id "
+        "WHERE f2.friend_id = ?1;";
+
+    const char *sql_self = "SELECT vis FROM users WHERE id = ?;";
+
+    int cap = 0;
+    const int all = (1 << VIS_PUBLIC) | (1 << VIS_FRIENDS) | (1 << VIS_CLOSE_FRIENDS);
+    sqlite3_stmt *stmt;
+
+    *streams = NULL;
+    *count = 0;
+
+    if (stream_add(streams, count, &cap, 0, 1 << VIS_PUBLIC, start) < 0)
+        return -1;
+
+    if (storage_prepare(db, sql_self, &stmt) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_int(stmt, 1, viewer_id);
+    int self_vis = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : USER_PRIVATE;
+    storage_finalize(stmt);
+
+    /* Public posts of public accounts already come from the shared stream. */
+    if (stream_add(streams, count, &cap, viewer_id,
+                   self_vis == USER_PUBLIC ? all & ~(1 << VIS_PUBLIC) : all, start) < 0)
+        return -1;
+
+    if (storage_prepare(db, sql_rel, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[feed] relations prepare failed: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, viewer_id);
+    sqlite3_bind_int(stmt, 2, start.created_at);
+    sqlite3_bind_int(stmt, 3, start.id);
+
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        if (sqlite3_column_type(stmt, 4) == SQLITE_NULL)
+            continue;
+
+        int author_id = sqlite3_column_int(stmt, 0);
+        int type      = sqlite3_column_int(stmt, 1);
+        int vis       = sqlite3_column_int(stmt, 2);
+        int mutual    = sqlite3_column_int(stmt, 3);
+        struct PostCursor bound = { sqlite3_column_int(stmt, 4), INT_MAX };
+        int mask      = 0;
+
+        if (mutual)
+        {
+            mask |= 1 << VIS_FRIENDS;
+            if (vis != USER_PUBLIC)
+                mask |= 1 << VIS_PUBLIC;
+        }
+        if (type == FRIEND_CLOSE)
+            mask |= 1 << VIS_CLOSE_FRIENDS;
+
+        if (stream_add(streams, count, &cap, author_id, mask, bound) < 0)
+        {
+            storage_finalize(stmt);
+            return -1;
+        }
+    }
+    storage_finalize(stmt);
+
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/* Loads the page's posts with one query, in the order the merge picked them. */
+static int feed_visit_page(sqlite3 *db, const int *ids, int n, post_visit_fn fn, void *ctx)
+{
+    const char *sql =
+        "SELECT p.id, p.author_id, u.name, p.visibility, p.content, p.created_at "
+        "FROM json_each(?) page "
+        "JOIN posts p ON p.id = page.value "
+        "JOIN users u ON u.id = p.author_id "
+        "ORDER BY page.key;";
+
+    if (n == 0)
+        return 0;
+
+    size_t cap = (size_t)n * FEED_JSON_INT + 3;
+    char *json = malloc(cap);
+    if (!json)
+        return -1;
+
+    size_t len = 0;
+    json[len++] = '[';
+    for (int i = 0; i < n; i++)
+        len += (size_t)snprintf(json + len, cap - len, "%s%d", i ? "," : "", ids[i]);
+    json[len++] = ']';
+    json[len] = '\0';
+
+    sqlite3_stmt *stmt;
+    if (storage_prepare(db, sql, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[feed] page prepare failed: %s\n", sqlite3_errmsg(db));
+        free(json);
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, json, (int)len, SQLITE_STATIC);
+    int count = posts_visit_stmt(stmt, n, fn, ctx);
+    free(json);
+    return count;
+}
+
+/* Merges the streams down to the ids of one page; returns how many it wrote to ids. */
+static int feed_merge_page(sqlite3 *db, struct FeedStream *streams, int nstreams, int *heap,
+                           struct PostCursor start, int max_size, int *ids)
+{
+    int nheap = nstreams;
+    for (int i = 0; i < nstreams; i++)
+        heap[i] = i;
+    for (int i = nheap / 2 - 1; i >= 0; i--)
+        heap_down(streams, heap, nheap, i);
+
+    int count = 0;
+    while (count < max_size && nheap > 0)
+    {
+        struct FeedStream *s = &streams[heap[0]];
+
+        /* Only an unread stream is empty at the top: its bound came up, so read it. */
+        if (s->pos == s->n)
+        {
+            int got = stream_fill(db, s, start);
+            if (got < 0)
+                return -1;
+            if (got == 0)
+                heap[0] = heap[--nheap];
+            heap_down(streams, heap, nheap, 0);
+            continue;
+        }
+
+        struct PostCursor cur = s->buf[s->pos++];
+        ids[count++] = cur.id;
+
+        if (s->pos == s->n)
+        {
+            int got = s->exhausted ? 0 : stream_fill(db, s, cur);
+            if (got < 0)
+                return -1;
+            if (got == 0)
+                heap[0] = heap[--nheap];
+        }
+        heap_down(streams, heap, nheap, 0);
+    }
+
+    return count;
+}
+
+int feed_merge_for_each(int viewer_id, const struct PostCursor *after, int max_size,
+                        post_visit_fn fn, void *ctx)
+{
+    if (max_size <= 0)
+        return 0;
+
+    struct PostCursor start = { INT_MAX, INT_MAX };
+    if (after)
+        start = *after;
+
+    struct FeedStream *streams = NULL;
+    int *heap = NULL;
+    int *ids = malloc((size_t)max_size * sizeof(*ids));
+    int nstreams = 0;
+    int count = -1;
+
+    if (!ids)
+        return -1;
+
+    sqlite3 *db = storage_read_begin();
+
+    /* One read transaction, so every stream sees the same snapshot. */
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+
+    if (feed_collect_streams(db, viewer_id, start, &streams, &nstreams) == 0 &&
+        (heap = malloc((size_t)nstreams * sizeof(*heap))) != NULL)
+        count = feed_merge_page(db, streams, nstreams, heap, start, max_size, ids);
+    if (count > 0)
+        count = feed_visit_page(db, ids, count, fn, ctx);
+
+    if (count < 0)
+        fprintf(stderr, "[feed] merge read failed for user %d\n", viewer_id);
+
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    storage_read_end(db);
+    free(ids);
+    free(heap);
+    free(streams);
+    return count;
+}
+
+int feed_merge_read(int viewer_id, const struct PostCursor *after, struct Post *out_array, int max_size)
+{
+    struct PostCollect pc = { out_array, 0 };
+    if (feed_merge_for_each(viewer_id, after, max_size, posts_collect_row, &pc) < 0)
+        return -1;
+    return pc.count;
+}
@@ -6,6 +6,11 @@
 #include "friends.h"
 #include "storage.h"
 #include "auth.h"
+#include "timeline.h"
+#include "graph.h"
+#include "connections.h"
+#include "buffer.h"
+#include "render.h"
 
 static int friends_upsert_one(int user_id, int friend_id, enum friend_type type)
 {
@@ -17,7 +22,7 @@ static int friends_upsert_one(int user_id, int friend_id, enum friend_type type)
 
     sqlite3_stmt *stmt = NULL;
 
-    int rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    int rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[friends] prepare upsert failed: %s\n", sqlite3_errmsg(g_db));
@@ -32,11 +37,11 @@ static int friends_upsert_one(int user_id, int friend_id, enum friend_type type)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[friends] upsert failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     return 0;
 }
 
@@ -46,16 +51,27 @@ int friends_add(int user_id, int friend_id, enum friend_type type)
         return 0;
 
     pthread_mutex_lock(&db_mutex);
-    int rc1 = friends_upsert_one(user_id, friend_id, type);
+    int rc = storage_write_begin();
+    if (rc == 0)
+    {
+        rc = friends_upsert_one(user_id, friend_id, type);
+        if (rc == 0)
+            rc = timeline_refresh_pair(user_id, friend_id);
+        if (rc == 0)
+            rc = timeline_check_degree(user_id);
+        rc = storage_write_end(rc);
+    }
+    /* The graph mirrors committed rows only. */
+    if (rc == 0)
+        graph_set_edge(user_id, friend_id, type);
     pthread_mutex_unlock(&db_mutex);
 
-    if (rc1 < 0)
-        return -1;
-    return 0;
+    return rc;
 }
 
-int friends_list_for_user(int user_id, struct Friendship *out_array, int max_size)
+int friends_list_for_user(int user_id, struct Arena *arena, int max_size, struct Friendship **out)
 {
+    *out = NULL;
     if (max_size <= 0) return 0;
 
     const char *sql =
@@ -67,34 +83,44 @@ int friends_list_for_user(int user_id, struct Friendship *out_array, int max_siz
 
     sqlite3_stmt *stmt = NULL;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    int rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    int rc = storage_prepare(db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[friends] prepare list failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[friends] prepare list failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, user_id);
     sqlite3_bind_int(stmt, 2, max_size);
 
-    int count = 0;
+    struct Friendship *rows = NULL;
+    int count = 0, cap = 0;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
     {
-        out_array[count].user_id_1 = sqlite3_column_int(stmt, 0);
-        out_array[count].user_id_2 = sqlite3_column_int(stmt, 1);
-        out_array[count].type      = (enum friend_type)sqlite3_column_int(stmt, 2);
+        if (!(rows = arena_grow(arena, rows, count, &cap, sizeof(*rows))))
+        {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        rows[count].user_id_1 = sqlite3_column_int(stmt, 0);
+        rows[count].user_id_2 = sqlite3_column_int(stmt, 1);
+        rows[count].type      = (enum friend_type)sqlite3_column_int(stmt, 2);
         count++;
     }
 
-    if (rc != SQLITE_DONE)
-        fprintf(stderr, "[friends] list select error: %s\n", sqlite3_errmsg(g_db));
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+    {
+        fprintf(stderr, "[friends] list select error: %s\n", sqlite3_errmsg(db));
+        count = -1;
+    }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
 
+    *out = rows;
     return count;
 }
 
@@ -108,19 +134,32 @@ static const char *friend_type_to_string(enum friend_type t)
     }
 }
 
-void format_friends_for_client(char *buf, size_t buf_size,
-                               struct Friendship *friends, int count,
-                               int current_user_id)
+static const struct RenderTemplate FRIEND_ROW = { 4, {
+    RENDER_SEG("\033[90m========== Friend #"),
+    RENDER_SEG(" ==========\033[0m\n\033[35mUsername:\033[0m "),
+    RENDER_SEG("\n\033[35mUser ID:\033[0m "),
+    RENDER_SEG("\n\033[35mType:\033[0m \033[33m"),
+    RENDER_SEG("\033[0m\n\n") } };
+
+/* user_id, username, type as SET_FRIEND_STATUS takes it */
+static const struct RenderTemplate FRIEND_ROW_COMPACT = { 3, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+void friends_send_for_client(int client_fd, enum output_mode mode,
+                             struct Friendship *friends, int count, int current_user_id)
 {
-    if (buf_size == 0) return;
+    struct OutBuf ob;
+    outbuf_init(&ob, client_fd, conn_sendv);
 
-    buf[0] = '\0';
-    int offset = 0;
+    if (mode == OUTPUT_COMPACT)
+        outbuf_printf(&ob, "OK FRIENDS %d\n", count);
+    else
+        outbuf_printf(&ob, "\033[32mOK\033[0m\nFRIENDS %d\n\n", count);
 
-    offset += snprintf(buf + offset, buf_size - offset,
-                       "\033[32mOK\033[0m\nFRIENDS %d\n\n", count);
-
-    for (int i = 0; i < count && offset < (int)buf_size - 1; i++)
+    for (int i = 0; i < count; i++)
     {
         struct Friendship *fr = &friends[i];
         int other_id =
@@ -129,19 +168,31 @@ void format_friends_for_client(char *buf, size_t buf_size,
         char other_name[64];
         auth_get_username_by_id(other_id, other_name, sizeof(other_name));
 
-        const char *type_str = friend_type_to_string(fr->type);
-
-        offset += snprintf(buf + offset, buf_size - offset,
-            "\033[90m========== Friend #%d ==========\033[0m\n"
-            "\033[35mUsername:\033[0m %s\n"
-            "\033[35mUser ID:\033[0m %d\n"
-            "\033[35mType:\033[0m \033[33m%s\033[0m\n\n",
-            i + 1,
-            other_name,
-            other_id,
-            type_str
-        );
+        if (mode == OUTPUT_COMPACT)
+        {
+            const struct RenderArg args[] = {
+                RENDER_INT(other_id),
+                RENDER_FIELD(other_name),
+                RENDER_STR(fr->type == FRIEND_CLOSE ? "CLOSE" : "NORMAL"),
+            };
+            render_row(&ob, &FRIEND_ROW_COMPACT, args);
+        }
+        else
+        {
+            const struct RenderArg args[] = {
+                RENDER_INT(i + 1),
+                RENDER_STR(other_name),
+                RENDER_INT(other_id),
+                RENDER_STR(friend_type_to_string(fr->type)),
+            };
+            render_row(&ob, &FRIEND_ROW, args);
+        }
     }
+
+    /* The decorated list has always ended at its last row; compact ones all close with END. */
+    if (mode == OUTPUT_COMPACT)
+        outbuf_append_ref(&ob, "END\n", 4);
+    outbuf_end(&ob);
 }
 
 int friends_delete(int user_id_1, const char *friend_username)
@@ -163,11 +214,18 @@ int friends_delete(int user_id_1, const char *friend_username)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    if (storage_write_begin() < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[friends] delete prepare failed: %s\n",
                 sqlite3_errmsg(g_db));
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
@@ -182,13 +240,34 @@ int friends_delete(int user_id_1, const char *friend_username)
     {
         fprintf(stderr, "[friends] delete step failed: %s\n",
                 sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     int changes = sqlite3_changes(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+
+    rc = 0;
+    if (changes > 0)
+    {
+        rc = timeline_refresh_pair(user_id_1, user_id_2);
+        if (rc == 0)
+            rc = timeline_check_degree(user_id_1);
+        if (rc == 0)
+            rc = timeline_check_degree(user_id_2);
+    }
+    if (storage_write_end(rc) < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+    if (changes > 0)
+    {
+        graph_remove_edge(user_id_1, user_id_2);
+        graph_remove_edge(user_id_2, user_id_1);
+    }
     pthread_mutex_unlock(&db_mutex);
 
     if (changes == 0)
@@ -209,11 +288,18 @@ int friends_change_status(int user_id, int friend_id, enum friend_type new_type)
     sqlite3_stmt *stmt;
     pthread_mutex_lock(&db_mutex);
 
-    int ok = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    if (storage_write_begin() < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    int ok = storage_prepare(g_db, sql, &stmt);
     if (ok != SQLITE_OK)
     {
         fprintf(stderr, "[friends] change_status prepare failed: %s\n",
                 sqlite3_errmsg(g_db));
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
@@ -227,13 +313,23 @@ int friends_change_status(int user_id, int friend_id, enum friend_type new_type)
     {
         fprintf(stderr, "[friends] change_status step failed: %s\n",
                 sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     int changes = sqlite3_changes(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+
+    ok = changes > 0 ? timeline_refresh_pair(user_id, friend_id) : 0;
+    if (storage_write_end(ok) < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+    if (changes > 0)
+        graph_set_edge(user_id, friend_id, new_type);
     pthread_mutex_unlock(&db_mutex);
 
     if (changes == 0)
@@ -243,38 +339,7 @@ int friends_change_status(int user_id, int friend_id, enum friend_type new_type)
 
 int friends_are_mutual(int a, int b)
 {
-    const char *sql =
-        "SELECT "
-        " (SELECT COUNT(*) FROM friends WHERE user_id=? AND friend_id=?) AS c1, "
-        " (SELECT COUNT(*) FROM friends WHERE user_id=? AND friend_id=?) AS c2;";
-
-    sqlite3_stmt *stmt = NULL;
-    int rc;
-
-    pthread_mutex_lock(&db_mutex);
-
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_int(stmt, 1, a);
-    sqlite3_bind_int(stmt, 2, b);
-    sqlite3_bind_int(stmt, 3, b);
-    sqlite3_bind_int(stmt, 4, a);
-
-    rc = sqlite3_step(stmt);
-    int ok = 0;
-    if (rc == SQLITE_ROW) {
-        int c1 = sqlite3_column_int(stmt, 0);
-        int c2 = sqlite3_column_int(stmt, 1);
-        ok = (c1 > 0 && c2 > 0);
-    }
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-    return ok;
+    return graph_are_mutual(a, b);
 }
 
 static int friends_request_exists(int from_id, int to_id)
@@ -284,10 +349,10 @@ static int friends_request_exists(int from_id, int to_id)
     sqlite3_stmt *stmt = NULL;
     int rc, found = 0;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) { pthread_mutex_unlock(&db_mutex); return -1; }
+    rc = storage_prepare(db, sql, &stmt);
+    if (rc != SQLITE_OK) { storage_read_end(db); return -1; }
 
     sqlite3_bind_int(stmt, 1, from_id);
     sqlite3_bind_int(stmt, 2, to_id);
@@ -295,8 +360,8 @@ static int friends_request_exists(int from_id, int to_id)
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW) found = 1;
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
     return found;
 }
 
@@ -323,7 +388,7 @@ int friends_request_send(int from_id, int to_id)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK) { pthread_mutex_unlock(&db_mutex); return -1; }
 
     sqlite3_bind_int(stmt, 1, from_id);
@@ -331,14 +396,15 @@ int friends_request_send(int from_id, int to_id)
     sqlite3_bind_int(stmt, 3, (int)time(NULL));
 
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return (rc == SQLITE_DONE) ? 0 : -1;
 }
 
-int friends_request_list(int to_id, struct FriendRequestInfo *out, int max)
+int friends_request_list(int to_id, struct Arena *arena, int max, struct FriendRequestInfo **out)
 {
+    *out = NULL;
     if (max <= 0) return 0;
 
     const char *sql =
@@ -352,28 +418,38 @@ int friends_request_list(int to_id, struct FriendRequestInfo *out, int max)
     sqlite3_stmt *stmt = NULL;
     int rc;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) { pthread_mutex_unlock(&db_mutex); return -1; }
+    rc = storage_prepare(db, sql, &stmt);
+    if (rc != SQLITE_OK) { storage_read_end(db); return -1; }
 
     sqlite3_bind_int(stmt, 1, to_id);
     sqlite3_bind_int(stmt, 2, max);
 
-    int count = 0;
+    struct FriendRequestInfo *rows = NULL;
+    int count = 0, cap = 0;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max)
     {
-        out[count].from_id = sqlite3_column_int(stmt, 0);
         const char *name = (const char*)sqlite3_column_text(stmt, 1);
-        out[count].created_at = sqlite3_column_int(stmt, 2);
-
-        strncpy(out[count].from_name, name ? name : "", sizeof(out[count].from_name)-1);
-        out[count].from_name[sizeof(out[count].from_name)-1] = '\0';
+        if (!(rows = arena_grow(arena, rows, count, &cap, sizeof(*rows))) ||
+            !(rows[count].from_name = arena_strndup(arena, name ? name : "",
+                                                    (size_t)sqlite3_column_bytes(stmt, 1))))
+        {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        rows[count].from_id = sqlite3_column_int(stmt, 0);
+        rows[count].created_at = sqlite3_column_int(stmt, 2);
         count++;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+        count = -1;
+
+    storage_finalize(stmt);
+    storage_read_end(db);
+
+    *out = rows;
     return count;
 }
 
@@ -390,7 +466,7 @@ int friends_request_reject(int me_id, const char *from_username)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK) { pthread_mutex_unlock(&db_mutex); return -1; }
 
     sqlite3_bind_int(stmt, 1, from_id);
@@ -399,7 +475,7 @@ int friends_request_reject(int me_id, const char *from_username)
     rc = sqlite3_step(stmt);
     int changes = sqlite3_changes(g_db);
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     if (rc != SQLITE_DONE) return -1;
@@ -427,14 +503,14 @@ int friends_request_accept_by_ids(int me_id, int from_id, enum friend_type my_ty
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK) { pthread_mutex_unlock(&db_mutex); return -1; }
 
     sqlite3_bind_int(stmt, 1, from_id);
     sqlite3_bind_int(stmt, 2, me_id);
 
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return (rc == SQLITE_DONE) ? 1 : -1;
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sqlite3.h>
+
+#include "graph.h"
+#include "storage.h"
+#include "epoch.h"
+
+/*
+ * In-memory copy of the friends table for the hot membership checks
+ * (are a and b mutual friends, is b a close friend of a). Directed edges
+ * user_id -> friend_id are kept in CSR form: offsets[u] .. offsets[u + 1]
+ * index the sorted neighbour ids of u and their friend_type.
+ *
+ * Readers never lock. A change copies the one row it touches into a
+ * separately allocated override and publishes it with an atomic store; the
+ * old copy is freed only after every reader that could still see it has
+ * left (epoch_synchronize). Once overrides pile up, or a user id outgrows
+ * the table, the whole CSR is rebuilt and swapped in the same way.
+ */
+
+#define GRAPH_SLACK_USERS 1024
+
+struct GraphRow
+{
+    int      count;
+    int     *ids;
+    uint8_t *types;
+};
+
+struct GraphSnapshot
+{
+    int       nusers;
+    int      *offsets;
+    int      *nbrs;
+    uint8_t  *types;
+    _Atomic(struct GraphRow *) *rows;   /* NULL: the row is in the CSR arrays */
+    int       overrides;                /* writer side only */
+    int       edges;                    /* writer side only */
+};
+
+static _Atomic(struct GraphSnapshot *) g_graph;
+static pthread_mutex_t g_graph_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_int g_edge_count;
+
+static struct GraphRow *row_alloc(int count)
+{
+    struct GraphRow *r = malloc(sizeof(*r) + (size_t)count * (sizeof(int) + 1));
+    if (!r)
+        return NULL;
+    r->count = count;
+    r->ids = (int *)(r + 1);
+    r->types = (uint8_t *)(r->ids + count);
+    return r;
+}
+
+/* Current neighbours of u in whichever form they are stored. */
+static int row_view(const struct GraphSnapshot *g, int u, const int **ids, const uint8_t **types)
+{
+    if (u < 0 || u >= g->nusers)
+    {
+        *ids = NULL;
+        *types = NULL;
+        return 0;
+    }
+
+    struct GraphRow *r = atomic_load_explicit(&g->rows[u], memory_order_acquire);
+    if (r)
+    {
+        *ids = r->ids;
+        *types = r->types;
+        return r->count;
+    }
+
+    *ids = g->nbrs + g->offsets[u];
+    *types = g->types + g->offsets[u];
+    return g->offsets[u + 1] - g->offsets[u];
+}
+
+static int row_find(const int *ids, int count, int v)
+{
+    int lo = 0, hi = count - 1;
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (ids[mid] == v)
+            return mid;
+        if (ids[mid] < v)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -(lo + 1);
+}
+
+static int snapshot_edge(const struct GraphSnapshot *g, int u, int v)
+{
+    const int *ids;
+    const uint8_t *types;
+    int n = row_view(g, u, &ids, &types);
+    int i = row_find(ids, n, v);
+    return i >= 0 ? types[i] : GRAPH_NO_EDGE;
+}
+
+static void snapshot_free(struct GraphSnapshot *g)
+{
+    if (!g)
+        return;
+    if (g->rows)
+    {
+        for (int u = 0; u < g->nusers; u++)
+            free(atomic_load(&g->rows[u]));
+        free(g->rows);
+    }
+    free(g->offsets);
+    free(g->nbrs);
+    free(g->types);
+    free(g);
+}
+
+static struct GraphSnapshot *snapshot_alloc(int nusers, int edges)
+{
+    struct GraphSnapshot *g = calloc(1, sizeof(*g));
+    if (!g)
+        return NULL;
+
+    g->nusers = nusers;
+    g->edges = edges;
+    g->offsets = calloc((size_t)nusers + 1, sizeof(int));
+    g->nbrs = malloc((size_t)(edges ? edges : 1) * sizeof(int));
+    g->types = malloc((size_t)(edges ? edges : 1));
+    g->rows = calloc((size_t)nusers, sizeof(*g->rows));
+
+    if (!g->offsets || !g->nbrs || !g->types || !g->rows)
+    {
+        snapshot_free(g);
+        return NULL;
+    }
+    return g;
+}
+
+/* Folds every override back into fresh CSR arrays holding at least nusers rows. Writer only. */
+static int graph_compact(struct GraphSnapshot *old, int nusers)
+{
+    if (nusers < old->nusers)
+        nusers = old->nusers;
+
+    struct GraphSnapshot *g = snapshot_alloc(nusers, old->edges);
+    if (!g)
+        return -1;
+
+    int pos = 0;
+    for (int u = 0; u < nusers; u++)
+    {
+        const int *ids;
+        const uint8_t *types;
+        int n = row_view(old, u, &ids, &types);
+
+        g->offsets[u] = pos;
+        if (n > 0)
+        {
+            memcpy(g->nbrs + pos, ids, (size_t)n * sizeof(int));
+            memcpy(g->types + pos, types, (size_t)n);
+        }
+        pos += n;
+    }
+    g->offsets[nusers] = pos;
+    g->edges = pos;
+
+    atomic_store(&g_graph, g);
+    epoch_synchronize();
+    snapshot_free(old);
+    return 0;
+}
+
+/* Replaces row u with a copy that has v inserted (type >= 0) or removed (type < 0). Writer only. */
+static int graph_update(int u, int v, int type)
+{
+    if (u < 0 || v < 0)
+        return -1;
+
+    struct GraphSnapshot *g = atomic_load(&g_graph);
+    if (!g)
+        return -1;
+
+    if (u >= g->nusers)
+    {
+        if (type < 0)
+            return 0;
+        if (graph_compact(g, u + 1 > 2 * g->nusers ? u + 1 : 2 * g->nusers) < 0)
+            return -1;
+        g = atomic_load(&g_graph);
+    }
+
+    const int *ids;
+    const uint8_t *types;
+    int n = row_view(g, u, &ids, &types);
+    int i = row_find(ids, n, v);
+
+    if (type >= 0 && i >= 0 && types[i] == type)
+        return 0;
+    if (type < 0 && i < 0)
+        return 0;
+
+    int count = n + (i < 0 ? 1 : 0) - (type < 0 ? 1 : 0);
+    struct GraphRow *r = row_alloc(count);
+    if (!r)
+        return -1;
+
+    if (type < 0)
+    {
+        memcpy(r->ids, ids, (size_t)i * sizeof(int));
+        memcpy(r->types, types, (size_t)i);
+        memcpy(r->ids + i, ids + i + 1, (size_t)(n - i - 1) * sizeof(int));
+        memcpy(r->types + i, types + i + 1, (size_t)(n - i - 1));
+        g->edges--;
+    }
+    else if (i >= 0)
+    {
+        memcpy(r->ids, ids, (size_t)n * sizeof(int));
+        memcpy(r->types, types, (size_t)n);
+        r->types[i] = (uint8_t)type;
+    }
+    else
+    {
+        int at = -i - 1;
+        memcpy(r->ids, ids, (size_t)at * sizeof(int));
+        memcpy(r->types, types, (size_t)at);
+        r->ids[at] = v;
+        r->types[at] = (uint8_t)type;
+        memcpy(r->ids + at + 1, ids + at, (size_t)(n - at) * sizeof(int));
+        memcpy(r->types + at + 1, types + at, (size_t)(n - at));
+        g->edges++;
+    }
+
+    struct GraphRow *old = atomic_exchange_explicit(&g->rows[u], r, memory_order_acq_rel);
+    if (old)
+    {
+        epoch_synchronize();
+        free(old);
+    }
+    else
+    {
+        g->overrides++;
+    }
+
+    atomic_store(&g_edge_count, g->edges);
+
+    if (g->overrides > g->nusers / 8 + GRAPH_SLACK_USERS)
+        graph_compact(g, g->nusers);
+    return 0;
+}
+
+int graph_set_edge(int user_id, int friend_id, enum friend_type type)
+{
+    pthread_mutex_lock(&g_graph_lock);
+    int rc = graph_update(user_id, friend_id, (int)type);
+    pthread_mutex_unlock(&g_graph_lock);
+    return rc;
+}
+
+int graph_remove_edge(int user_id, int friend_id)
+{
+    pthread_mutex_lock(&g_graph_lock);
+    int rc = graph_update(user_id, friend_id, -1);
+    pthread_mutex_unlock(&g_graph_lock);
+    return rc;
+}
+
+int graph_edge_type(int user_id, int friend_id)
+{
+    unsigned e = epoch_enter();
+    struct GraphSnapshot *g = atomic_load(&g_graph);
+    int type = g ? snapshot_edge(g, user_id, friend_id) : GRAPH_NO_EDGE;
+    epoch_exit(e);
+    return type;
+}
+
+int graph_are_mutual(int a, int b)
+{
+    unsigned e = epoch_enter();
+    struct GraphSnapshot *g = atomic_load(&g_graph);
+    int mutual = g && snapshot_edge(g, a, b) != GRAPH_NO_EDGE && snapshot_edge(g, b, a) != GRAPH_NO_EDGE;
+    epoch_exit(e);
+    return mutual;
+}
+
+int graph_edge_count(void)
+{
+    return atomic_load(&g_edge_count);
+}
+
+/* Loads the friends table; rows come out of the primary key already sorted. */
+int graph_init(void)
+{
+    const char *sql_max =
+        "SELECT MAX(COALESCE((SELECT MAX(id) FROM users), 0), "
+        "           COALESCE((SELECT MAX(user_id) FROM friends), 0)), "
+        "       (SELECT COUNT(*) FROM friends);";
+
+    const char *sql_edges =
+        "SELECT user_id, friend_id, type FROM friends ORDER BY user_id, friend_id;";
+
+    sqlite3_stmt *stmt;
+    int max_id = 0, edges = 0;
+
+    pthread_mutex_lock(&db_mutex);
+
+    if (storage_prepare(g_db, sql_max, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[graph] prepare failed: %s\n", sqlite3_errmsg(g_db));
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        max_id = sqlite3_column_int(stmt, 0);
+        edges = sqlite3_column_int(stmt, 1);
+    }
+    storage_finalize(stmt);
+
+    struct GraphSnapshot *g = snapshot_alloc(max_id + 1 + GRAPH_SLACK_USERS, edges);
+    if (!g)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    if (storage_prepare(g_db, sql_edges, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[graph] prepare edges failed: %s\n", sqlite3_errmsg(g_db));
+        pthread_mutex_unlock(&db_mutex);
+        snapshot_free(g);
+        return -1;
+    }
+
+    int pos = 0, u = 0;
+    while (pos < edges && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int from = sqlite3_column_int(stmt, 0);
+        if (from < 0 || from > max_id)
+            continue;
+        while (u <= from)
+            g->offsets[u++] = pos;
+        g->nbrs[pos] = sqlite3_column_int(stmt, 1);
+        g->types[pos] = (uint8_t)sqlite3_column_int(stmt, 2);
+        pos++;
+    }
+    while (u <= g->nusers)
+        g->offsets[u++] = pos;
+    g->edges = pos;
+
+    storage_finalize(stmt);
+    pthread_mutex_unlock(&db_mutex);
+
+    atomic_store(&g_edge_count, pos);
+    atomic_store(&g_graph, g);
+    printf("[graph] Loaded %d friendship edges for %d users.\n", pos, max_id);
+    return 0;
+}
+
+void graph_destroy(void)
+{
+    pthread_mutex_lock(&g_graph_lock);
+    struct GraphSnapshot *g = atomic_exchange(&g_graph, NULL);
+    epoch_synchronize();
+    snapshot_free(g);
+    pthread_mutex_unlock(&g_graph_lock);
+}
@@ -2,6 +2,8 @@
 #include "groups.h"
 #include "auth.h"
 #include "storage.h"
+#include "connections.h"
+#include "buffer.h"
 
 #include <sqlite3.h>
 #include <string.h>
@@ -24,7 +26,7 @@ static int groups_get_info(const char *name, int *out_group_id, int *out_is_publ
     if (out_owner_id)
         *out_owner_id  = -1;
 
-    rc = sqlite3_prepare_v3(g_db, sql, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_get_info] prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -39,10 +41,10 @@ static int groups_get_info(const char *name, int *out_group_id, int *out_is_publ
             *out_is_public = sqlite3_column_int(stmt, 1);
         if (out_owner_id)
             *out_owner_id = sqlite3_column_int(stmt, 2);
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         return 0;
     } else {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         return GROUP_ERR_NOT_FOUND;
     }
 }
@@ -56,7 +58,7 @@ int groups_create(int owner_id, const char *name, int is_public)
 
     const char *sql_check = "SELECT id FROM groups WHERE name = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v3(g_db, sql_check, -1, 0, &stmt, NULL);
+    int rc = storage_prepare(g_db, sql_check, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_create] prepare check failed: %s\n", sqlite3_errmsg(g_db));
@@ -68,16 +70,16 @@ int groups_create(int owner_id, const char *name, int is_public)
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_EXISTS;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_group =
         "INSERT INTO groups(name, owner_id, is_public) VALUES(?, ?, ?);";
 
-    rc = sqlite3_prepare_v3(g_db, sql_insert_group, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_group, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_create] prepare insert failed: %s\n", sqlite3_errmsg(g_db));
@@ -93,18 +95,18 @@ int groups_create(int owner_id, const char *name, int is_public)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[groups_create] insert group failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     int group_id = (int)sqlite3_last_insert_rowid(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_member =
         "INSERT INTO group_members(group_id, user_id, role) VALUES(?, ?, 1);";
 
-    rc = sqlite3_prepare_v3(g_db, sql_insert_member, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_member, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_create] prepare insert member failed: %s\n", sqlite3_errmsg(g_db));
@@ -119,12 +121,12 @@ int groups_create(int owner_id, const char *name, int is_public)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[groups_create] insert member failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return GROUP_OK;
@@ -158,7 +160,7 @@ int groups_join_public(int user_id, const char *group_name)
     const char *sql_check =
         "SELECT 1 FROM group_members WHERE group_id = ? AND user_id = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v3(g_db, sql_check, -1, 0, &stmt, NULL);
+    int rc = storage_prepare(g_db, sql_check, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_join_public] prepare check member failed: %s\n", sqlite3_errmsg(g_db));
@@ -172,16 +174,16 @@ int groups_join_public(int user_id, const char *group_name)
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_ALREADY_MEMBER;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert =
         "INSERT INTO group_members(group_id, user_id, role) VALUES(?, ?, 0);";
 
-    rc = sqlite3_prepare_v3(g_db, sql_insert, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_join_public] prepare insert failed: %s\n", sqlite3_errmsg(g_db));
@@ -196,12 +198,12 @@ int groups_join_public(int user_id, const char *group_name)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[groups_join_public] insert failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return GROUP_OK;
@@ -229,7 +231,7 @@ int groups_request_join(int user_id, const char *group_name)
     const char *sql_check_member =
         "SELECT 1 FROM group_members WHERE group_id = ? AND user_id = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v3(g_db, sql_check_member, -1, 0, &stmt, NULL);
+    int rc = storage_prepare(g_db, sql_check_member, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_request_join] prepare check member failed: %s\n", sqlite3_errmsg(g_db));
@@ -243,16 +245,16 @@ int groups_request_join(int user_id, const char *group_name)
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_ALREADY_MEMBER;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_req =
         "INSERT OR IGNORE INTO group_requests(group_id, user_id) VALUES(?, ?);";
 
-    rc = sqlite3_prepare_v3(g_db, sql_insert_req, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_req, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_request_join] prepare insert failed: %s\n", sqlite3_errmsg(g_db));
@@ -267,12 +269,12 @@ int groups_request_join(int user_id, const char *group_name)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[groups_request_join] insert failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return GROUP_OK;
@@ -301,7 +303,7 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
     const char *sql_check_admin =
         "SELECT role FROM group_members WHERE group_id = ? AND user_id = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v3(g_db, sql_check_admin, -1, 0, &stmt, NULL);
+    int rc = storage_prepare(g_db, sql_check_admin, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_approve_member] prepare check admin failed: %s\n", sqlite3_errmsg(g_db));
@@ -319,7 +321,7 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
         int role = sqlite3_column_int(stmt, 0);
         if (role == 1) is_admin = 1;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (!is_admin && admin_id != owner_id)
     {
@@ -327,22 +329,7 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
         return GROUP_ERR_NOT_ADMIN;
     }
 
-    const char *sql_user =
-        "SELECT id FROM users WHERE name = ?;";
-    rc = sqlite3_prepare_v3(g_db, sql_user, -1, 0, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[groups_approve_member] prepare user failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-    rc = sqlite3_step(stmt);
-    int user_id = -1;
-    if (rc == SQLITE_ROW)
-        user_id = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    int user_id = auth_get_user_id_by_name(username);
 
     if (user_id <= 0)
     {
@@ -352,7 +339,7 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
 
     const char *sql_check_req =
         "SELECT 1 FROM group_requests WHERE group_id = ? AND user_id = ?;";
-    rc = sqlite3_prepare_v3(g_db, sql_check_req, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_check_req, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_approve_member] prepare check req failed: %s\n", sqlite3_errmsg(g_db));
@@ -366,15 +353,15 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_ROW)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_NO_REQUEST;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_del_req =
         "DELETE FROM group_requests WHERE group_id = ? AND user_id = ?;";
-    rc = sqlite3_prepare_v3(g_db, sql_del_req, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_del_req, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_approve_member] prepare del req failed: %s\n", sqlite3_errmsg(g_db));
@@ -384,11 +371,11 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
     sqlite3_bind_int(stmt, 1, group_id);
     sqlite3_bind_int(stmt, 2, user_id);
     sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_member =
         "INSERT OR IGNORE INTO group_members(group_id, user_id, role) VALUES(?, ?, 0);";
-    rc = sqlite3_prepare_v3(g_db, sql_insert_member, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_member, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_approve_member] prepare insert member failed: %s\n", sqlite3_errmsg(g_db));
@@ -401,11 +388,11 @@ int groups_approve_member(int admin_id, const char *group_name, const char *user
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[groups_approve_member] insert member failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     pthread_mutex_unlock(&db_mutex);
     return GROUP_OK;
@@ -434,7 +421,7 @@ int groups_send_group_msg(int sender_id, const char *group_name, const char *tex
     const char *sql_check_member =
         "SELECT 1 FROM group_members WHERE group_id = ? AND user_id = ?;";
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v3(g_db, sql_check_member, -1, 0, &stmt, NULL);
+    int rc = storage_prepare(g_db, sql_check_member, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_send_group_msg] prepare check member failed: %s\n", sqlite3_errmsg(g_db));
@@ -448,17 +435,17 @@ int groups_send_group_msg(int sender_id, const char *group_name, const char *tex
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_ROW)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_NO_PERMISSION;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_msg =
         "INSERT INTO group_messages(group_id, sender_id, content, created_at) "
         "VALUES(?, ?, ?, ?);";
 
-    rc = sqlite3_prepare_v3(g_db, sql_insert_msg, -1, 0, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_msg, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_send_group_msg] prepare insert failed: %s\n", sqlite3_errmsg(g_db));
@@ -475,12 +462,12 @@ int groups_send_group_msg(int sender_id, const char *group_name, const char *tex
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[groups_send_group_msg] insert failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return GROUP_OK;
@@ -500,7 +487,7 @@ int groups_leave(int user_id, const char *group_name)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
         pthread_mutex_unlock(&db_mutex);
@@ -513,13 +500,13 @@ int groups_leave(int user_id, const char *group_name)
         group_id = sqlite3_column_int(stmt, 0);
     else
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
-    rc = sqlite3_prepare_v2(g_db, sql_remove_member, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_remove_member, &stmt);
     if (rc != SQLITE_OK)
     {
         pthread_mutex_unlock(&db_mutex);
@@ -532,13 +519,13 @@ int groups_leave(int user_id, const char *group_name)
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     int changes = sqlite3_changes(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     if (changes == 0)
@@ -546,9 +533,11 @@ int groups_leave(int user_id, const char *group_name)
     return GROUP_OK;
 }
 
-int groups_view_members(int requester_id, const char *group_name, struct GroupMemberInfo *out_array, int max_size)
+int groups_view_members(int requester_id, const char *group_name, struct Arena *arena, int max_size,
+                        struct GroupMemberInfo **out)
 {
-    if (requester_id <= 0 || !group_name || !out_array || max_size <= 0)
+    *out = NULL;
+    if (requester_id <= 0 || !group_name || max_size <= 0)
         return -1;
 
     const char *sql_find_group =
@@ -570,14 +559,14 @@ int groups_view_members(int requester_id, const char *group_name, struct GroupMe
     int rc;
     int group_id = -1;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups] prepare find_group failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
@@ -586,18 +575,18 @@ int groups_view_members(int requester_id, const char *group_name, struct GroupMe
     if ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
         group_id = sqlite3_column_int(stmt, 0);
     else {
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        storage_finalize(stmt);
+        storage_read_end(db);
         return GROUP_ERR_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
-    rc = sqlite3_prepare_v2(g_db, sql_check_member, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_check_member, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups] prepare check_member failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
@@ -607,63 +596,61 @@ int groups_view_members(int requester_id, const char *group_name, struct GroupMe
     int is_member = 0;
     if ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
         is_member = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (is_member <= 0)
     {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return GROUP_ERR_NO_PERMISSION;
     }
 
-    rc = sqlite3_prepare_v2(g_db, sql_list_members, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_list_members, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups] prepare list_members failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, group_id);
-    int count = 0;
+    struct GroupMemberInfo *rows = NULL;
+    int count = 0, cap = 0;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
     {
-        out_array[count].user_id = sqlite3_column_int(stmt, 0);
-
-        const unsigned char *uname = sqlite3_column_text(stmt, 1);
-        if (uname)
-        {
-            strncpy(out_array[count].username,
-                    (const char *)uname,
-                    sizeof(out_array[count].username) - 1);
-            out_array[count].username[
-                sizeof(out_array[count].username) - 1] = '\0';
-        }
-        else
+        const char *uname = (const char *)sqlite3_column_text(stmt, 1);
+        if (!(rows = arena_grow(arena, rows, count, &cap, sizeof(*rows))) ||
+            !(rows[count].username = arena_strndup(arena, uname ? uname : "",
+                                                   (size_t)sqlite3_column_bytes(stmt, 1))))
         {
-            out_array[count].username[0] = '\0';
+            rc = SQLITE_NOMEM;
+            break;
         }
+        rows[count].user_id = sqlite3_column_int(stmt, 0);
 
         int role = sqlite3_column_int(stmt, 2);
-        out_array[count].is_admin = (role != 0);
+        rows[count].is_admin = (role != 0);
         count++;
     }
 
-    if (rc != SQLITE_DONE)
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
     {
         fprintf(stderr, "[groups] list_members error: %s\n",
-                sqlite3_errmsg(g_db));
+                sqlite3_errmsg(db));
+        count = -1;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
 
+    *out = rows;
     return count;
 }
 
-int groups_list_for_user(int user_id, struct GroupInfo *out_array, int max_size)
+int groups_list_for_user(int user_id, struct Arena *arena, int max_size, struct GroupInfo **out)
 {
-    if (user_id <= 0 || !out_array || max_size <= 0)
+    *out = NULL;
+    if (user_id <= 0 || max_size <= 0)
         return -1;
 
     const char *sql =
@@ -676,54 +663,51 @@ int groups_list_for_user(int user_id, struct GroupInfo *out_array, int max_size)
     sqlite3_stmt *stmt = NULL;
     int rc;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups] prepare list_for_user failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, user_id);
 
-    int count = 0;
+    struct GroupInfo *rows = NULL;
+    int count = 0, cap = 0;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
     {
-        out_array[count].group_id  = sqlite3_column_int(stmt, 0);
-
-        const unsigned char *gname = sqlite3_column_text(stmt, 1);
-        if (gname)
-        {
-            strncpy(out_array[count].name,
-                    (const char *)gname,
-                    sizeof(out_array[count].name) - 1);
-            out_array[count].name[sizeof(out_array[count].name) - 1] = '\0';
-        }
-        else
+        const char *gname = (const char *)sqlite3_column_text(stmt, 1);
+        if (!(rows = arena_grow(arena, rows, count, &cap, sizeof(*rows))) ||
+            !(rows[count].name = arena_strndup(arena, gname ? gname : "",
+                                               (size_t)sqlite3_column_bytes(stmt, 1))))
         {
-            out_array[count].name[0] = '\0';
+            rc = SQLITE_NOMEM;
+            break;
         }
-
-        out_array[count].is_public = sqlite3_column_int(stmt, 2);
+        rows[count].group_id  = sqlite3_column_int(stmt, 0);
+        rows[count].is_public = sqlite3_column_int(stmt, 2);
 
         int role = sqlite3_column_int(stmt, 3);
-        out_array[count].is_admin = (role != 0);
+        rows[count].is_admin = (role != 0);
 
         count++;
     }
 
-    if (rc != SQLITE_DONE)
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
     {
         fprintf(stderr, "[groups] list_for_user error: %s\n",
-                sqlite3_errmsg(g_db));
+                sqlite3_errmsg(db));
+        count = -1;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
 
+    *out = rows;
     return count;
 }
 
@@ -774,10 +758,10 @@ void format_group_messages_for_client(char *buf, int buf_size, const char *group
     }
 }
 
-int groups_get_group_history(int requester_id, const char *group_name, struct Message *out_array, int max_size)
+int groups_for_each_group_message(int requester_id, const char *group_name, int max_size,
+                                  message_visit_fn fn, void *ctx)
 {
-    if (requester_id <= 0 || !group_name || !*group_name ||
-        !out_array || max_size <= 0)
+    if (requester_id <= 0 || !group_name || !*group_name || max_size <= 0)
         return -1;
 
     const char *sql_find_group =
@@ -789,7 +773,7 @@ int groups_get_group_history(int requester_id, const char *group_name, struct Me
         "WHERE group_id = ? AND user_id = ?;";
 
     const char *sql_list_msgs =
-        "SELECT gm.id, gm.sender_id, u.name, gm.content, gm.created_at "
+        "SELECT gm.id, gm.group_id, gm.sender_id, u.name, gm.content, gm.created_at "
         "FROM group_messages gm "
         "JOIN users u ON u.id = gm.sender_id "
         "WHERE gm.group_id = ? "
@@ -800,14 +784,14 @@ int groups_get_group_history(int requester_id, const char *group_name, struct Me
     int rc;
     int group_id = -1;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[groups_get_group_history] prepare find_group failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[groups_group_history] prepare find_group failed: %s\n",
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
@@ -817,18 +801,18 @@ int groups_get_group_history(int requester_id, const char *group_name, struct Me
     if (rc == SQLITE_ROW)
         group_id = sqlite3_column_int(stmt, 0);
     else {
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        storage_finalize(stmt);
+        storage_read_end(db);
         return -2;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
-    rc = sqlite3_prepare_v2(g_db, sql_check_member, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_check_member, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[groups_get_group_history] prepare check_member failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[groups_group_history] prepare check_member failed: %s\n",
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
@@ -839,69 +823,28 @@ int groups_get_group_history(int requester_id, const char *group_name, struct Me
     rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW)
         is_member = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (is_member <= 0)
     {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return -3;
     }
 
-    rc = sqlite3_prepare_v2(g_db, sql_list_msgs, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_list_msgs, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[groups_get_group_history] prepare list_msgs failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[groups_group_history] prepare list_msgs failed: %s\n",
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, group_id);
     sqlite3_bind_int(stmt, 2, max_size);
 
-    int count = 0;
-
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-    {
-        struct Message *m = &out_array[count];
-
-        m->id              = sqlite3_column_int(stmt, 0);
-        m->conversation_id = group_id;
-        m->sender_id       = sqlite3_column_int(stmt, 1);
-
-        const unsigned char *uname = sqlite3_column_text(stmt, 2);
-        if (uname) {
-            strncpy(m->sender_name,
-                    (const char*)uname,
-                    sizeof(m->sender_name) - 1);
-            m->sender_name[sizeof(m->sender_name) - 1] = '\0';
-        } else {
-            m->sender_name[0] = '\0';
-        }
-
-        const unsigned char *txt = sqlite3_column_text(stmt, 3);
-        if (txt) {
-            strncpy(m->content,
-                    (const char*)txt,
-                    sizeof(m->content) - 1);
-            m->content[sizeof(m->content) - 1] = '\0';
-        } else {
-            m->content[0] = '\0';
-        }
-
-        m->created_at = sqlite3_column_int(stmt, 4);
-
-        count++;
-    }
-
-    if (rc != SQLITE_DONE)
-    {
-        fprintf(stderr, "[groups_get_group_history] list_msgs error: %s\n",
-                sqlite3_errmsg(g_db));
-    }
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    int count = messages_visit_stmt(stmt, max_size, fn, ctx);
+    storage_read_end(db);
 
     return count;
 }
@@ -928,7 +871,7 @@ int groups_set_visibility(int admin_id, const char *group_name, int is_public)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_set_visibility] prepare find_group failed: %s\n",
@@ -947,11 +890,11 @@ int groups_set_visibility(int admin_id, const char *group_name, int is_public)
     }
     else
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (current_is_public == (is_public ? 1 : 0)) {
         pthread_mutex_unlock(&db_mutex);
@@ -965,7 +908,7 @@ int groups_set_visibility(int admin_id, const char *group_name, int is_public)
     }
     else
     {
-        rc = sqlite3_prepare_v2(g_db, sql_check_admin, -1, &stmt, NULL);
+        rc = storage_prepare(g_db, sql_check_admin, &stmt);
         if (rc != SQLITE_OK)
         {
             fprintf(stderr, "[groups_set_visibility] prepare check_admin failed: %s\n",
@@ -984,7 +927,7 @@ int groups_set_visibility(int admin_id, const char *group_name, int is_public)
             if (role == 1)
                 is_admin = 1;
         }
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
     }
 
     if (!is_admin)
@@ -993,7 +936,7 @@ int groups_set_visibility(int admin_id, const char *group_name, int is_public)
         return GROUP_ERR_NOT_ADMIN;
     }
 
-    rc = sqlite3_prepare_v2(g_db, sql_update_vis, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_update_vis, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[groups_set_visibility] prepare update failed: %s\n",
@@ -1010,12 +953,12 @@ int groups_set_visibility(int admin_id, const char *group_name, int is_public)
     {
         fprintf(stderr, "[groups_set_visibility] update failed: %s\n",
                 sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return GROUP_OK;
@@ -1032,9 +975,6 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
     const char *sql_check_admin =
         "SELECT role FROM group_members WHERE group_id = ? AND user_id = ?;";
 
-    const char *sql_get_user =
-        "SELECT id FROM users WHERE name = ?;";
-
     const char *sql_delete_member =
         "DELETE FROM group_members WHERE group_id = ? AND user_id = ?;";
 
@@ -1046,7 +986,7 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
         pthread_mutex_unlock(&db_mutex);
@@ -1062,17 +1002,17 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
     }
     else
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     int is_admin = 0;
     if (admin_id == owner_id) {
         is_admin = 1;
     } else {
-        rc = sqlite3_prepare_v2(g_db, sql_check_admin, -1, &stmt, NULL);
+        rc = storage_prepare(g_db, sql_check_admin, &stmt);
         if (rc != SQLITE_OK) {
             pthread_mutex_unlock(&db_mutex);
             return -1;
@@ -1086,7 +1026,7 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
             int role = sqlite3_column_int(stmt, 0);
             if (role == 1) is_admin = 1;
         }
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
     }
 
     if (!is_admin)
@@ -1095,19 +1035,7 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
         return GROUP_ERR_NOT_ADMIN;
     }
 
-    int user_id = -1;
-
-    rc = sqlite3_prepare_v2(g_db, sql_get_user, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-
-    if (sqlite3_step(stmt) == SQLITE_ROW)
-        user_id = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    int user_id = auth_get_user_id_by_name(username);
 
     if (user_id <= 0)
     {
@@ -1121,7 +1049,7 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
         return GROUP_ERR_NO_PERMISSION;
     }
 
-    rc = sqlite3_prepare_v2(g_db, sql_delete_member, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_delete_member, &stmt);
     if (rc != SQLITE_OK)
     {
         pthread_mutex_unlock(&db_mutex);
@@ -1132,7 +1060,7 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
     sqlite3_bind_int(stmt, 2, user_id);
 
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (rc != SQLITE_DONE)
     {
@@ -1148,9 +1076,11 @@ int groups_kick_member(int admin_id, const char *group_name, const char *usernam
     return GROUP_OK;
 }
 
-int groups_list_requests(int admin_id, const char *group_name, struct GroupRequestInfo *out_array, int max_size)
+int groups_list_requests(int admin_id, const char *group_name, struct Arena *arena, int max_size,
+                         struct GroupRequestInfo **out)
 {
-    if (admin_id <= 0 || !group_name || !out_array || max_size <= 0)
+    *out = NULL;
+    if (admin_id <= 0 || !group_name || max_size <= 0)
         return -1;
 
     const char *sql_find_group =
@@ -1172,12 +1102,12 @@ int groups_list_requests(int admin_id, const char *group_name, struct GroupReque
     int group_id = -1;
     int owner_id = -1;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return -1;
     }
 
@@ -1190,11 +1120,11 @@ int groups_list_requests(int admin_id, const char *group_name, struct GroupReque
     }
     else
     {
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        storage_finalize(stmt);
+        storage_read_end(db);
         return GROUP_ERR_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     int is_admin = 0;
     if (admin_id == owner_id)
@@ -1203,10 +1133,10 @@ int groups_list_requests(int admin_id, const char *group_name, struct GroupReque
     }
     else
     {
-        rc = sqlite3_prepare_v2(g_db, sql_check_admin, -1, &stmt, NULL);
+        rc = storage_prepare(db, sql_check_admin, &stmt);
         if (rc != SQLITE_OK)
         {
-            pthread_mutex_unlock(&db_mutex);
+            storage_read_end(db);
             return -1;
         }
 
@@ -1218,41 +1148,47 @@ int groups_list_requests(int admin_id, const char *group_name, struct GroupReque
             int role = sqlite3_column_int(stmt, 0);
             if (role == 1) is_admin = 1;
         }
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
     }
 
     if (!is_admin)
     {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return GROUP_ERR_NOT_ADMIN;
     }
 
-    rc = sqlite3_prepare_v2(g_db, sql_list_requests, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_list_requests, &stmt);
     if (rc != SQLITE_OK)
     {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, group_id);
 
-    int count = 0;
+    struct GroupRequestInfo *rows = NULL;
+    int count = 0, cap = 0;
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
     {
-        out_array[count].user_id = sqlite3_column_int(stmt, 0);
-
-        const unsigned char *uname = sqlite3_column_text(stmt, 1);
-        if (uname)
-            strncpy(out_array[count].username, (const char *)uname, sizeof(out_array[count].username) - 1);
-        else
-            out_array[count].username[0] = '\0';
-
+        const char *uname = (const char *)sqlite3_column_text(stmt, 1);
+        if (!(rows = arena_grow(arena, rows, count, &cap, sizeof(*rows))) ||
+            !(rows[count].username = arena_strndup(arena, uname ? uname : "",
+                                                   (size_t)sqlite3_column_bytes(stmt, 1))))
+        {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        rows[count].user_id = sqlite3_column_int(stmt, 0);
         count++;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+        count = -1;
+
+    storage_finalize(stmt);
+    storage_read_end(db);
 
+    *out = rows;
     return count;
 }
 
@@ -1267,9 +1203,6 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
     const char *sql_check_admin =
         "SELECT role FROM group_members WHERE group_id = ? AND user_id = ?;";
 
-    const char *sql_find_user =
-        "SELECT id FROM users WHERE name = ?;";
-
     const char *sql_check_request =
         "SELECT 1 FROM group_requests WHERE group_id = ? AND user_id = ?;";
 
@@ -1283,7 +1216,7 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql_find_group, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_find_group, &stmt);
     if (rc != SQLITE_OK)
     {
         pthread_mutex_unlock(&db_mutex);
@@ -1298,17 +1231,17 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
     }
     else
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return GROUP_ERR_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     int is_admin = (admin_id == owner_id);
 
     if (!is_admin)
     {
-        rc = sqlite3_prepare_v2(g_db, sql_check_admin, -1, &stmt, NULL);
+        rc = storage_prepare(g_db, sql_check_admin, &stmt);
         if (rc == SQLITE_OK) {
             sqlite3_bind_int(stmt, 1, group_id);
             sqlite3_bind_int(stmt, 2, admin_id);
@@ -1318,7 +1251,7 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
                 if (role == 1) is_admin = 1;
             }
         }
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
     }
 
     if (!is_admin)
@@ -1327,15 +1260,7 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
         return GROUP_ERR_NOT_ADMIN;
     }
 
-    int user_id = -1;
-    rc = sqlite3_prepare_v2(g_db, sql_find_user, -1, &stmt, NULL);
-    if (rc == SQLITE_OK)
-    {
-        sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
-        if (sqlite3_step(stmt) == SQLITE_ROW)
-            user_id = sqlite3_column_int(stmt, 0);
-    }
-    sqlite3_finalize(stmt);
+    int user_id = auth_get_user_id_by_name(username);
 
     if (user_id <= 0)
     {
@@ -1343,7 +1268,7 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
         return GROUP_ERR_NOT_FOUND;
     }
 
-    rc = sqlite3_prepare_v2(g_db, sql_check_request, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_check_request, &stmt);
     if (rc == SQLITE_OK)
     {
         sqlite3_bind_int(stmt, 1, group_id);
@@ -1351,14 +1276,14 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
 
         if (sqlite3_step(stmt) != SQLITE_ROW)
         {
-            sqlite3_finalize(stmt);
+            storage_finalize(stmt);
             pthread_mutex_unlock(&db_mutex);
             return GROUP_ERR_NO_REQUEST;
         }
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
-    rc = sqlite3_prepare_v2(g_db, sql_delete_request, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_delete_request, &stmt);
     if (rc == SQLITE_OK)
     {
         sqlite3_bind_int(stmt, 1, group_id);
@@ -1366,15 +1291,16 @@ int groups_reject_request(int admin_id, const char *group_name, const char *user
         sqlite3_step(stmt);
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return GROUP_OK;
 }
 
-int groups_list_member_ids(const char *group_name, int *out_ids, int max_ids)
+int groups_list_member_ids(const char *group_name, int **out_ids)
 {
-    if (!group_name || !out_ids || max_ids <= 0) return -1;
+    if (!group_name || !out_ids) return -1;
+    *out_ids = NULL;
 
     const char *sql =
         "SELECT gm.user_id "
@@ -1386,85 +1312,44 @@ int groups_list_member_ids(const char *group_name, int *out_ids, int max_ids)
     sqlite3_stmt *stmt = NULL;
     int rc;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql, &stmt);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "[groups_list_member_ids] prepare failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[groups_list_member_ids] prepare failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_text(stmt, 1, group_name, -1, SQLITE_TRANSIENT);
 
-    int count = 0;
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_ids) {
-        out_ids[count++] = sqlite3_column_int(stmt, 0);
+    int *ids = NULL;
+    int count = 0, cap = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            int *grown = realloc(ids, (size_t)cap * sizeof(int));
+            if (!grown) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            ids = grown;
+        }
+        ids[count++] = sqlite3_column_int(stmt, 0);
     }
 
     if (rc != SQLITE_DONE) {
-        fprintf(stderr, "[groups_list_member_ids] step failed: %s\n", sqlite3_errmsg(g_db));
+        fprintf(stderr, "[groups_list_member_ids] step failed: %s\n", sqlite3_errmsg(db));
+        storage_finalize(stmt);
+        storage_read_end(db);
+        free(ids);
+        return -1;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
 
+    *out_ids = ids;
     return count;
 }
 
-static void write_all(int fd, const char *buf, size_t len)
-{
-    size_t off = 0;
-    while (off < len) {
-        ssize_t n = write(fd, buf + off, len - off);
-        if (n <= 0) return;
-        off += (size_t)n;
-    }
-}
-
-void group_messages_send_for_client(int client_fd,
-                                    const char *group_name,
-                                    struct Message *msgs, int count,
-                                    int current_user_id)
-{
-    char out[4096];
-    int off = 0;
-
-    if (!group_name) group_name = "";
-
-    off = snprintf(out, sizeof(out),
-                   "\033[32mOK\033[0m\nGROUP_MESSAGES %d\n"
-                   "\033[35mGroup:\033[0m \033[36m%s\033[0m\n\n",
-                   count, group_name);
-    write_all(client_fd, out, (size_t)off);
-
-    for (int i = 0; i < count; i++) {
-        struct Message *m = &msgs[i];
-
-        char timebuf[64] = {0};
-        time_t t = (time_t)m->created_at;
-        struct tm tm_info;
-        localtime_r(&t, &tm_info);
-        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm_info);
-
-        const char *side = msg_side_label(m->sender_id, current_user_id);
-        const char *sender_color = msg_sender_color(m->sender_id, current_user_id);
-
-        off = snprintf(out, sizeof(out),
-                       "\033[90m========== Group Message #%d ==========\033[0m\n"
-                       "\033[35mFrom:\033[0m %s%s\033[0m (%s)\n"
-                       "\033[35mTime:\033[0m \033[34m%s\033[0m\n"
-                       "\033[35mContent:\033[0m\n%s\n\n",
-                       m->id,
-                       sender_color,
-                       m->sender_name,
-                       side,
-                       timebuf,
-                       m->content);
-
-        write_all(client_fd, out, (size_t)off);
-    }
-
-    write_all(client_fd, "END\n", 4);
-}
-
@@ -0,0 +1,223 @@
+#include "common.h"
+#include "hash_pool.h"
+
+/*
+ * Jobs wait in one FIFO per peer address and the threads serve the peers
+ * round robin, so one address flooding LOGIN only delays its own requests.
+ * The queue is bounded in total and per peer; a job that does not fit is
+ * refused and the caller answers the client right away.
+ */
+
+struct HashJob
+{
+    hash_job_fn     fn;
+    void           *arg;
+    struct HashJob *next;
+};
+
+struct HashPeer
+{
+    uint32_t         addr;
+    int              count;
+    struct HashJob  *head;
+    struct HashJob  *tail;
+    struct HashPeer *next;      /* ring of peers with queued jobs */
+};
+
+static struct HashJob  g_jobs[HASH_QUEUE_DEPTH];
+static struct HashPeer g_peers[HASH_QUEUE_DEPTH];
+static struct HashJob  *g_free_jobs;
+static struct HashPeer *g_free_peers;
+static struct HashPeer *g_ring;       /* next peer to serve */
+static struct HashPeer *g_ring_tail;  /* g_ring_tail->next == g_ring */
+
+static pthread_t g_threads[HASH_POOL_MAX_THREADS];
+static int g_nthreads = 0;
+static int g_stop = 0;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_cond = PTHREAD_COND_INITIALIZER;
+
+/* Caller holds g_lock. */
+static struct HashPeer *peer_find(uint32_t addr)
+{
+    struct HashPeer *p = g_ring;
+    if (!p)
+        return NULL;
+    do
+    {
+        if (p->addr == addr)
+            return p;
+        p = p->next;
+    } while (p != g_ring);
+    return NULL;
+}
+
+/* Caller holds g_lock. Appends a peer at the back of the ring. */
+static void ring_push(struct HashPeer *p)
+{
+    if (!g_ring)
+    {
+        p->next = p;
+        g_ring = g_ring_tail = p;
+        return;
+    }
+    p->next = g_ring;
+    g_ring_tail->next = p;
+    g_ring_tail = p;
+}
+
+/* Caller holds g_lock and the ring is not empty. Takes one job from the front peer. */
+static struct HashJob *ring_take(void)
+{
+    struct HashPeer *p = g_ring;
+    struct HashJob *job = p->head;
+
+    p->head = job->next;
+    if (!p->head)
+        p->tail = NULL;
+    p->count--;
+
+    if (p->count > 0)
+    {
+        /* Rotate: the peer goes to the back and waits for its next turn. */
+        g_ring_tail = p;
+        g_ring = p->next;
+    }
+    else
+    {
+        if (p->next == p)
+        {
+            g_ring = g_ring_tail = NULL;
+        }
+        else
+        {
+            g_ring = p->next;
+            g_ring_tail->next = g_ring;
+        }
+        p->next = g_free_peers;
+        g_free_peers = p;
+    }
+    return job;
+}
+
+static void *hash_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&g_lock);
+    while (1)
+    {
+        while (!g_ring && !g_stop)
+            pthread_cond_wait(&g_cond, &g_lock);
+        if (!g_ring)
+            break;
+
+        struct HashJob *job = ring_take();
+        hash_job_fn fn = job->fn;
+        void *job_arg = job->arg;
+        job->next = g_free_jobs;
+        g_free_jobs = job;
+
+        pthread_mutex_unlock(&g_lock);
+        fn(job_arg);
+        pthread_mutex_lock(&g_lock);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+int hash_pool_start(int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = HASH_POOL_DEFAULT_THREADS;
+    if (nthreads > HASH_POOL_MAX_THREADS)
+        nthreads = HASH_POOL_MAX_THREADS;
+
+    g_free_jobs = NULL;
+    g_free_peers = NULL;
+    for (int i = HASH_QUEUE_DEPTH - 1; i >= 0; i--)
+    {
+        g_jobs[i].next = g_free_jobs;
+        g_free_jobs = &g_jobs[i];
+        g_peers[i].next = g_free_peers;
+        g_free_peers = &g_peers[i];
+    }
+    g_ring = g_ring_tail = NULL;
+    g_stop = 0;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&g_threads[i], NULL, hash_main, NULL) != 0)
+        {
+            fprintf(stderr, "[hash] Cannot start hashing thread %d\n", i);
+            g_nthreads = i;
+            hash_pool_stop();
+            return -1;
+        }
+    }
+    g_nthreads = nthreads;
+
+    printf("[hash] Started %d hashing threads (queue depth %d, %d per peer)\n",
+           nthreads, HASH_QUEUE_DEPTH, HASH_QUEUE_PER_PEER);
+    return 0;
+}
+
+int hash_pool_submit(uint32_t peer, hash_job_fn fn, void *arg)
+{
+    if (!fn)
+        return -1;
+
+    pthread_mutex_lock(&g_lock);
+    if (g_stop || g_nthreads == 0 || !g_free_jobs)
+    {
+        pthread_mutex_unlock(&g_lock);
+        return -1;
+    }
+
+    struct HashPeer *p = peer_find(peer);
+    if (p && p->count >= HASH_QUEUE_PER_PEER)
+    {
+        pthread_mutex_unlock(&g_lock);
+        return -1;
+    }
+    if (!p)
+    {
+        p = g_free_peers;
+        g_free_peers = p->next;
+        p->addr = peer;
+        p->count = 0;
+        p->head = p->tail = NULL;
+        ring_push(p);
+    }
+
+    struct HashJob *job = g_free_jobs;
+    g_free_jobs = job->next;
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    if (p->tail)
+        p->tail->next = job;
+    else
+        p->head = job;
+    p->tail = job;
+    p->count++;
+
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+/* Runs whatever is still queued, then joins the threads. */
+void hash_pool_stop(void)
+{
+    pthread_mutex_lock(&g_lock);
+    g_stop = 1;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+
+    for (int i = 0; i < g_nthreads; i++)
+        pthread_join(g_threads[i], NULL);
+    g_nthreads = 0;
+}
@@ -2,10 +2,86 @@
 #include "common.h"
 #include "storage.h"
 #include "sessions.h"
+#include "worker_pool.h"
+#include "hash_pool.h"
+#include "feed.h"
+#include "graph.h"
+#include "userdir.h"
 #include <sodium.h>
+#include <getopt.h>
 
-int main(void)
+static void usage(const char *prog)
 {
+    fprintf(stderr, "Usage: %s [-w|--workers N] [-H|--hashers N] [-f|--feed MODE]\n", prog);
+    fprintf(stderr, "  -w, --workers N   command worker threads (default: %d, one per core)\n",
+            worker_pool_default_size());
+    fprintf(stderr, "  -H, --hashers N   password hashing threads, 64 MB each (default: %d)\n",
+            HASH_POOL_DEFAULT_THREADS);
+    fprintf(stderr, "  -f, --feed MODE   VIEW_FEED engine: timeline (default) or merge\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int workers = worker_pool_default_size();
+    int hashers = HASH_POOL_DEFAULT_THREADS;
+
+    static const struct option long_opts[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "hashers", required_argument, NULL, 'H' },
+        { "feed",    required_argument, NULL, 'f' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:H:f:h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+            {
+                char *end = NULL;
+                long n = strtol(optarg, &end, 10);
+                if (!end || *end != '\0' || n < 1 || n > WORKER_POOL_MAX_THREADS)
+                {
+                    fprintf(stderr, "Invalid worker count '%s' (1..%d)\n", optarg, WORKER_POOL_MAX_THREADS);
+                    return 1;
+                }
+                workers = (int)n;
+                break;
+            }
+            case 'H':
+            {
+                char *end = NULL;
+                long n = strtol(optarg, &end, 10);
+                if (!end || *end != '\0' || n < 1 || n > HASH_POOL_MAX_THREADS)
+                {
+                    fprintf(stderr, "Invalid hasher count '%s' (1..%d)\n", optarg, HASH_POOL_MAX_THREADS);
+                    return 1;
+                }
+                hashers = (int)n;
+                break;
+            }
+            case 'f':
+            {
+                enum feed_mode mode;
+                if (feed_mode_from_string(optarg, &mode) < 0)
+                {
+                    fprintf(stderr, "Invalid feed mode '%s' (timeline or merge)\n", optarg);
+                    return 1;
+                }
+                feed_set_mode(mode);
+                break;
+            }
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
     signal(SIGPIPE, SIG_IGN);
     if (sodium_init() < 0)
     {
@@ -16,16 +92,26 @@ int main(void)
     if (storage_init("data/virtualsoc.db") < 0)
         return 1;
 
+    if (userdir_init() < 0 || graph_init() < 0)
+    {
+        storage_close();
+        return 1;
+    }
+
     sessions_init();
 
     int sockfd = server_start(PORT);
     if (sockfd < 0)
     {
         printf("[server] Failed to start server");
+        graph_destroy();
+        userdir_destroy();
         storage_close();
         return 1;
     }
-    server_run(sockfd);
+    server_run(sockfd, workers, hashers);
+    graph_destroy();
+    userdir_destroy();
     storage_close();
     return 0;
 }
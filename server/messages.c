@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
@@ -7,6 +8,10 @@
 #include "messages.h"
 #include "storage.h"
 #include "models.h"
+#include "connections.h"
+#include "buffer.h"
+#include "protocol.h"
+#include "render.h"
 
 static void sort_pair(int *a, int *b)
 {
@@ -39,7 +44,7 @@ int messages_find_or_create_dm(int user1_id, int user2_id)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql_find, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_find, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[messages] find DM prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -54,17 +59,17 @@ int messages_find_or_create_dm(int user1_id, int user2_id)
     if (rc == SQLITE_ROW)
     {
         conv_id = sqlite3_column_int(stmt, 0);
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return conv_id;
     }
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_conv =
         "INSERT INTO conversations(title, is_group, visibility, created_by, created_at) "
         "VALUES (?, 0, 2, ?, ?);";
 
-    rc = sqlite3_prepare_v2(g_db, sql_insert_conv, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_conv, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[messages] insert conv prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -80,19 +85,19 @@ int messages_find_or_create_dm(int user1_id, int user2_id)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[messages] insert conv failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     conv_id = (int)sqlite3_last_insert_rowid(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     const char *sql_insert_member =
         "INSERT INTO conversation_members(conversation_id, user_id, joined_at) "
         "VALUES (?, ?, ?);";
 
-    rc = sqlite3_prepare_v2(g_db, sql_insert_member, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_insert_member, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[messages] insert member prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -107,7 +112,7 @@ int messages_find_or_create_dm(int user1_id, int user2_id)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[messages] insert member1 failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
@@ -121,12 +126,12 @@ int messages_find_or_create_dm(int user1_id, int user2_id)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[messages] insert member2 failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return conv_id;
@@ -146,7 +151,7 @@ int messages_add(int conversation_id, int sender_id, const char *content)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[messages] insert msg prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -163,19 +168,67 @@ int messages_add(int conversation_id, int sender_id, const char *content)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[messages] insert msg failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     msg_id = (int)sqlite3_last_insert_rowid(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     return msg_id;
 }
 
-int messages_get_history_dm(int user1_id, int user2_id, struct Message *out_array, int max_size)
+/*
+ * Steps a bound message query (id, conversation_id, sender_id, sender name,
+ * content, created_at) and hands every row to fn while the statement still
+ * owns it. Finalizes the statement; returns the rows visited or -1.
+ */
+int messages_visit_stmt(sqlite3_stmt *stmt, int max_size, message_visit_fn fn, void *ctx)
+{
+    int count = 0;
+    int rc = SQLITE_DONE;
+
+    while (count < max_size && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        const char *name = (const char *)sqlite3_column_text(stmt, 3);
+        const char *txt  = (const char *)sqlite3_column_text(stmt, 4);
+
+        struct Message m;
+        m.id              = sqlite3_column_int(stmt, 0);
+        m.conversation_id = sqlite3_column_int(stmt, 1);
+        m.sender_id       = sqlite3_column_int(stmt, 2);
+        m.sender_name     = name ? name : "";
+        m.content         = txt ? txt : "";
+        m.created_at      = (time_t)sqlite3_column_int(stmt, 5);
+
+        count++;
+        if (fn(&m, ctx) != 0)
+        {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+    {
+        fprintf(stderr, "[messages] select error: %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        count = -1;
+    }
+
+    storage_finalize(stmt);
+    return count;
+}
+
+/*
+ * One page of a DM, newest page first: the max_size messages with id below
+ * before_id (or the latest ones when before_id <= 0), visited oldest first.
+ * Walks idx_messages_conversation_id backwards, so the cost depends on the
+ * page size only, not on how long the conversation is.
+ */
+int messages_for_each_dm(int user1_id, int user2_id, int before_id, int max_size,
+                         message_visit_fn fn, void *ctx)
 {
     if (max_size <= 0)
         return 0;
@@ -193,13 +246,13 @@ int messages_get_history_dm(int user1_id, int user2_id, struct Message *out_arra
         sqlite3_stmt *stmt;
         int rc;
 
-        pthread_mutex_lock(&db_mutex);
+        sqlite3 *db = storage_read_begin();
 
-        rc = sqlite3_prepare_v2(g_db, sql_find, -1, &stmt, NULL);
+        rc = storage_prepare(db, sql_find, &stmt);
         if (rc != SQLITE_OK)
         {
-            fprintf(stderr, "[messages] history find DM prepare failed: %s\n", sqlite3_errmsg(g_db));
-            pthread_mutex_unlock(&db_mutex);
+            fprintf(stderr, "[messages] history find DM prepare failed: %s\n", sqlite3_errmsg(db));
+            storage_read_end(db);
             return -1;
         }
 
@@ -210,74 +263,45 @@ int messages_get_history_dm(int user1_id, int user2_id, struct Message *out_arra
         if (rc == SQLITE_ROW)
             conv_id = sqlite3_column_int(stmt, 0);
         else if (rc != SQLITE_DONE)
-            fprintf(stderr, "[messages] history find DM error: %s\n", sqlite3_errmsg(g_db));
+            fprintf(stderr, "[messages] history find DM error: %s\n", sqlite3_errmsg(db));
 
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        storage_finalize(stmt);
+        storage_read_end(db);
     }
 
     if (conv_id <= 0)
         return 0;
 
+    /* The inner query takes the page newest first; the outer one flips it into reading order. */
     const char *sql_msgs =
-        "SELECT m.id, m.conversation_id, m.sender_id, u.name, m.content, m.created_at "
-        "FROM messages m "
-        "JOIN users u ON u.id = m.sender_id "
-        "WHERE m.conversation_id = ? "
-        "ORDER BY m.created_at ASC;";
+        "SELECT * FROM ("
+        "  SELECT m.id, m.conversation_id, m.sender_id, u.name, m.content, m.created_at "
+        "  FROM messages m "
+        "  JOIN users u ON u.id = m.sender_id "
+        "  WHERE m.conversation_id = ? AND m.id < ? "
+        "  ORDER BY m.id DESC "
+        "  LIMIT ?) "
+        "ORDER BY id ASC;";
 
     sqlite3_stmt *stmt;
     int rc;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql_msgs, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_msgs, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[messages] history prepare failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[messages] history prepare failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, conv_id);
+    sqlite3_bind_int(stmt, 2, before_id > 0 ? before_id : INT_MAX);
+    sqlite3_bind_int(stmt, 3, max_size);
 
-    int count = 0;
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-    {
-        out_array[count].id             = sqlite3_column_int(stmt, 0);
-        out_array[count].conversation_id = sqlite3_column_int(stmt, 1);
-        out_array[count].sender_id      = sqlite3_column_int(stmt, 2);
-
-        const unsigned char *name = sqlite3_column_text(stmt, 3);
-        if (name) {
-            strncpy(out_array[count].sender_name,
-                    (const char *)name,
-                    sizeof(out_array[count].sender_name) - 1);
-            out_array[count].sender_name[sizeof(out_array[count].sender_name) - 1] = '\0';
-        } else {
-            out_array[count].sender_name[0] = '\0';
-        }
-
-        const unsigned char *txt = sqlite3_column_text(stmt, 4);
-        if (txt) {
-            strncpy(out_array[count].content,
-                    (const char *)txt,
-                    sizeof(out_array[count].content) - 1);
-            out_array[count].content[sizeof(out_array[count].content) - 1] = '\0';
-        } else {
-            out_array[count].content[0] = '\0';
-        }
-
-        out_array[count].created_at = (time_t)sqlite3_column_int(stmt, 5);
-
-        count++;
-    }
-
-    if (rc != SQLITE_DONE)
-        fprintf(stderr, "[messages] history select error: %s\n", sqlite3_errmsg(g_db));
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-
+    int count = messages_visit_stmt(stmt, max_size, fn, ctx);
+    storage_read_end(db);
     return count;
 }
 
@@ -333,55 +357,136 @@ void format_messages_for_client(char *buf, size_t buf_size, struct Message *msgs
     }
 }
 
-static void write_all(int fd, const char *buf, size_t len)
+void messages_page_begin(struct MessagePage *pg, int client_fd, enum output_mode mode,
+                         int viewer_id, const char *group_name)
+{
+    outbuf_init(&pg->ob, client_fd, conn_sendv);
+    pg->mode = mode;
+    pg->viewer_id = viewer_id;
+    pg->group_name = group_name;
+    pg->count = 0;
+    pg->first_id = 0;
+}
+
+static const struct RenderTemplate DM_ROW = { 7, {
+    RENDER_SEG("\033[90m========== Message #"),
+    RENDER_SEG(" ==========\033[0m\n\033[35mConversation:\033[0m "),
+    RENDER_SEG("\n\033[35mFrom:\033[0m "),
+    RENDER_SEG(""),
+    RENDER_SEG("\033[0m ("),
+    RENDER_SEG(")\n\033[35mTime:\033[0m \033[34m"),
+    RENDER_SEG("\033[0m\n\033[35mContent:\033[0m\n"),
+    RENDER_SEG("\n\n") } };
+
+static const struct RenderTemplate GROUP_MSG_ROW = { 6, {
+    RENDER_SEG("\033[90m========== Group Message #"),
+    RENDER_SEG(" ==========\033[0m\n\033[35mFrom:\033[0m "),
+    RENDER_SEG(""),
+    RENDER_SEG("\033[0m ("),
+    RENDER_SEG(")\n\033[35mTime:\033[0m \033[34m"),
+    RENDER_SEG("\033[0m\n\033[35mContent:\033[0m\n"),
+    RENDER_SEG("\n\n") } };
+
+/* id, conversation or group id, sender_id, sender, created_at, content */
+static const struct RenderTemplate MESSAGE_ROW_COMPACT = { 6, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static void messages_page_header(struct MessagePage *pg)
 {
-    size_t off = 0;
-    while (off < len) {
-        ssize_t n = write(fd, buf + off, len - off);
-        if (n <= 0) return;
-        off += (size_t)n;
+    if (pg->mode == OUTPUT_COMPACT)
+    {
+        if (pg->group_name)
+            outbuf_printf(&pg->ob, "OK GROUP_MESSAGES %s\n", pg->group_name);
+        else
+            outbuf_append_ref(&pg->ob, "OK MESSAGES\n", 12);
     }
+    else if (pg->group_name)
+        outbuf_printf(&pg->ob,
+                       "\033[32mOK\033[0m\nGROUP_MESSAGES\n"
+                       "\033[35mGroup:\033[0m \033[36m%s\033[0m\n\n",
+                       pg->group_name);
+    else
+        outbuf_printf(&pg->ob, "\033[32mOK\033[0m\nMESSAGES\n\n");
 }
 
-void messages_send_for_client(int client_fd,
-                              struct Message *msgs, int count,
-                              int current_user_id)
+int messages_page_row(const struct Message *m, void *ctx)
 {
-    char out[4096];
-    int off = 0;
+    struct MessagePage *pg = (struct MessagePage *)ctx;
+    if (pg->count == 0)
+    {
+        messages_page_header(pg);
+        pg->first_id = m->id;
+    }
 
-    off = snprintf(out, sizeof(out),
-                   "\033[32mOK\033[0m\nMESSAGES %d\n\n", count);
-    write_all(client_fd, out, (size_t)off);
+    const char *side = msg_side_label(m->sender_id, pg->viewer_id);
+    const char *sender_color = msg_sender_color(m->sender_id, pg->viewer_id);
 
-    for (int i = 0; i < count; i++) {
-        struct Message *m = &msgs[i];
+    if (pg->mode == OUTPUT_COMPACT)
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(m->id),
+            RENDER_INT(m->conversation_id),
+            RENDER_INT(m->sender_id),
+            RENDER_FIELD(m->sender_name),
+            RENDER_INT(m->created_at),
+            RENDER_FIELD(m->content),
+        };
+        render_row(&pg->ob, &MESSAGE_ROW_COMPACT, args);
+    }
+    else if (pg->group_name)
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(m->id),
+            RENDER_STR(sender_color),
+            RENDER_STR(m->sender_name),
+            RENDER_STR(side),
+            RENDER_TIME(m->created_at),
+            RENDER_STR(m->content),
+        };
+        render_row(&pg->ob, &GROUP_MSG_ROW, args);
+    }
+    else
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(m->id),
+            RENDER_INT(m->conversation_id),
+            RENDER_STR(sender_color),
+            RENDER_STR(m->sender_name),
+            RENDER_STR(side),
+            RENDER_TIME(m->created_at),
+            RENDER_STR(m->content),
+        };
+        render_row(&pg->ob, &DM_ROW, args);
+    }
 
-        char timebuf[64] = {0};
-        time_t t = (time_t)m->created_at;
-        struct tm tm_info;
-        localtime_r(&t, &tm_info);
-        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm_info);
+    pg->count++;
 
-        const char *side = msg_side_label(m->sender_id, current_user_id);
-        const char *sender_color = msg_sender_color(m->sender_id, current_user_id);
+    /* Stop stepping once the client is gone. */
+    return pg->ob.failed;
+}
 
-        off = snprintf(out, sizeof(out),
-                       "\033[90m========== Message #%d ==========\033[0m\n"
-                       "\033[35mConversation:\033[0m %d\n"
-                       "\033[35mFrom:\033[0m %s%s\033[0m (%s)\n"
-                       "\033[35mTime:\033[0m \033[34m%s\033[0m\n"
-                       "\033[35mContent:\033[0m\n%s\n\n",
-                       m->id,
-                       m->conversation_id,
-                       sender_color,
-                       m->sender_name,
-                       side,
-                       timebuf,
-                       m->content);
-
-        write_all(client_fd, out, (size_t)off);
-    }
+/*
+ * Closes the listing. A full DM page may have older messages behind it, so
+ * it hands back its first id as the cursor; page_size 0 never does.
+ */
+void messages_page_end(struct MessagePage *pg, int page_size, int failed)
+{
+    if (pg->count == 0)
+        messages_page_header(pg);
+
+    outbuf_printf(&pg->ob, "COUNT %d\n", pg->count);
+
+    if (failed)
+        outbuf_printf(&pg->ob, "%s %s %s\n", RESP_ERROR, ERR_INTERNAL, "Listing interrupted.");
+    else if (page_size > 0 && pg->count == page_size)
+        outbuf_printf(&pg->ob, "NEXT %d\n", pg->first_id);
 
-    write_all(client_fd, "END\n", 4);
+    outbuf_append_ref(&pg->ob, "END\n", 4);
+    outbuf_end(&pg->ob);
 }
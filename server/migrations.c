@@ -0,0 +1,296 @@
+#include <sqlite3.h>
+#include <time.h>
+#include "common.h"
+#include "migrations.h"
+#include "timeline.h"
+
+/*
+ * Ordered schema upgrades. Each step runs in its own transaction together
+ * with the row that records it in schema_version, so a database is always at
+ * exactly one version. Steps are append-only: never edit a released one,
+ * add a new version instead.
+ *
+ * Version 1 is the schema that used to be created ad hoc at startup; every
+ * statement is IF NOT EXISTS so databases created before versioning are
+ * adopted as they are.
+ *
+ * A step may also carry a C hook that runs after its SQL, inside the same
+ * transaction, for data that cannot be produced by a single statement.
+ */
+struct Migration
+{
+    int         version;
+    const char *name;
+    const char *sql;
+    int (*apply)(sqlite3 *db);
+};
+
+static const struct Migration g_migrations[] = {
+    { 1, "base schema",
+        "CREATE TABLE IF NOT EXISTS users ("
+        "  id            INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  name          TEXT UNIQUE NOT NULL,"
+        "  password_hash TEXT NOT NULL,"
+        "  type          INTEGER NOT NULL,"
+        "  vis           INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS posts ("
+        "  id         INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  author_id  INTEGER NOT NULL,"
+        "  visibility INTEGER NOT NULL,"
+        "  content    TEXT    NOT NULL,"
+        "  created_at INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS conversations ("
+        "  id          INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  title       TEXT NOT NULL,"
+        "  is_group    INTEGER NOT NULL,"
+        "  visibility  INTEGER NOT NULL,"
+        "  created_by  INTEGER NOT NULL,"
+        "  created_at  INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS conversation_members ("
+        "  conversation_id  INTEGER NOT NULL,"
+        "  user_id          INTEGER NOT NULL,"
+        "  is_admin         INTEGER NOT NULL DEFAULT 0,"
+        "  joined_at        INTEGER NOT NULL,"
+        "  PRIMARY KEY (conversation_id, user_id)"
+        ");"
+        "CREATE TABLE IF NOT EXISTS messages ("
+        "  id              INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  conversation_id INTEGER NOT NULL,"
+        "  sender_id       INTEGER NOT NULL,"
+        "  content         TEXT NOT NULL,"
+        "  created_at      INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS friends ("
+        "  user_id   INTEGER NOT NULL,"
+        "  friend_id INTEGER NOT NULL,"
+        "  type      INTEGER NOT NULL,"
+        "  PRIMARY KEY (user_id, friend_id)"
+        ");"
+        "CREATE TABLE IF NOT EXISTS groups ("
+        "  id        INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  name      TEXT UNIQUE NOT NULL,"
+        "  owner_id  INTEGER NOT NULL,"
+        "  is_public INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS group_members ("
+        "  group_id INTEGER NOT NULL,"
+        "  user_id  INTEGER NOT NULL,"
+        "  role     INTEGER NOT NULL,"
+        "  PRIMARY KEY (group_id, user_id)"
+        ");"
+        "CREATE TABLE IF NOT EXISTS group_requests ("
+        "  group_id INTEGER NOT NULL,"
+        "  user_id  INTEGER NOT NULL,"
+        "  PRIMARY KEY (group_id, user_id)"
+        ");"
+        "CREATE TABLE IF NOT EXISTS group_messages ("
+        "  id         INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  group_id   INTEGER NOT NULL,"
+        "  sender_id  INTEGER NOT NULL,"
+        "  content    TEXT    NOT NULL,"
+        "  created_at INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS notifications ("
+        "id         INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "user_id    INTEGER NOT NULL,"
+        "type       TEXT    NOT NULL,"
+        "payload    TEXT    NOT NULL,"
+        "created_at INTEGER NOT NULL,"
+        "deleted    INTEGER NOT NULL DEFAULT 0,"
+        "FOREIGN KEY(user_id) REFERENCES users(id)"
+        ");"
+        "CREATE TABLE IF NOT EXISTS friend_requests ("
+        "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "  from_id INTEGER NOT NULL,"
+        "  to_id INTEGER NOT NULL,"
+        "  created_at INTEGER NOT NULL,"
+        "  UNIQUE(from_id, to_id)"
+        ");",
+        NULL
+    },
+    { 2, "indexes for hot queries",
+        /* VIEW_NOTIFS and DELETE_NOTIFS */
+        "CREATE INDEX IF NOT EXISTS idx_notifications_user_live "
+        "  ON notifications(user_id, deleted, created_at);"
+        /* LIST_MESSAGES */
+        "CREATE INDEX IF NOT EXISTS idx_messages_conversation "
+        "  ON messages(conversation_id, created_at);"
+        /* GROUP_MESSAGES */
+        "CREATE INDEX IF NOT EXISTS idx_group_messages_group "
+        "  ON group_messages(group_id, created_at);"
+        /* VIEW_FEED ordering, VIEW_PUBLIC_POSTS, VIEW_USER_POSTS */
+        "CREATE INDEX IF NOT EXISTS idx_posts_created "
+        "  ON posts(created_at);"
+        "CREATE INDEX IF NOT EXISTS idx_posts_visibility_created "
+        "  ON posts(visibility, created_at);"
+        "CREATE INDEX IF NOT EXISTS idx_posts_author_created "
+        "  ON posts(author_id, created_at);"
+        /* LIST_GROUPS; the primary key only covers (group_id, user_id) */
+        "CREATE INDEX IF NOT EXISTS idx_group_members_user "
+        "  ON group_members(user_id, group_id, role);"
+        /* VIEW_FRIEND_REQUESTS */
+        "CREATE INDEX IF NOT EXISTS idx_friend_requests_to "
+        "  ON friend_requests(to_id, created_at, from_id);"
+        /* DM lookup starts from one participant */
+        "CREATE INDEX IF NOT EXISTS idx_conversation_members_user "
+        "  ON conversation_members(user_id, conversation_id);",
+        NULL
+    },
+    { 3, "drop sqlite sessions table",
+        /* Sessions are kept in memory by sessions.c. */
+        "DROP TABLE IF EXISTS sessions;",
+        NULL
+    },
+    { 4, "keyset index for dm history",
+        /* LIST_MESSAGES pages by (conversation_id, id) now, not by time. */
+        "CREATE INDEX IF NOT EXISTS idx_messages_conversation_id "
+        "  ON messages(conversation_id, id);"
+        "DROP INDEX IF EXISTS idx_messages_conversation;",
+        NULL
+    },
+    { 5, "materialized home timelines",
+        /* user_id 0 is the shared timeline of public posts by public accounts. */
+        "CREATE TABLE IF NOT EXISTS timeline ("
+        "  user_id    INTEGER NOT NULL,"
+        "  created_at INTEGER NOT NULL,"
+        "  post_id    INTEGER NOT NULL,"
+        "  author_id  INTEGER NOT NULL,"
+        "  PRIMARY KEY (user_id, created_at, post_id)"
+        ") WITHOUT ROWID;"
+        "CREATE INDEX IF NOT EXISTS idx_timeline_post ON timeline(post_id);"
+        "CREATE INDEX IF NOT EXISTS idx_timeline_author ON timeline(author_id, user_id);"
+        "CREATE TABLE IF NOT EXISTS timeline_pull ("
+        "  author_id INTEGER PRIMARY KEY"
+        ");",
+        timeline_rebuild
+    },
+    { 6, "indexes for feed merge",
+        /* Feed merge looks up everyone who lists a viewer as a friend... */
+        "CREATE INDEX IF NOT EXISTS idx_friends_friend "
+        "  ON friends(friend_id, user_id, type);"
+        /* ...and walks each author's posts filtered by visibility. */
+        "CREATE INDEX IF NOT EXISTS idx_posts_author_created_vis "
+        "  ON posts(author_id, created_at, id, visibility);"
+        "DROP INDEX IF EXISTS idx_posts_author_created;",
+        NULL
+    },
+};
+
+#define MIGRATION_COUNT ((int)(sizeof(g_migrations) / sizeof(g_migrations[0])))
+
+int storage_schema_version(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int version = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(version), 0) FROM schema_version;", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    else
+        version = -1;
+
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+static int migration_apply(sqlite3 *db, const struct Migration *m)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "[storage] migration %d: cannot begin: %s\n", m->version, errmsg);
+        sqlite3_free(errmsg);
+        return -1;
+    }
+
+    if (sqlite3_exec(db, m->sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "[storage] migration %d (%s) failed: %s\n", m->version, m->name, errmsg);
+        sqlite3_free(errmsg);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    if (m->apply && m->apply(db) < 0)
+    {
+        fprintf(stderr, "[storage] migration %d (%s) failed in its data step\n", m->version, m->name);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db,
+                                "INSERT INTO schema_version(version, name, applied_at) VALUES (?, ?, ?);",
+                                -1, &stmt, NULL);
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_bind_int(stmt, 1, m->version);
+        sqlite3_bind_text(stmt, 2, m->name, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, (int)time(NULL));
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+        sqlite3_finalize(stmt);
+    }
+
+    if (rc != SQLITE_OK || sqlite3_exec(db, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "[storage] migration %d: cannot record version: %s\n",
+                m->version, errmsg ? errmsg : sqlite3_errmsg(db));
+        sqlite3_free(errmsg);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    printf("[storage] Schema upgraded to version %d (%s).\n", m->version, m->name);
+    return 0;
+}
+
+/* Brings the database up to the newest version. Runs once, before any worker starts. */
+int storage_migrate(sqlite3 *db)
+{
+    char *errmsg = NULL;
+
+    const char *sql_version =
+        "CREATE TABLE IF NOT EXISTS schema_version ("
+        "  version    INTEGER PRIMARY KEY,"
+        "  name       TEXT    NOT NULL,"
+        "  applied_at INTEGER NOT NULL"
+        ");";
+
+    if (sqlite3_exec(db, sql_version, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "[storage] Cannot create schema_version table: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        return -1;
+    }
+
+    int current = storage_schema_version(db);
+    if (current < 0)
+    {
+        fprintf(stderr, "[storage] Cannot read schema version: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    int latest = g_migrations[MIGRATION_COUNT - 1].version;
+    if (current > latest)
+    {
+        fprintf(stderr, "[storage] Database schema version %d is newer than this server (%d)\n",
+                current, latest);
+        return -1;
+    }
+
+    for (int i = 0; i < MIGRATION_COUNT; i++)
+    {
+        if (g_migrations[i].version <= current)
+            continue;
+        if (migration_apply(db, &g_migrations[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
@@ -5,6 +5,10 @@
 #include <stdio.h>
 #include "notifications.h"
 #include "storage.h"
+#include "connections.h"
+#include "buffer.h"
+#include "protocol.h"
+#include "render.h"
 
 int notifications_add(int user_id, const char *type, const char *payload)
 {
@@ -21,7 +25,7 @@ int notifications_add(int user_id, const char *type, const char *payload)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[notifs_add] prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -35,7 +39,7 @@ int notifications_add(int user_id, const char *type, const char *payload)
     sqlite3_bind_int(stmt, 4, (int)time(NULL));
 
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (rc != SQLITE_DONE)
     {
@@ -48,10 +52,63 @@ int notifications_add(int user_id, const char *type, const char *payload)
     return 0;
 }
 
-int notifications_list(int user_id, struct Notification *out, int max_size)
+/*
+ * One notification for every member of a group except exclude_user_id,
+ * written by a single INSERT ... SELECT, so any group size costs one
+ * statement and one transaction. Returns the number of rows written.
+ */
+int notifications_add_for_group(const char *group_name, int exclude_user_id,
+                                const char *type, const char *payload)
+{
+    if (!group_name) return -1;
+    if (!type) type = "GENERIC";
+    if (!payload) payload = "";
+
+    const char *sql =
+        "INSERT INTO notifications(user_id, type, payload, created_at, deleted) "
+        "SELECT gm.user_id, ?, ?, ?, 0 "
+        "FROM group_members gm "
+        "JOIN groups g ON g.id = gm.group_id "
+        "WHERE g.name = ? AND gm.user_id <> ?;";
+
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    pthread_mutex_lock(&db_mutex);
+
+    rc = storage_prepare(g_db, sql, &stmt);
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "[notifs_add_group] prepare failed: %s\n", sqlite3_errmsg(g_db));
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, type, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, payload, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 3, (int)time(NULL));
+    sqlite3_bind_text(stmt, 4, group_name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 5, exclude_user_id);
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "[notifs_add_group] insert failed: %s\n", sqlite3_errmsg(g_db));
+        storage_finalize(stmt);
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    int added = sqlite3_changes(g_db);
+    storage_finalize(stmt);
+    pthread_mutex_unlock(&db_mutex);
+    return added;
+}
+
+int notifications_for_each(int user_id, int max_size, notification_visit_fn fn, void *ctx)
 {
     if (user_id <= 0) return -1;
-    if (!out || max_size <= 0) return 0;
+    if (max_size <= 0) return 0;
 
     const char *sql =
         "SELECT id, user_id, type, payload, created_at "
@@ -63,13 +120,13 @@ int notifications_list(int user_id, struct Notification *out, int max_size)
     sqlite3_stmt *stmt = NULL;
     int rc;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[notifs_list] prepare failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[notifs_list] prepare failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
@@ -77,34 +134,34 @@ int notifications_list(int user_id, struct Notification *out, int max_size)
     sqlite3_bind_int(stmt, 2, max_size);
 
     int count = 0;
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
+    while (count < max_size && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-        out[count].id        = sqlite3_column_int(stmt, 0);
-        out[count].user_id   = sqlite3_column_int(stmt, 1);
-        out[count].created_at= sqlite3_column_int(stmt, 4);
-
-        const char *t = (const char *)sqlite3_column_text(stmt, 2);
-        const char *p = (const char *)sqlite3_column_text(stmt, 3);
+        const char *type    = (const char *)sqlite3_column_text(stmt, 2);
+        const char *payload = (const char *)sqlite3_column_text(stmt, 3);
 
-        strncpy(out[count].type, t ? t : "", sizeof(out[count].type) - 1);
-        out[count].type[sizeof(out[count].type) - 1] = '\0';
-
-        strncpy(out[count].payload, p ? p : "", sizeof(out[count].payload) - 1);
-        out[count].payload[sizeof(out[count].payload) - 1] = '\0';
+        struct Notification n;
+        n.id         = sqlite3_column_int(stmt, 0);
+        n.user_id    = sqlite3_column_int(stmt, 1);
+        n.type       = type ? type : "";
+        n.payload    = payload ? payload : "";
+        n.created_at = sqlite3_column_int(stmt, 4);
 
         count++;
+        if (fn(&n, ctx) != 0)
+        {
+            rc = SQLITE_DONE;
+            break;
+        }
     }
 
     if (rc != SQLITE_DONE && rc != SQLITE_ROW)
     {
-        fprintf(stderr, "[notifs_list] step error: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        fprintf(stderr, "[notifs_list] step error: %s\n", sqlite3_errmsg(db));
+        count = -1;
     }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    storage_finalize(stmt);
+    storage_read_end(db);
     return count;
 }
 
@@ -120,7 +177,7 @@ int notifications_delete_all(int user_id)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[notifs_delete] prepare failed: %s\n", sqlite3_errmsg(g_db));
@@ -131,7 +188,7 @@ int notifications_delete_all(int user_id)
     sqlite3_bind_int(stmt, 1, user_id);
 
     rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
 
     if (rc != SQLITE_DONE)
     {
@@ -144,39 +201,76 @@ int notifications_delete_all(int user_id)
     return 1;
 }
 
-static void write_all(int fd, const char *buf, size_t len)
+void notifications_page_begin(struct NotifPage *pg, int client_fd, enum output_mode mode)
 {
-    size_t off = 0;
-    while (off < len) {
-        ssize_t n = write(fd, buf + off, len - off);
-        if (n <= 0) return;
-        off += (size_t)n;
-    }
+    outbuf_init(&pg->ob, client_fd, conn_sendv);
+    pg->mode = mode;
+    pg->count = 0;
 }
 
-void notifications_send_for_client(int client_fd, struct Notification *ns, int count)
+static const struct RenderTemplate NOTIF_ROW = { 4, {
+    RENDER_SEG("\033[90m========== Notif #"),
+    RENDER_SEG(" ==========\033[0m\n\033[35mTime:\033[0m \033[34m"),
+    RENDER_SEG("\033[0m\n\033[35mType:\033[0m \033[33m"),
+    RENDER_SEG("\033[0m\n\033[35mFrom:\033[0m\n"),
+    RENDER_SEG("\n\n") } };
+
+/* id, created_at, type, payload */
+static const struct RenderTemplate NOTIF_ROW_COMPACT = { 4, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static void notifications_page_header(struct NotifPage *pg)
 {
-    char out[2048];
-    int off = snprintf(out, sizeof(out),
-                       "\033[32mOK\033[0m\nNOTIFS %d\n\n", count);
-    write_all(client_fd, out, (size_t)off);
-
-    for (int i = 0; i < count; i++) {
-        char timebuf[64] = {0};
-        time_t t = (time_t)ns[i].created_at;
-        struct tm tm_info;
-        localtime_r(&t, &tm_info);
-        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm_info);
-
-        off = snprintf(out, sizeof(out),
-            "\033[90m========== Notif #%d ==========\033[0m\n"
-            "\033[35mTime:\033[0m \033[34m%s\033[0m\n"
-            "\033[35mType:\033[0m \033[33m%s\033[0m\n"
-            "\033[35mFrom:\033[0m\n%s\n\n",
-            ns[i].id, timebuf, ns[i].type, ns[i].payload);
-
-        write_all(client_fd, out, (size_t)off);
+    if (pg->mode == OUTPUT_COMPACT)
+        outbuf_append_ref(&pg->ob, "OK NOTIFS\n", 10);
+    else
+        outbuf_printf(&pg->ob, "\033[32mOK\033[0m\nNOTIFS\n\n");
+}
+
+int notifications_page_row(const struct Notification *n, void *ctx)
+{
+    struct NotifPage *pg = (struct NotifPage *)ctx;
+    if (pg->count == 0)
+        notifications_page_header(pg);
+
+    if (pg->mode == OUTPUT_COMPACT)
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(n->id),
+            RENDER_INT(n->created_at),
+            RENDER_FIELD(n->type),
+            RENDER_FIELD(n->payload),
+        };
+        render_row(&pg->ob, &NOTIF_ROW_COMPACT, args);
+    }
+    else
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(n->id),
+            RENDER_TIME(n->created_at),
+            RENDER_STR(n->type),
+            RENDER_STR(n->payload),
+        };
+        render_row(&pg->ob, &NOTIF_ROW, args);
     }
 
-    write_all(client_fd, "END\n", 4);
-}
\ No newline at end of file
+    pg->count++;
+    return pg->ob.failed;
+}
+
+void notifications_page_end(struct NotifPage *pg, int failed)
+{
+    if (pg->count == 0)
+        notifications_page_header(pg);
+
+    outbuf_printf(&pg->ob, "COUNT %d\n", pg->count);
+    if (failed)
+        outbuf_printf(&pg->ob, "%s %s %s\n", RESP_ERROR, ERR_INTERNAL, "Listing interrupted.");
+
+    outbuf_append_ref(&pg->ob, "END\n", 4);
+    outbuf_end(&pg->ob);
+}
@@ -4,23 +4,9 @@
 #include <string.h>
 #include "common.h"
 #include "notifications.h"
-
-static int write_all(int fd, const char *buf, size_t len)
-{
-    size_t off = 0;
-    while (off < len)
-    {
-        ssize_t n = write(fd, buf + off, len - off);
-        if (n > 0)
-        {
-            off += (size_t)n;
-            continue;
-        }
-        if (n < 0 && errno == EINTR) continue;
-        return -1;
-    }
-    return 0;
-}
+#include "connections.h"
+#include "groups.h"
+#include "worker_pool.h"
 
 static void parse_notif_line(const char *line,
                              char *type, size_t type_cap,
@@ -71,8 +57,86 @@ void notify_user(int user_id, const char *line)
 
     notifications_add(user_id, type, payload);
 
-    int fd = sessions_find_fd_by_user_id(user_id);
-    if (fd < 0) return;
+    int fds[SESSIONS_MAX_PER_USER];
+    int n = sessions_find_fds_by_user_id(user_id, fds, SESSIONS_MAX_PER_USER);
+    if (n <= 0) return;
+
+    conn_send_many(fds, n, line, strlen(line));
+}
+
+struct GroupFanout
+{
+    int   sender_id;
+    char *group_name;
+    char *line;
+};
+
+/*
+ * Runs off the sender's request: stores the notification for every member
+ * in one statement, then pushes the line to all their live connections.
+ */
+static void notify_group_job(void *arg)
+{
+    struct GroupFanout *ev = (struct GroupFanout *)arg;
+
+    char type[64];
+    char payload[1024];
+    parse_notif_line(ev->line, type, sizeof(type), payload, sizeof(payload));
+
+    if (notifications_add_for_group(ev->group_name, ev->sender_id, type, payload) < 0)
+        fprintf(stderr, "[notify] could not store notifications for group %s\n", ev->group_name);
+
+    int *members = NULL;
+    int count = groups_list_member_ids(ev->group_name, &members);
 
-    write_all(fd, line, strlen(line));
-}
\ No newline at end of file
+    int *fds = NULL;
+    int nfds = 0, cap = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (members[i] == ev->sender_id)
+            continue;
+
+        if (cap - nfds < SESSIONS_MAX_PER_USER)
+        {
+            int grown_cap = cap ? cap * 2 : 256;
+            int *grown = realloc(fds, (size_t)grown_cap * sizeof(int));
+            if (!grown)
+                break;
+            fds = grown;
+            cap = grown_cap;
+        }
+        nfds += sessions_find_fds_by_user_id(members[i], fds + nfds, SESSIONS_MAX_PER_USER);
+    }
+
+    if (nfds > 0)
+        conn_send_many(fds, nfds, ev->line, strlen(ev->line));
+
+    free(fds);
+    free(members);
+    free(ev->group_name);
+    free(ev->line);
+    free(ev);
+}
+
+void notify_group(int sender_id, const char *group_name, const char *line)
+{
+    if (!group_name || !line) return;
+
+    struct GroupFanout *ev = calloc(1, sizeof(*ev));
+    if (!ev) return;
+
+    ev->sender_id = sender_id;
+    ev->group_name = strdup(group_name);
+    ev->line = strdup(line);
+    if (!ev->group_name || !ev->line)
+    {
+        free(ev->group_name);
+        free(ev->line);
+        free(ev);
+        return;
+    }
+
+    /* With the pool saturated, do the work inline rather than lose it. */
+    if (worker_pool_submit(notify_group_job, ev) < 0)
+        notify_group_job(ev);
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <sqlite3.h>
+
+#include "posts.h"
+#include "storage.h"
+
+/*
+ * Row plumbing shared by every post listing. Kept apart from posts.c so the
+ * feed benchmark can link the read path without the socket layer.
+ */
+
+/* Columns: id, author_id, author name, visibility, content, created_at. */
+static void post_row_load(sqlite3_stmt *stmt, struct PostRow *row)
+{
+    const char *name = (const char *)sqlite3_column_text(stmt, 2);
+    const char *txt  = (const char *)sqlite3_column_text(stmt, 4);
+
+    row->id          = sqlite3_column_int(stmt, 0);
+    row->author_id   = sqlite3_column_int(stmt, 1);
+    row->author_name = name ? name : "";
+    row->vis         = (enum post_visibility)sqlite3_column_int(stmt, 3);
+    row->content     = txt ? txt : "";
+    row->content_len = (size_t)sqlite3_column_bytes(stmt, 4);
+    row->created_at  = sqlite3_column_int(stmt, 5);
+}
+
+/*
+ * Steps a bound post query and hands every row to fn while the statement
+ * still owns it. Finalizes the statement; returns the rows visited or -1.
+ */
+int posts_visit_stmt(sqlite3_stmt *stmt, int max_size, post_visit_fn fn, void *ctx)
+{
+    int count = 0;
+    int rc = SQLITE_DONE;
+
+    while (count < max_size && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        struct PostRow row;
+        post_row_load(stmt, &row);
+        count++;
+        if (fn(&row, ctx) != 0)
+        {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+    {
+        fprintf(stderr, "[post_rows] select error: %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        count = -1;
+    }
+
+    storage_finalize(stmt);
+    return count;
+}
+
+int posts_collect_row(const struct PostRow *row, void *ctx)
+{
+    struct PostCollect *pc = (struct PostCollect *)ctx;
+    struct Post *p = &pc->out[pc->count++];
+
+    p->id         = row->id;
+    p->author_id  = row->author_id;
+    p->vis        = row->vis;
+    p->created_at = row->created_at;
+    snprintf(p->author_name, sizeof(p->author_name), "%s", row->author_name);
+    snprintf(p->content, sizeof(p->content), "%s", row->content);
+    return 0;
+}
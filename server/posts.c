@@ -4,11 +4,19 @@
 #include <pthread.h>
 #include <sqlite3.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "models.h"
 #include "posts.h"
 #include "auth.h"
 #include "storage.h"
+#include "connections.h"
+#include "buffer.h"
+#include "timeline.h"
+#include "feed.h"
+#include "graph.h"
+#include "userdir.h"
+#include "render.h"
 
 int posts_add(int author_id, int visibility, const char *content)
 {
@@ -22,10 +30,17 @@ int posts_add(int author_id, int visibility, const char *content)
 
     pthread_mutex_lock(&db_mutex);
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    if (storage_write_begin() < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    rc = storage_prepare(g_db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[posts_add] prepare failed: %s\n", sqlite3_errmsg(g_db));
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
@@ -39,172 +54,102 @@ int posts_add(int author_id, int visibility, const char *content)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[posts_add] insert failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     new_id = (int)sqlite3_last_insert_rowid(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+
+    /* The post and its timeline copies land together or not at all. */
+    rc = timeline_add_post(new_id);
+    if (rc < 0)
+        fprintf(stderr, "[posts_add] timeline fan-out failed for post %d\n", new_id);
+    if (storage_write_end(rc) < 0)
+        new_id = -1;
     pthread_mutex_unlock(&db_mutex);
 
     return new_id;
 }
 
-
-int posts_get_public(struct Post *out_array, int max_size)
+int posts_cursor_parse(const char *token, struct PostCursor *out)
 {
-    if (max_size <= 0)
-        return 0;
-
-    const char *sql =
-        "SELECT p.id, p.author_id, u.name, p.visibility, p.content, p.created_at "
-        "FROM posts p "
-        "JOIN users u ON u.id = p.author_id "
-        "WHERE p.visibility = ? "
-        "  AND u.vis = ? "
-        "ORDER BY p.created_at DESC "
-        "LIMIT ?;";
-
-    sqlite3_stmt *stmt;
-    int rc;
-
-    pthread_mutex_lock(&db_mutex);
+    unsigned int created_at, id;
+    int n = 0;
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[posts_get_public] prepare failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+    if (!token || strlen(token) != POST_CURSOR_LEN - 1)
+        return -1;
+    if (sscanf(token, "%8x%8x%n", &created_at, &id, &n) != 2 || n != POST_CURSOR_LEN - 1)
+        return -1;
+    if (created_at > INT_MAX || id > INT_MAX)
         return -1;
-    }
-
-    int idx = 1;
-    sqlite3_bind_int(stmt, idx++, VIS_PUBLIC);
-    sqlite3_bind_int(stmt, idx++, USER_PUBLIC);
-    sqlite3_bind_int(stmt, idx++, max_size);
-
-    int count = 0;
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-    {
-        out_array[count].id         = sqlite3_column_int(stmt, 0);
-        out_array[count].author_id  = sqlite3_column_int(stmt, 1);
-        out_array[count].vis        = (enum post_visibility)sqlite3_column_int(stmt, 3);
-        out_array[count].created_at = sqlite3_column_int(stmt, 5);
-
-        const char *uname = (const char *)sqlite3_column_text(stmt, 2);
-        const char *txt   = (const char *)sqlite3_column_text(stmt, 4);
-
-        strncpy(out_array[count].author_name, uname ? uname : "",
-                sizeof(out_array[count].author_name) - 1);
-        out_array[count].author_name[sizeof(out_array[count].author_name) - 1] = '\0';
-
-        strncpy(out_array[count].content, txt ? txt : "",
-                sizeof(out_array[count].content) - 1);
-        out_array[count].content[sizeof(out_array[count].content) - 1] = '\0';
-
-        count++;
-    }
 
-    if (rc != SQLITE_DONE)
-    {
-        fprintf(stderr, "[posts_get_public] select error: %s\n",
-                sqlite3_errmsg(g_db));
-    }
+    out->created_at = (int)created_at;
+    out->id = (int)id;
+    return 0;
+}
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+void posts_cursor_format(const struct PostCursor *cur, char *buf, size_t size)
+{
+    snprintf(buf, size, "%08x%08x", (unsigned int)cur->created_at, (unsigned int)cur->id);
+}
 
-    return count;
+/* Binds the "(p.created_at, p.id) < (?, ?)" pair; no cursor means from the newest post. */
+static int bind_cursor(sqlite3_stmt *stmt, int idx, const struct PostCursor *after)
+{
+    sqlite3_bind_int(stmt, idx++, after ? after->created_at : INT_MAX);
+    sqlite3_bind_int(stmt, idx++, after ? after->id : INT_MAX);
+    return idx;
 }
 
-int posts_get_feed_for_user(int user_id, struct Post *out_array, int max_size)
+int posts_for_each_public(const struct PostCursor *after, int max_size, post_visit_fn fn, void *ctx)
 {
-    if (max_size <= 0) return 0;
+    if (max_size <= 0)
+        return 0;
 
     const char *sql =
         "SELECT p.id, p.author_id, u.name, p.visibility, p.content, p.created_at "
         "FROM posts p "
         "JOIN users u ON u.id = p.author_id "
-        "LEFT JOIN friends f1 "
-        "       ON f1.user_id = ? "
-        "      AND f1.friend_id = p.author_id "
-        "LEFT JOIN friends f2 "
-        "       ON f2.user_id = p.author_id "
-        "      AND f2.friend_id = ? "
-        "WHERE "
-        "      p.author_id = ? "
-        "   OR (p.visibility = ? "
-        "       AND (u.vis = ? "
-        "            OR (f1.user_id IS NOT NULL AND f2.user_id IS NOT NULL))) "
-        "   OR (p.visibility = ? "
-        "       AND (f1.user_id IS NOT NULL AND f2.user_id IS NOT NULL)) "
-        "   OR (p.visibility = ? "
-        "       AND (f2.user_id IS NOT NULL AND f2.type = ?)) "
-        "ORDER BY p.created_at DESC "
+        "WHERE p.visibility = ? "
+        "  AND u.vis = ? "
+        "  AND (p.created_at, p.id) < (?, ?) "
+        "ORDER BY p.created_at DESC, p.id DESC "
         "LIMIT ?;";
 
     sqlite3_stmt *stmt;
     int rc;
 
-    pthread_mutex_lock(&db_mutex);
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[posts_get_feed_for_user] prepare failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[posts_for_each_public] prepare failed: %s\n",
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
     int idx = 1;
-    sqlite3_bind_int(stmt, idx++, user_id);
-    sqlite3_bind_int(stmt, idx++, user_id);
-    sqlite3_bind_int(stmt, idx++, user_id);
     sqlite3_bind_int(stmt, idx++, VIS_PUBLIC);
     sqlite3_bind_int(stmt, idx++, USER_PUBLIC);
-    sqlite3_bind_int(stmt, idx++, VIS_FRIENDS);
-    sqlite3_bind_int(stmt, idx++, VIS_CLOSE_FRIENDS);
-    sqlite3_bind_int(stmt, idx++, FRIEND_CLOSE);
+    idx = bind_cursor(stmt, idx, after);
     sqlite3_bind_int(stmt, idx++, max_size);
 
-    int count = 0;
-
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-    {
-        out_array[count].id         = sqlite3_column_int(stmt, 0);
-        out_array[count].author_id  = sqlite3_column_int(stmt, 1);
-        out_array[count].vis        = (enum post_visibility)sqlite3_column_int(stmt, 3);
-        out_array[count].created_at = sqlite3_column_int(stmt, 5);
-
-        const char *uname = (const char *)sqlite3_column_text(stmt, 2);
-        const char *txt   = (const char *)sqlite3_column_text(stmt, 4);
-
-        strncpy(out_array[count].author_name, uname ? uname : "",
-                sizeof(out_array[count].author_name) - 1);
-        out_array[count].author_name[sizeof(out_array[count].author_name) - 1] = '\0';
-
-        strncpy(out_array[count].content, txt ? txt : "",
-                sizeof(out_array[count].content) - 1);
-        out_array[count].content[sizeof(out_array[count].content) - 1] = '\0';
-
-        count++;
-    }
-
-    if (rc != SQLITE_DONE)
-    {
-        fprintf(stderr, "[posts_get_feed_for_user] select error: %s\n",
-                sqlite3_errmsg(g_db));
-    }
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-
+    int count = posts_visit_stmt(stmt, max_size, fn, ctx);
+    storage_read_end(db);
     return count;
 }
 
+/* Home feed of user_id, assembled by the engine chosen with --feed (see feed.c). */
+int posts_for_each_feed(int user_id, const struct PostCursor *after, int max_size,
+                        post_visit_fn fn, void *ctx)
+{
+    return feed_for_each(user_id, after, max_size, fn, ctx);
+}
 
 static const char* visibility_to_string(enum post_visibility v)
 {
@@ -257,52 +202,123 @@ void format_posts_for_client(char *buf, int buf_size, struct Post *posts, int co
     }
 }
 
-static void write_all(int fd, const char *buf, size_t len)
+/*
+ * Streams a listing page: each visited row is rendered into the OutBuf
+ * straight from the statement, and the header only goes out with the first
+ * row, so a query that fails up front can still be answered with an error.
+ * The row count follows the rows (COUNT) since it is unknown until the end.
+ */
+void posts_page_begin(struct PostPage *pg, int client_fd, enum output_mode mode)
+{
+    outbuf_init(&pg->ob, client_fd, conn_sendv);
+    pg->mode = mode;
+    pg->count = 0;
+    pg->last.created_at = 0;
+    pg->last.id = 0;
+}
+
+static const struct RenderTemplate POST_ROW = { 6, {
+    RENDER_SEG("\033[90m========== Post #"),
+    RENDER_SEG(" ==========\033[0m\n\033[35mID:\033[0m "),
+    RENDER_SEG("\n\033[35mAuthor:\033[0m \033[36m"),
+    RENDER_SEG("\033[0m\n\033[35mTime:\033[0m \033[34m"),
+    RENDER_SEG("\033[0m\n\033[35mVisibility:\033[0m \033[33m"),
+    RENDER_SEG("\033[0m\n\033[35mContent:\033[0m\n"),
+    RENDER_SEG("\n\n") } };
+
+/* id, author_id, author, visibility as POST takes it, created_at, content */
+static const struct RenderTemplate POST_ROW_COMPACT = { 6, {
+    RENDER_SEG(""),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\t"),
+    RENDER_SEG("\n") } };
+
+static const char *visibility_keyword(enum post_visibility v)
 {
-    size_t off = 0;
-    while (off < len) {
-        ssize_t n = write(fd, buf + off, len - off);
-        if (n <= 0) return;
-        off += (size_t)n;
+    switch (v)
+    {
+        case VIS_PUBLIC:        return "public";
+        case VIS_FRIENDS:       return "friends";
+        case VIS_CLOSE_FRIENDS: return "close";
+        default:                return "unknown";
     }
 }
 
-void posts_send_for_client(int client_fd, struct Post *posts, int count)
+static void posts_page_header(struct PostPage *pg)
 {
-    char out[2048];
-    int off = 0;
+    if (pg->mode == OUTPUT_COMPACT)
+        outbuf_append_ref(&pg->ob, "OK POSTS\n", 9);
+    else
+        outbuf_printf(&pg->ob, "\033[32mOK\033[0m\nPOSTS\n\n");
+}
 
-    off = snprintf(out, sizeof(out), "\033[32mOK\033[0m\nPOSTS %d\n\n", count);
-    write_all(client_fd, out, (size_t)off);
+int posts_page_row(const struct PostRow *row, void *ctx)
+{
+    struct PostPage *pg = (struct PostPage *)ctx;
+    if (pg->count == 0)
+        posts_page_header(pg);
 
-    for (int i = 0; i < count; i++) {
-        const char *vis_str = visibility_to_string(posts[i].vis);
+    if (pg->mode == OUTPUT_COMPACT)
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(row->id),
+            RENDER_INT(row->author_id),
+            RENDER_FIELD(row->author_name),
+            RENDER_STR(visibility_keyword(row->vis)),
+            RENDER_INT(row->created_at),
+            RENDER_FIELDN(row->content, row->content_len),
+        };
+        render_row(&pg->ob, &POST_ROW_COMPACT, args);
+    }
+    else
+    {
+        const struct RenderArg args[] = {
+            RENDER_INT(row->id),
+            RENDER_INT(row->id),
+            RENDER_STR(row->author_name),
+            RENDER_TIME(row->created_at),
+            RENDER_STR(visibility_to_string(row->vis)),
+            RENDER_STRN(row->content, row->content_len),
+        };
+        render_row(&pg->ob, &POST_ROW, args);
+    }
+
+    pg->count++;
+    pg->last.created_at = row->created_at;
+    pg->last.id = row->id;
+
+    /* Stop stepping once the client is gone. */
+    return pg->ob.failed;
+}
 
-        char timebuf[64] = {0};
-        time_t t = (time_t)posts[i].created_at;
-        struct tm tm_info;
-        localtime_r(&t, &tm_info);
-        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm_info);
+/*
+ * Closes the listing. A full page carries a NEXT token pointing at its last
+ * post so the client can continue; a page cut short by a failed query ends
+ * with an error line instead.
+ */
+void posts_page_end(struct PostPage *pg, int page_size, int failed)
+{
+    if (pg->count == 0)
+        posts_page_header(pg);
 
-        off = snprintf(out, sizeof(out),
-        "\033[90m========== Post #%d ==========\033[0m\n"
-        "\033[35mID:\033[0m %d\n"
-        "\033[35mAuthor:\033[0m \033[36m%s\033[0m\n"
-        "\033[35mTime:\033[0m \033[34m%s\033[0m\n"
-        "\033[35mVisibility:\033[0m \033[33m%s\033[0m\n"
-        "\033[35mContent:\033[0m\n%s\n\n",
-            posts[i].id,
-            posts[i].id,
-            posts[i].author_name,
-            timebuf,
-            vis_str,
-            posts[i].content
-        );
+    outbuf_printf(&pg->ob, "COUNT %d\n", pg->count);
 
-        write_all(client_fd, out, (size_t)off);
+    if (failed)
+    {
+        outbuf_printf(&pg->ob, "%s %s %s\n", RESP_ERROR, ERR_INTERNAL, "Listing interrupted.");
+    }
+    else if (pg->count == page_size)
+    {
+        char next[POST_CURSOR_LEN];
+        posts_cursor_format(&pg->last, next, sizeof(next));
+        outbuf_printf(&pg->ob, "NEXT %s\n", next);
     }
 
-    write_all(client_fd, "END\n", 4);
+    outbuf_append_ref(&pg->ob, "END\n", 4);
+    outbuf_end(&pg->ob);
 }
 
 int posts_delete(int requester_id, int post_id)
@@ -321,7 +337,7 @@ int posts_delete(int requester_id, int post_id)
     int author_id = -1;
 
     pthread_mutex_lock(&db_mutex);
-    rc = sqlite3_prepare_v2(g_db, sql_get_author, -1, &stmt, NULL);
+    rc = storage_prepare(g_db, sql_get_author, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[posts] prepare get author failed: %s\n", sqlite3_errmsg(g_db));
@@ -337,19 +353,19 @@ int posts_delete(int requester_id, int post_id)
         author_id = sqlite3_column_int(stmt, 0);
     } else if (rc == SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return 0;
     }
     else
     {
         fprintf(stderr, "[posts] get author error: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
     pthread_mutex_unlock(&db_mutex);
 
     if (requester_id != author_id)
@@ -362,10 +378,17 @@ int posts_delete(int requester_id, int post_id)
     }
 
     pthread_mutex_lock(&db_mutex);
-    rc = sqlite3_prepare_v2(g_db, sql_delete, -1, &stmt, NULL);
+    if (storage_write_begin() < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    rc = storage_prepare(g_db, sql_delete, &stmt);
     if (rc != SQLITE_OK)
     {
         fprintf(stderr, "[posts] prepare delete failed: %s\n", sqlite3_errmsg(g_db));
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
@@ -375,13 +398,21 @@ int posts_delete(int requester_id, int post_id)
     if (rc != SQLITE_DONE)
     {
         fprintf(stderr, "[posts] delete failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
+        storage_finalize(stmt);
+        storage_write_end(-1);
         pthread_mutex_unlock(&db_mutex);
         return -1;
     }
 
     int changes = sqlite3_changes(g_db);
-    sqlite3_finalize(stmt);
+    storage_finalize(stmt);
+
+    rc = changes > 0 ? timeline_remove_post(post_id) : 0;
+    if (storage_write_end(rc) < 0)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
     pthread_mutex_unlock(&db_mutex);
 
     if (changes == 0)
@@ -389,8 +420,8 @@ int posts_delete(int requester_id, int post_id)
     return 1;
 }
 
-int posts_get_for_user(int viewer_id, int target_user_id,
-                       struct Post *out_array, int max_size)
+int posts_for_each_of_user(int viewer_id, int target_user_id, const struct PostCursor *after,
+                           int max_size, post_visit_fn fn, void *ctx)
 {
     if (max_size <= 0 || target_user_id <= 0)
         return 0;
@@ -401,41 +432,17 @@ int posts_get_for_user(int viewer_id, int target_user_id,
         is_admin = (auth_is_admin(viewer_id) == 1);
     }
 
+    struct UserInfo target;
+    if (userdir_get(target_user_id, &target) < 0)
+        return 0;
+    int target_vis = target.vis;
+
     sqlite3_stmt *stmt = NULL;
     int rc;
     int count = 0;
 
-    pthread_mutex_lock(&db_mutex);
-
-    int target_vis = USER_PUBLIC;
-
-    const char *sql_vis =
-        "SELECT vis FROM users WHERE id = ? LIMIT 1;";
+    sqlite3 *db = storage_read_begin();
 
-    rc = sqlite3_prepare_v2(g_db, sql_vis, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[posts_get_for_user] prepare vis failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_int(stmt, 1, target_user_id);
-
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW)
-    {
-        target_vis = sqlite3_column_int(stmt, 0);
-    }
-    else
-    {
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
-        return 0;
-    }
-
-    sqlite3_finalize(stmt);
     if (is_admin || (viewer_id > 0 && viewer_id == target_user_id))
     {
         const char *sql_all =
@@ -443,44 +450,25 @@ int posts_get_for_user(int viewer_id, int target_user_id,
             "FROM posts p "
             "JOIN users u ON u.id = p.author_id "
             "WHERE p.author_id = ? "
-            "ORDER BY p.created_at DESC "
+            "  AND (p.created_at, p.id) < (?, ?) "
+            "ORDER BY p.created_at DESC, p.id DESC "
             "LIMIT ?;";
 
-        rc = sqlite3_prepare_v2(g_db, sql_all, -1, &stmt, NULL);
+        rc = storage_prepare(db, sql_all, &stmt);
         if (rc != SQLITE_OK)
         {
-            fprintf(stderr, "[posts_get_for_user] prepare all failed: %s\n",
-                    sqlite3_errmsg(g_db));
-            pthread_mutex_unlock(&db_mutex);
+            fprintf(stderr, "[posts_for_each_of_user] prepare all failed: %s\n",
+                    sqlite3_errmsg(db));
+            storage_read_end(db);
             return -1;
         }
 
         sqlite3_bind_int(stmt, 1, target_user_id);
-        sqlite3_bind_int(stmt, 2, max_size);
+        bind_cursor(stmt, 2, after);
+        sqlite3_bind_int(stmt, 4, max_size);
 
-        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-        {
-            out_array[count].id         = sqlite3_column_int(stmt, 0);
-            out_array[count].author_id  = sqlite3_column_int(stmt, 1);
-            out_array[count].vis        = (enum post_visibility)sqlite3_column_int(stmt, 3);
-            out_array[count].created_at = sqlite3_column_int(stmt, 5);
-
-            const char *name = (const char *)sqlite3_column_text(stmt, 2);
-            const char *txt  = (const char *)sqlite3_column_text(stmt, 4);
-
-            strncpy(out_array[count].author_name, name ? name : "",
-                    sizeof(out_array[count].author_name) - 1);
-            out_array[count].author_name[sizeof(out_array[count].author_name) - 1] = '\0';
-
-            strncpy(out_array[count].content, txt ? txt : "",
-                    sizeof(out_array[count].content) - 1);
-            out_array[count].content[sizeof(out_array[count].content) - 1] = '\0';
-
-            count++;
-        }
-
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        count = posts_visit_stmt(stmt, max_size, fn, ctx);
+        storage_read_end(db);
         return count;
     }
 
@@ -488,7 +476,7 @@ int posts_get_for_user(int viewer_id, int target_user_id,
     {
         if (target_vis != USER_PUBLIC)
         {
-            pthread_mutex_unlock(&db_mutex);
+            storage_read_end(db);
             return 0;
         }
 
@@ -497,96 +485,34 @@ int posts_get_for_user(int viewer_id, int target_user_id,
             "FROM posts p "
             "JOIN users u ON u.id = p.author_id "
             "WHERE p.author_id = ? AND p.visibility = ? "
-            "ORDER BY p.created_at DESC "
+            "  AND (p.created_at, p.id) < (?, ?) "
+            "ORDER BY p.created_at DESC, p.id DESC "
             "LIMIT ?;";
 
-        rc = sqlite3_prepare_v2(g_db, sql_public, -1, &stmt, NULL);
+        rc = storage_prepare(db, sql_public, &stmt);
         if (rc != SQLITE_OK)
         {
-            fprintf(stderr, "[posts_get_for_user] prepare public failed: %s\n",
-                    sqlite3_errmsg(g_db));
-            pthread_mutex_unlock(&db_mutex);
+            fprintf(stderr, "[posts_for_each_of_user] prepare public failed: %s\n",
+                    sqlite3_errmsg(db));
+            storage_read_end(db);
             return -1;
         }
 
         sqlite3_bind_int(stmt, 1, target_user_id);
         sqlite3_bind_int(stmt, 2, VIS_PUBLIC);
-        sqlite3_bind_int(stmt, 3, max_size);
-
-        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-        {
-            out_array[count].id         = sqlite3_column_int(stmt, 0);
-            out_array[count].author_id  = sqlite3_column_int(stmt, 1);
-            out_array[count].vis        = (enum post_visibility)sqlite3_column_int(stmt, 3);
-            out_array[count].created_at = sqlite3_column_int(stmt, 5);
-
-            const char *name = (const char *)sqlite3_column_text(stmt, 2);
-            const char *txt  = (const char *)sqlite3_column_text(stmt, 4);
-
-            strncpy(out_array[count].author_name, name ? name : "",
-                    sizeof(out_array[count].author_name) - 1);
-            out_array[count].author_name[sizeof(out_array[count].author_name) - 1] = '\0';
+        bind_cursor(stmt, 3, after);
+        sqlite3_bind_int(stmt, 5, max_size);
 
-            strncpy(out_array[count].content, txt ? txt : "",
-                    sizeof(out_array[count].content) - 1);
-            out_array[count].content[sizeof(out_array[count].content) - 1] = '\0';
-
-            count++;
-        }
-
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+        count = posts_visit_stmt(stmt, max_size, fn, ctx);
+        storage_read_end(db);
         return count;
     }
 
-    bool has_1 = false, has_2 = false;
-    enum friend_type t1 = FRIEND_NORMAL, t2 = FRIEND_NORMAL;
-
-    const char *sql_f1 =
-        "SELECT type FROM friends WHERE user_id = ? AND friend_id = ? LIMIT 1;";
-
-    rc = sqlite3_prepare_v2(g_db, sql_f1, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[posts_get_for_user] prepare f1 failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_int(stmt, 1, viewer_id);
-    sqlite3_bind_int(stmt, 2, target_user_id);
-
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW)
-    {
-        has_1 = true;
-        t1 = sqlite3_column_int(stmt, 0);
-    }
-    sqlite3_finalize(stmt);
-
-    const char *sql_f2 =
-        "SELECT type FROM friends WHERE user_id = ? AND friend_id = ? LIMIT 1;";
-
-    rc = sqlite3_prepare_v2(g_db, sql_f2, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
-    {
-        fprintf(stderr, "[posts_get_for_user] prepare f2 failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
-    }
-
-    sqlite3_bind_int(stmt, 1, target_user_id);
-    sqlite3_bind_int(stmt, 2, viewer_id);
+    int t1 = graph_edge_type(viewer_id, target_user_id);
+    int t2 = graph_edge_type(target_user_id, viewer_id);
 
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW)
-    {
-        has_2 = true;
-        t2 = sqlite3_column_int(stmt, 0);
-    }
-    sqlite3_finalize(stmt);
+    bool has_1 = (t1 != GRAPH_NO_EDGE);
+    bool has_2 = (t2 != GRAPH_NO_EDGE);
 
     bool are_friends = (has_1 && has_2);
     bool is_close_from_target = (has_2 && t2 == FRIEND_CLOSE);
@@ -594,7 +520,7 @@ int posts_get_for_user(int viewer_id, int target_user_id,
 
     if (target_vis == USER_PRIVATE && !are_friends)
     {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return 0;
     }
 
@@ -612,7 +538,7 @@ int posts_get_for_user(int viewer_id, int target_user_id,
     allow_close  = are_close   ? 1 : 0;
 
     if (!allow_public && !allow_friend && !allow_close) {
-        pthread_mutex_unlock(&db_mutex);
+        storage_read_end(db);
         return 0;
     }
 
@@ -625,15 +551,16 @@ int posts_get_for_user(int viewer_id, int target_user_id,
         "   OR (? AND p.visibility = ?) "
         "   OR (? AND p.visibility = ?) "
         ") "
-        "ORDER BY p.created_at DESC "
+        "  AND (p.created_at, p.id) < (?, ?) "
+        "ORDER BY p.created_at DESC, p.id DESC "
         "LIMIT ?;";
 
-    rc = sqlite3_prepare_v2(g_db, sql_sel, -1, &stmt, NULL);
+    rc = storage_prepare(db, sql_sel, &stmt);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[posts_get_for_user] prepare filtered failed: %s\n",
-                sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        fprintf(stderr, "[posts_for_each_of_user] prepare filtered failed: %s\n",
+                sqlite3_errmsg(db));
+        storage_read_end(db);
         return -1;
     }
 
@@ -645,31 +572,11 @@ int posts_get_for_user(int viewer_id, int target_user_id,
     sqlite3_bind_int(stmt, idx++, VIS_FRIENDS);
     sqlite3_bind_int(stmt, idx++, allow_close);
     sqlite3_bind_int(stmt, idx++, VIS_CLOSE_FRIENDS);
+    idx = bind_cursor(stmt, idx, after);
     sqlite3_bind_int(stmt, idx++, max_size);
 
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && count < max_size)
-    {
-        out_array[count].id         = sqlite3_column_int(stmt, 0);
-        out_array[count].author_id  = sqlite3_column_int(stmt, 1);
-        out_array[count].vis        = (enum post_visibility)sqlite3_column_int(stmt, 3);
-        out_array[count].created_at = sqlite3_column_int(stmt, 5);
-
-        const char *name = (const char *)sqlite3_column_text(stmt, 2);
-        const char *txt  = (const char *)sqlite3_column_text(stmt, 4);
-
-        strncpy(out_array[count].author_name, name ? name : "",
-                sizeof(out_array[count].author_name) - 1);
-        out_array[count].author_name[sizeof(out_array[count].author_name) - 1] = '\0';
-
-        strncpy(out_array[count].content, txt ? txt : "",
-                sizeof(out_array[count].content) - 1);
-        out_array[count].content[sizeof(out_array[count].content) - 1] = '\0';
-
-        count++;
-    }
-
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    count = posts_visit_stmt(stmt, max_size, fn, ctx);
+    storage_read_end(db);
     return count;
 }
 
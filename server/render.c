@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "render.h"
+
+#define RENDER_INT_MAX 20       /* "-9223372036854775808" */
+
+struct TimeCache
+{
+    int valid;
+    time_t sec;                 /* second text was last set for */
+    time_t day_start;           /* [day_start, day_end) shares the date part */
+    time_t day_end;
+    char text[RENDER_TIME_LEN + 1];
+};
+
+static _Thread_local struct TimeCache t_time;
+
+static void put2(char *p, int v)
+{
+    p[0] = (char)('0' + v / 10);
+    p[1] = (char)('0' + v % 10);
+}
+
+const char *render_time(time_t t)
+{
+    struct TimeCache *c = &t_time;
+
+    if (c->valid && t == c->sec)
+        return c->text;
+
+    if (c->valid && t >= c->day_start && t < c->day_end)
+    {
+        int s = (int)(t - c->day_start);
+        put2(c->text + 11, s / 3600);
+        put2(c->text + 14, s / 60 % 60);
+        put2(c->text + 17, s % 60);
+        c->sec = t;
+        return c->text;
+    }
+
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (strftime(c->text, sizeof(c->text), "%Y-%m-%d %H:%M:%S", &tm) != RENDER_TIME_LEN)
+    {
+        /* Outside the four-digit years; nothing sensible fits the column. */
+        memcpy(c->text, "0000-00-00 00:00:00", RENDER_TIME_LEN + 1);
+        c->valid = 0;
+        return c->text;
+    }
+
+    c->sec = t;
+    c->day_start = t - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+    c->day_end = c->day_start + 24 * 3600;
+    c->valid = 1;
+
+    /* Wall time only runs in step with t on a day without a DST switch. */
+    struct tm edge;
+    time_t first = c->day_start;
+    time_t last = c->day_end - 1;
+    if (!localtime_r(&first, &edge) || edge.tm_gmtoff != tm.tm_gmtoff ||
+        !localtime_r(&last, &edge) || edge.tm_gmtoff != tm.tm_gmtoff)
+        c->day_end = c->day_start;
+
+    return c->text;
+}
+
+static size_t put_int(char *p, long v)
+{
+    char tmp[RENDER_INT_MAX];
+    unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+    size_t n = 0;
+
+    do
+    {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+
+    size_t len = 0;
+    if (v < 0)
+        p[len++] = '-';
+    while (n)
+        p[len++] = tmp[--n];
+    return len;
+}
+
+/* Escape letter for each byte that would break a TSV line, 0 for the rest. */
+static const char k_escape[256] = {
+    ['\\'] = '\\',
+    ['\t']  = 't',
+    ['\n']  = 'n',
+    ['\r']  = 'r',
+};
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Nonzero when one of the 8 bytes is a control character or a backslash. */
+static uint64_t word_needs_look(uint64_t w)
+{
+    uint64_t bs = w ^ (ONES * '\\');
+    return ((w - ONES * 0x20) & ~w & HIGHS) | ((bs - ONES) & ~bs & HIGHS);
+}
+
+/* Copies s with those bytes turned into backslash escapes, clean runs in one memcpy. */
+static size_t put_field(char *p, const char *s, size_t len)
+{
+    size_t n = 0;
+    size_t run = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        /* Ordinary text is skipped 32 bytes at a time, then 8. */
+        while (i + 32 <= len)
+        {
+            uint64_t w[4];
+            memcpy(w, s + i, 32);
+            if (word_needs_look(w[0]) | word_needs_look(w[1]) |
+                word_needs_look(w[2]) | word_needs_look(w[3]))
+                break;
+            i += 32;
+        }
+        while (i + 8 <= len)
+        {
+            uint64_t w;
+            memcpy(&w, s + i, 8);
+            if (word_needs_look(w))
+                break;
+            i += 8;
+        }
+        if (i >= len)
+            break;
+
+        char e = k_escape[(unsigned char)s[i]];
+        if (!e)
+            continue;
+
+        memcpy(p + n, s + run, i - run);
+        n += i - run;
+        p[n++] = '\\';
+        p[n++] = e;
+        run = i + 1;
+    }
+
+    memcpy(p + n, s + run, len - run);
+    return n + len - run;
+}
+
+static size_t hole_max(const struct RenderArg *a)
+{
+    if (a->kind == RENDER_K_INT)
+        return RENDER_INT_MAX;
+    if (a->kind == RENDER_K_TIME)
+        return RENDER_TIME_LEN;
+    if (a->kind == RENDER_K_FIELD)
+        return 2 * a->len;
+    return a->len;
+}
+
+/* Rows too big for the arena (long content) go out piece by piece. */
+static int render_row_pieces(struct OutBuf *ob, const struct RenderTemplate *tpl, const struct RenderArg *args)
+{
+    for (int i = 0; i < tpl->nholes; i++)
+    {
+        outbuf_append(ob, tpl->seg[i].text, tpl->seg[i].len);
+
+        const struct RenderArg *a = &args[i];
+        if (a->kind == RENDER_K_INT)
+        {
+            char num[RENDER_INT_MAX];
+            outbuf_append(ob, num, put_int(num, a->num));
+        }
+        else if (a->kind == RENDER_K_TIME)
+            outbuf_append(ob, render_time((time_t)a->num), RENDER_TIME_LEN);
+        else if (a->kind == RENDER_K_FIELD)
+        {
+            char esc[512];
+            for (size_t off = 0; off < a->len; off += sizeof(esc) / 2)
+            {
+                size_t take = a->len - off < sizeof(esc) / 2 ? a->len - off : sizeof(esc) / 2;
+                outbuf_append(ob, esc, put_field(esc, a->str + off, take));
+            }
+        }
+        else
+            outbuf_append(ob, a->str, a->len);
+    }
+    outbuf_append(ob, tpl->seg[tpl->nholes].text, tpl->seg[tpl->nholes].len);
+    return ob->failed ? -1 : 0;
+}
+
+int render_row(struct OutBuf *ob, const struct RenderTemplate *tpl, const struct RenderArg *args)
+{
+    size_t max = tpl->seg[tpl->nholes].len;
+    for (int i = 0; i < tpl->nholes; i++)
+        max += tpl->seg[i].len + hole_max(&args[i]);
+
+    char *start = outbuf_reserve_span(ob, max);
+    if (!start)
+        return ob->failed ? -1 : render_row_pieces(ob, tpl, args);
+
+    char *p = start;
+    for (int i = 0; i < tpl->nholes; i++)
+    {
+        memcpy(p, tpl->seg[i].text, tpl->seg[i].len);
+        p += tpl->seg[i].len;
+
+        const struct RenderArg *a = &args[i];
+        if (a->kind == RENDER_K_INT)
+            p += put_int(p, a->num);
+        else if (a->kind == RENDER_K_TIME)
+        {
+            memcpy(p, render_time((time_t)a->num), RENDER_TIME_LEN);
+            p += RENDER_TIME_LEN;
+        }
+        else if (a->kind == RENDER_K_FIELD)
+            p += put_field(p, a->str, a->len);
+        else
+        {
+            memcpy(p, a->str, a->len);
+            p += a->len;
+        }
+    }
+    memcpy(p, tpl->seg[tpl->nholes].text, tpl->seg[tpl->nholes].len);
+    p += tpl->seg[tpl->nholes].len;
+
+    outbuf_commit_span(ob, (size_t)(p - start));
+    return 0;
+}
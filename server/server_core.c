@@ -2,9 +2,19 @@
 #include "common.h"
 #include "models.h"
 #include "command_dispatch.h"
+#include "connections.h"
+#include "sessions.h"
+#include "response.h"
+#include "worker_pool.h"
+#include "storage.h"
+#include "hash_pool.h"
 
-void* client_handler(void *);
-void answer(void *);
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#define MAX_EVENTS      256
+#define JOB_LINE_BUDGET 32
 
 int server_start(int port)
 {
@@ -31,7 +41,7 @@ int server_start(int port)
         return errno;
     }
 
-    if (listen(sd, 10) == -1)
+    if (listen(sd, SOMAXCONN) == -1)
     {
         perror ("[server]Error at listen.\n");
         return errno;
@@ -41,40 +51,252 @@ int server_start(int port)
     return sd;
 }
 
-void server_run(int sd)
+static void client_close(int fd)
+{
+    sessions_clear(fd);
+    conn_close(fd);
+    printf("[server] client %d disconnected\n", fd);
+}
+
+/* Answers a binary request that never reaches the dispatcher. */
+static void client_frame_error(struct Conn *c, const struct FrameHead *h, const char *code, const char *msg)
+{
+    char response[128];
+    build_error(response, sizeof(response), code, msg);
+
+    struct FrameReply *r = conn_reply_open(c, h->id, h->op);
+    conn_send(c->fd, response, strlen(response));
+    conn_reply_close(r);
+}
+
+/*
+ * Runs on a worker. Only one job per connection exists at a time, so the
+ * commands of a client execute exactly once and in the order they arrived;
+ * frames are the exception, command_dispatch_frame() may start them on other
+ * workers. After a batch the job requeues itself to let other connections in.
+ */
+static void client_job(void *arg)
+{
+    struct Conn *c = (struct Conn *)arg;
+    int eof = 0;
+    int budget = JOB_LINE_BUDGET;
+    char *line;
+    size_t len;
+    int rc;
+
+    while ((rc = conn_next_line(c, &line, &len, &eof)) != CONN_DRAINED)
+    {
+        if (rc == CONN_LINE)
+        {
+            /* The connection stays scheduled and keeps this reference until server_resume(). */
+            if (command_dispatch(c, line, len) == DISPATCH_PARKED)
+                return;
+        }
+        else if (rc == CONN_FRAME)
+        {
+            if (command_dispatch_frame(c, line, len) == DISPATCH_PARKED)
+                return;
+        }
+        else if (rc == CONN_FRAME_TOO_LONG)
+        {
+            struct FrameHead h;
+            frame_head_get(line, &h);
+            client_frame_error(c, &h, ERR_BAD_ARGS, "Command too long.");
+        }
+        else
+        {
+            char response[128];
+            build_error(response, sizeof(response), ERR_BAD_ARGS, "Command too long.");
+            conn_send(c->fd, response, strlen(response));
+        }
+
+        if (--budget == 0)
+        {
+            if (worker_pool_submit(client_job, c) == 0)
+                return;
+            budget = JOB_LINE_BUDGET;
+        }
+    }
+
+    if (eof)
+        client_close(c->fd);
+    conn_release(c);
+}
+
+static void client_reject(struct Conn *c)
+{
+    int eof = 0;
+    struct FrameHead frames[CONN_RBUF_SIZE / FRAME_HEADER];
+    int dropped = conn_reject(c, &eof, frames, CONN_RBUF_SIZE / FRAME_HEADER);
+    char response[128];
+
+    if (dropped > 0 && c->framed)
+    {
+        for (int i = 0; i < dropped; i++)
+            client_frame_error(c, &frames[i], ERR_SERVER_BUSY, "Server overloaded, try again later.");
+        fprintf(stderr, "[server] pool full, rejected %d frame(s) from %d\n", dropped, c->fd);
+    }
+    else if (dropped > 0)
+    {
+        build_error(response, sizeof(response), ERR_SERVER_BUSY, "Server overloaded, try again later.");
+        for (int i = 0; i < dropped; i++)
+            conn_send(c->fd, response, strlen(response));
+        fprintf(stderr, "[server] pool full, rejected %d command(s) from %d\n", dropped, c->fd);
+    }
+
+    if (eof)
+        client_close(c->fd);
+    conn_release(c);
+}
+
+/*
+ * Picks up a connection whose job parked on a command that completes on
+ * another thread. The caller hands over the reference the job was holding.
+ */
+void server_resume(struct Conn *c)
+{
+    if (worker_pool_submit(client_job, c) < 0)
+        client_reject(c);
+}
+
+static void client_readable(struct Conn *c, int hangup)
+{
+    if (conn_fill(c, hangup) && worker_pool_submit(client_job, c) < 0)
+        client_reject(c);
+}
+
+static void accept_clients(int sd)
 {
-    struct sockaddr_in from;
-    pthread_t th[MAX_ID_THREADS];
-    int i = 0;
     while (1)
     {
-        int client;
-        struct thData* td = malloc(sizeof(struct thData));
-        unsigned int length = sizeof(from);
+        struct sockaddr_in from;
+        socklen_t length = sizeof(from);
 
-        printf ("[server]Waiting at port %d...\n",PORT);
-        fflush (stdout);
+        int client = accept(sd, (struct sockaddr *) &from, &length);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("[server]Eroare la accept().\n");
+            return;
+        }
 
-        if ((client = accept(sd, (struct sockaddr *) &from, &length)) < 0)
+        if (!conn_open(client, from.sin_addr.s_addr))
         {
-            perror ("[server]Eroare la accept().\n");
+            fprintf(stderr, "[server] Cannot track client %d, dropping it.\n", client);
+            close(client);
             continue;
         }
 
-        td -> id_thread = i++;
-        td -> client = client;
-
-        pthread_create(&th[i], NULL, &client_handler, td);
+        printf("[server] client %d connected\n", client);
     }
 }
 
-void* client_handler(void * arg)
+void server_run(int sd, int workers, int hashers)
 {
-    struct thData* args = (struct thData*)arg;
-    printf ("[thread]- %d - Waiting the message...\n", args->id_thread);
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        perror("[server] epoll_create1");
+        return;
+    }
+
+    conns_init(epfd);
+
+    int flags = fcntl(sd, F_GETFL, 0);
+    fcntl(sd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) < 0)
+    {
+        perror("[server] epoll_ctl listen socket");
+        close(epfd);
+        return;
+    }
+
+    /*
+     * SIGUSR1 dumps runtime counters. It stays blocked in every thread (the
+     * workers inherit this mask) and the reactor picks it up via signalfd.
+     */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.fd = sigfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+    }
+
+    if (worker_pool_start(workers) < 0 || hash_pool_start(hashers) < 0)
+    {
+        fprintf(stderr, "[server] Cannot start worker pool\n");
+        worker_pool_stop();
+        if (sigfd >= 0)
+            close(sigfd);
+        close(epfd);
+        return;
+    }
+
+    printf ("[server]Waiting at port %d...\n",PORT);
     fflush (stdout);
-    command_dispatch(args->client);
-    pthread_detach(pthread_self());
-    close (args->client);
-    return NULL;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("[server] epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            uint32_t what = events[i].events;
+
+            if (fd == sd)
+            {
+                accept_clients(sd);
+                continue;
+            }
+
+            if (fd == sigfd)
+            {
+                struct signalfd_siginfo si;
+                while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+                    ;
+                storage_log_stats();
+                continue;
+            }
+
+            struct Conn *c = conn_acquire(fd);
+            if (!c)
+                continue;
+
+            if (what & EPOLLOUT)
+                conn_flush(c);
+
+            if (what & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                client_readable(c, (what & (EPOLLERR | EPOLLHUP)) != 0);
+
+            conn_release(c);
+        }
+    }
+
+    hash_pool_stop();
+    worker_pool_stop();
+    if (sigfd >= 0)
+        close(sigfd);
+    close(epfd);
 }
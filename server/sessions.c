@@ -1,181 +1,333 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
-#include <sqlite3.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <sodium.h>
 
 #include "sessions.h"
-#include "storage.h"
+#include "connections.h"
+
+/*
+ * Sessions live only as long as the socket, so they are kept in memory.
+ * fd -> user is a flat array of atomics (one load per lookup, no lock);
+ * user -> fd is a chained hash whose buckets are guarded by striped mutexes
+ * and holds one node per logged-in connection, so a user may have several.
+ *
+ * Resume tokens outlive the socket: LOGIN issues one and RESUME on a new
+ * connection binds it to the same user without checking the password again.
+ * A token is 8 bytes of lookup key followed by the secret that is compared
+ * in constant time; each fd remembers the key it logged in with so LOGOUT
+ * can revoke it. Token operations are rare and share one lock.
+ */
+#define SESSION_BUCKETS 4096
+#define SESSION_STRIPES 64
+#define TOKEN_BUCKETS   4096
+#define TOKEN_KEY_BYTES 8
+
+struct SessionNode
+{
+    int fd;
+    int user_id;
+    struct SessionNode *next;
+};
 
-int sessions_init()
+struct ResumeToken
+{
+    uint64_t key;
+    unsigned char token[SESSION_TOKEN_BYTES];
+    int user_id;
+    time_t expires;
+    struct ResumeToken *next;
+};
+
+static atomic_int g_fd_user[MAX_CONNECTIONS];
+static struct SessionNode *g_buckets[SESSION_BUCKETS];
+static pthread_mutex_t g_stripes[SESSION_STRIPES];
+
+static struct ResumeToken *g_tokens[TOKEN_BUCKETS];
+static uint64_t g_fd_token[MAX_CONNECTIONS];    /* 0 = none */
+static int g_token_count = 0;
+static pthread_mutex_t g_token_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned session_bucket(int user_id)
 {
-    const char *sql_create =
-        "CREATE TABLE IF NOT EXISTS sessions ("
-        "  id        INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  client_fd INTEGER UNIQUE NOT NULL,"
-        "  user_id   INTEGER NOT NULL"
-        ");";
+    return ((unsigned)user_id * 2654435761u) % SESSION_BUCKETS;
+}
 
-    const char *sql_clear =
-        "DELETE FROM sessions;";
+static pthread_mutex_t *session_stripe(unsigned bucket)
+{
+    return &g_stripes[bucket % SESSION_STRIPES];
+}
 
-    char *errmsg = NULL;
-    int rc;
+static void session_link(int user_id, int fd, struct SessionNode *node)
+{
+    unsigned b = session_bucket(user_id);
+    node->fd = fd;
+    node->user_id = user_id;
+
+    pthread_mutex_lock(session_stripe(b));
+    node->next = g_buckets[b];
+    g_buckets[b] = node;
+    pthread_mutex_unlock(session_stripe(b));
+}
 
-    pthread_mutex_lock(&db_mutex);
+static void session_unlink(int user_id, int fd)
+{
+    unsigned b = session_bucket(user_id);
+    struct SessionNode *dead = NULL;
 
-    rc = sqlite3_exec(g_db, sql_create, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    pthread_mutex_lock(session_stripe(b));
+    for (struct SessionNode **pp = &g_buckets[b]; *pp; pp = &(*pp)->next)
     {
-        fprintf(stderr, "[sessions] Cannot create sessions table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        if ((*pp)->fd == fd && (*pp)->user_id == user_id)
+        {
+            dead = *pp;
+            *pp = dead->next;
+            break;
+        }
     }
+    pthread_mutex_unlock(session_stripe(b));
 
-    rc = sqlite3_exec(g_db, sql_clear, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    free(dead);
+}
+
+int sessions_init()
+{
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+        atomic_init(&g_fd_user[i], 0);
+
+    for (int i = 0; i < SESSION_STRIPES; i++)
     {
-        fprintf(stderr, "[sessions] Cannot clear sessions: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        if (pthread_mutex_init(&g_stripes[i], NULL) != 0)
+        {
+            fprintf(stderr, "[sessions] Cannot init stripe lock\n");
+            return -1;
+        }
     }
-
-    pthread_mutex_unlock(&db_mutex);
     return 0;
 }
 
 int sessions_set(int client_fd, int user_id)
 {
-    const char *sql =
-        "INSERT INTO sessions(client_fd, user_id) "
-        "VALUES (?, ?) "
-        "ON CONFLICT(client_fd) DO UPDATE SET user_id = excluded.user_id;";
+    if (client_fd < 0 || client_fd >= MAX_CONNECTIONS || user_id <= 0)
+        return -1;
 
-    sqlite3_stmt *stmt;
-    int rc;
+    struct SessionNode *node = malloc(sizeof(*node));
+    if (!node)
+        return -1;
 
-    pthread_mutex_lock(&db_mutex);
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
+    int old = atomic_exchange(&g_fd_user[client_fd], user_id);
+    if (old == user_id)
     {
-        fprintf(stderr, "[sessions] prepare upsert failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        free(node);
+        return 0;
     }
+    if (old > 0)
+        session_unlink(old, client_fd);
 
-    sqlite3_bind_int(stmt, 1, client_fd);
-    sqlite3_bind_int(stmt, 2, user_id);
+    session_link(user_id, client_fd, node);
+    return 0;
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE)
-    {
-        fprintf(stderr, "[sessions] upsert failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
+int sessions_clear(int client_fd)
+{
+    if (client_fd < 0 || client_fd >= MAX_CONNECTIONS)
         return -1;
-    }
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
+    pthread_mutex_lock(&g_token_lock);
+    g_fd_token[client_fd] = 0;
+    pthread_mutex_unlock(&g_token_lock);
+
+    int old = atomic_exchange(&g_fd_user[client_fd], 0);
+    if (old > 0)
+        session_unlink(old, client_fd);
     return 0;
 }
 
-int sessions_clear(int client_fd)
+int sessions_get_user_id(int client_fd)
 {
-    const char *sql =
-        "DELETE FROM sessions WHERE client_fd = ?;";
+    if (client_fd < 0 || client_fd >= MAX_CONNECTIONS)
+        return -1;
 
-    sqlite3_stmt *stmt;
-    int rc;
+    int user_id = atomic_load(&g_fd_user[client_fd]);
+    return user_id > 0 ? user_id : -1;
+}
 
-    pthread_mutex_lock(&db_mutex);
+int sessions_find_fd_by_user_id(int user_id)
+{
+    if (user_id <= 0)
+        return -1;
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
+    unsigned b = session_bucket(user_id);
+    int client_fd = -1;
+
+    pthread_mutex_lock(session_stripe(b));
+    for (struct SessionNode *n = g_buckets[b]; n; n = n->next)
     {
-        fprintf(stderr, "[sessions] prepare delete failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        if (n->user_id == user_id)
+        {
+            client_fd = n->fd;
+            break;
+        }
     }
+    pthread_mutex_unlock(session_stripe(b));
 
-    sqlite3_bind_int(stmt, 1, client_fd);
+    return client_fd;
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE)
+int sessions_find_fds_by_user_id(int user_id, int *out_fds, int max_fds)
+{
+    if (user_id <= 0 || !out_fds || max_fds <= 0)
+        return 0;
+
+    unsigned b = session_bucket(user_id);
+    int count = 0;
+
+    pthread_mutex_lock(session_stripe(b));
+    for (struct SessionNode *n = g_buckets[b]; n && count < max_fds; n = n->next)
     {
-        fprintf(stderr, "[sessions] delete failed: %s\n", sqlite3_errmsg(g_db));
-        sqlite3_finalize(stmt);
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        if (n->user_id == user_id)
+            out_fds[count++] = n->fd;
     }
+    pthread_mutex_unlock(session_stripe(b));
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-    return 0;
+    return count;
 }
 
-int sessions_get_user_id(int client_fd)
+static uint64_t token_key(const unsigned char *token)
 {
-    const char *sql =
-        "SELECT user_id FROM sessions WHERE client_fd = ? LIMIT 1;";
+    uint64_t key;
+    memcpy(&key, token, sizeof(key));
+    return key;
+}
 
-    sqlite3_stmt *stmt;
-    int rc;
-    int user_id = -1;
+/* Caller holds g_token_lock. Unlinks every token that matches; expired ones always go. */
+static int token_sweep(uint64_t key, int user_id, time_t now)
+{
+    int removed = 0;
+    for (int b = 0; b < TOKEN_BUCKETS; b++)
+    {
+        if (key && (unsigned)(key % TOKEN_BUCKETS) != (unsigned)b)
+            continue;
+
+        struct ResumeToken **pp = &g_tokens[b];
+        while (*pp)
+        {
+            struct ResumeToken *t = *pp;
+            if (t->expires <= now || (key && t->key == key) || (user_id > 0 && t->user_id == user_id))
+            {
+                *pp = t->next;
+                sodium_memzero(t, sizeof(*t));
+                free(t);
+                g_token_count--;
+                removed++;
+                continue;
+            }
+            pp = &t->next;
+        }
+    }
+    return removed;
+}
 
-    pthread_mutex_lock(&db_mutex);
+int sessions_token_issue(int client_fd, int user_id, char *out_hex, size_t out_size)
+{
+    if (client_fd < 0 || client_fd >= MAX_CONNECTIONS || user_id <= 0 ||
+        !out_hex || out_size < SESSION_TOKEN_HEX)
+        return -1;
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
+    struct ResumeToken *t = malloc(sizeof(*t));
+    if (!t)
+        return -1;
+
+    do
+    {
+        randombytes_buf(t->token, sizeof(t->token));
+        t->key = token_key(t->token);
+    } while (t->key == 0);
+    t->user_id = user_id;
+    t->expires = time(NULL) + SESSION_TOKEN_TTL;
+
+    /* Once linked, t belongs to the table and a revoke may free it at any time. */
+    sodium_bin2hex(out_hex, out_size, t->token, sizeof(t->token));
+
+    pthread_mutex_lock(&g_token_lock);
+    if (g_token_count >= SESSION_TOKENS_MAX)
+        token_sweep(0, 0, time(NULL));
+    if (g_token_count >= SESSION_TOKENS_MAX)
     {
-        fprintf(stderr, "[sessions] prepare get user_id failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
+        pthread_mutex_unlock(&g_token_lock);
+        sodium_memzero(out_hex, out_size);
+        sodium_memzero(t, sizeof(*t));
+        free(t);
         return -1;
     }
 
-    sqlite3_bind_int(stmt, 1, client_fd);
-
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        user_id = sqlite3_column_int(stmt, 0);
-    } else if (rc != SQLITE_DONE) {
-        fprintf(stderr, "[sessions] get user_id error: %s\n", sqlite3_errmsg(g_db));
-    }
+    unsigned b = (unsigned)(t->key % TOKEN_BUCKETS);
+    t->next = g_tokens[b];
+    g_tokens[b] = t;
+    g_token_count++;
+    g_fd_token[client_fd] = t->key;
+    pthread_mutex_unlock(&g_token_lock);
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-    return user_id;
+    return 0;
 }
 
-int sessions_find_fd_by_user_id(int user_id)
+/* Binds client_fd to the token's user. Returns the user id, or -1 for an unknown or expired token. */
+int sessions_token_resume(int client_fd, const char *token_hex)
 {
-    const char *sql =
-        "SELECT client_fd FROM sessions WHERE user_id = ? LIMIT 1;";
+    unsigned char token[SESSION_TOKEN_BYTES];
+    size_t len = 0;
 
-    sqlite3_stmt *stmt;
-    int rc;
-    int client_fd = -1;
+    if (client_fd < 0 || client_fd >= MAX_CONNECTIONS || !token_hex ||
+        strlen(token_hex) != SESSION_TOKEN_BYTES * 2 ||
+        sodium_hex2bin(token, sizeof(token), token_hex, strlen(token_hex), NULL, &len, NULL) != 0 ||
+        len != sizeof(token))
+        return -1;
 
-    pthread_mutex_lock(&db_mutex);
+    uint64_t key = token_key(token);
+    time_t now = time(NULL);
+    int user_id = -1;
 
-    rc = sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
+    pthread_mutex_lock(&g_token_lock);
+    for (struct ResumeToken *t = g_tokens[key % TOKEN_BUCKETS]; t; t = t->next)
     {
-        fprintf(stderr, "[sessions] prepare find fd failed: %s\n", sqlite3_errmsg(g_db));
-        pthread_mutex_unlock(&db_mutex);
-        return -1;
+        if (t->key != key || sodium_memcmp(t->token, token, sizeof(token)) != 0)
+            continue;
+        if (t->expires > now)
+            user_id = t->user_id;
+        break;
     }
+    if (user_id > 0)
+        g_fd_token[client_fd] = key;
+    pthread_mutex_unlock(&g_token_lock);
 
-    sqlite3_bind_int(stmt, 1, user_id);
+    if (user_id <= 0 || sessions_set(client_fd, user_id) != 0)
+        return -1;
+    return user_id;
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        client_fd = sqlite3_column_int(stmt, 0);
-    } else if (rc != SQLITE_DONE) {
-        fprintf(stderr, "[sessions] find fd error: %s\n", sqlite3_errmsg(g_db));
-    }
+int sessions_token_revoke_fd(int client_fd)
+{
+    if (client_fd < 0 || client_fd >= MAX_CONNECTIONS)
+        return -1;
 
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&db_mutex);
-    return client_fd;
+    pthread_mutex_lock(&g_token_lock);
+    uint64_t key = g_fd_token[client_fd];
+    g_fd_token[client_fd] = 0;
+    int removed = key ? token_sweep(key, 0, 0) : 0;
+    pthread_mutex_unlock(&g_token_lock);
+    return removed;
+}
+
+int sessions_token_revoke_user(int user_id)
+{
+    if (user_id <= 0)
+        return -1;
+
+    pthread_mutex_lock(&g_token_lock);
+    int removed = token_sweep(0, user_id, time(NULL));
+    pthread_mutex_unlock(&g_token_lock);
+    return removed;
 }
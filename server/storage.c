@@ -1,211 +1,403 @@
 #include <sqlite3.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "storage.h"
+#include "migrations.h"
 #include "common.h"
 
+#define STORAGE_BUSY_TIMEOUT_MS 5000
+
+/*
+ * g_db is the single writer connection and stays behind db_mutex. Reads go
+ * through storage_read_begin(), which gives every thread its own read-only
+ * connection; with the database in WAL mode those never wait for the writer.
+ */
 sqlite3 *g_db = NULL;
 pthread_mutex_t db_mutex;
 
-int storage_init(const char *path)
+/*
+ * Prepared statements are cached per connection, keyed by SQL text.
+ * storage_prepare() hands out the cached statement and storage_finalize()
+ * only resets it, so the hot path never parses or plans SQL again. Entries
+ * are indexed twice, by SQL text for prepare and by statement pointer for
+ * finalize, so both are a hash probe. A cache
+ * belongs to one connection and is only touched by whoever may use that
+ * connection (the writer under db_mutex, a reader by its own thread).
+ */
+struct StmtCacheEntry
 {
-    int rc = sqlite3_open(path, &g_db);
-    if (rc != SQLITE_OK)
+    char         *sql;
+    uint32_t      hash;
+    int           in_use;
+    sqlite3_stmt *stmt;
+};
+
+struct StmtCache
+{
+    struct StmtCacheEntry *entries;
+    int  count;
+    int  cap;
+    int *slots;     /* open addressing over entries by SQL, -1 = empty */
+    int *by_stmt;   /* same, by statement pointer */
+    int  nslots;
+};
+
+struct StorageReader
+{
+    sqlite3         *db;
+    struct StmtCache cache;
+};
+
+static char g_db_path[512];
+static pthread_key_t g_reader_key;
+static int g_reader_key_ok = 0;
+
+static struct StmtCache g_writer_cache;
+static atomic_ulong g_stmt_hits;
+static atomic_ulong g_stmt_misses;
+
+static uint32_t stmt_hash(const char *sql)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)sql; *p; p++)
     {
-        fprintf(stderr, "[storage] Cannot open DB: %s\n", sqlite3_errmsg(g_db));
-        return -1;
+        h ^= *p;
+        h *= 16777619u;
     }
+    return h;
+}
 
-    if (pthread_mutex_init(&db_mutex, NULL) != 0)
-    {
-        fprintf(stderr, "[storage] Cannot init db_mutex\n");
-        sqlite3_close(g_db);
-        g_db = NULL;
+static uint32_t stmt_ptr_hash(const sqlite3_stmt *stmt)
+{
+    uint64_t p = (uint64_t)(uintptr_t)stmt >> 4;
+    return (uint32_t)((p * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static int stmt_cache_find(struct StmtCache *cache, const char *sql, uint32_t hash)
+{
+    if (cache->nslots == 0)
         return -1;
+
+    for (int i = (int)(hash & (uint32_t)(cache->nslots - 1)); ; i = (i + 1) & (cache->nslots - 1))
+    {
+        int idx = cache->slots[i];
+        if (idx < 0)
+            return -1;
+
+        struct StmtCacheEntry *e = &cache->entries[idx];
+        if (e->hash == hash && (e->sql == sql || strcmp(e->sql, sql) == 0))
+            return idx;
     }
+}
 
-    char *errmsg = NULL;
-    const char *sql_posts =
-        "CREATE TABLE IF NOT EXISTS posts ("
-        "  id         INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  author_id  INTEGER NOT NULL,"
-        "  visibility INTEGER NOT NULL,"
-        "  content    TEXT    NOT NULL,"
-        "  created_at INTEGER NOT NULL"
-        ");";
-
-    rc = sqlite3_exec(g_db, sql_posts, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "[storage] Cannot create posts table: %s\n", errmsg);
-        sqlite3_free(errmsg);
+static int stmt_cache_find_stmt(struct StmtCache *cache, const sqlite3_stmt *stmt)
+{
+    if (cache->nslots == 0)
         return -1;
+
+    for (int i = (int)(stmt_ptr_hash(stmt) & (uint32_t)(cache->nslots - 1)); ; i = (i + 1) & (cache->nslots - 1))
+    {
+        int idx = cache->by_stmt[i];
+        if (idx < 0 || cache->entries[idx].stmt == stmt)
+            return idx;
     }
+}
 
-    const char *sql_conversations =
-        "CREATE TABLE IF NOT EXISTS conversations ("
-        "  id          INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  title       TEXT NOT NULL,"
-        "  is_group    INTEGER NOT NULL,"
-        "  visibility  INTEGER NOT NULL,"
-        "  created_by  INTEGER NOT NULL,"
-        "  created_at  INTEGER NOT NULL"
-        ");";
+static void stmt_cache_link(struct StmtCache *cache, int idx)
+{
+    int i = (int)(cache->entries[idx].hash & (uint32_t)(cache->nslots - 1));
+    while (cache->slots[i] >= 0)
+        i = (i + 1) & (cache->nslots - 1);
+    cache->slots[i] = idx;
 
-    rc = sqlite3_exec(g_db, sql_conversations, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    i = (int)(stmt_ptr_hash(cache->entries[idx].stmt) & (uint32_t)(cache->nslots - 1));
+    while (cache->by_stmt[i] >= 0)
+        i = (i + 1) & (cache->nslots - 1);
+    cache->by_stmt[i] = idx;
+}
+
+static int stmt_cache_insert(struct StmtCache *cache, const char *sql, uint32_t hash, sqlite3_stmt *stmt)
+{
+    if (cache->count == cache->cap)
     {
-        fprintf(stderr, "[storage] Cannot create conversations table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        return -1;
+        int cap = cache->cap ? cache->cap * 2 : 64;
+        struct StmtCacheEntry *entries = realloc(cache->entries, (size_t)cap * sizeof(*entries));
+        if (!entries)
+            return -1;
+        cache->entries = entries;
+
+        int *slots = malloc((size_t)cap * 2 * sizeof(int));
+        int *by_stmt = malloc((size_t)cap * 2 * sizeof(int));
+        if (!slots || !by_stmt)
+        {
+            free(slots);
+            free(by_stmt);
+            return -1;
+        }
+        free(cache->slots);
+        free(cache->by_stmt);
+        cache->slots = slots;
+        cache->by_stmt = by_stmt;
+        cache->nslots = cap * 2;
+        cache->cap = cap;
+
+        for (int i = 0; i < cache->nslots; i++)
+        {
+            cache->slots[i] = -1;
+            cache->by_stmt[i] = -1;
+        }
+        for (int i = 0; i < cache->count; i++)
+            stmt_cache_link(cache, i);
     }
 
-    const char *sql_members =
-        "CREATE TABLE IF NOT EXISTS conversation_members ("
-        "  conversation_id  INTEGER NOT NULL,"
-        "  user_id          INTEGER NOT NULL,"
-        "  is_admin         INTEGER NOT NULL DEFAULT 0,"
-        "  joined_at        INTEGER NOT NULL,"
-        "  PRIMARY KEY (conversation_id, user_id)"
-        ");";
+    char *key = strdup(sql);
+    if (!key)
+        return -1;
 
-    rc = sqlite3_exec(g_db, sql_members, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    struct StmtCacheEntry *e = &cache->entries[cache->count];
+    e->sql = key;
+    e->hash = hash;
+    e->in_use = 1;
+    e->stmt = stmt;
+    stmt_cache_link(cache, cache->count);
+    cache->count++;
+    return 0;
+}
+
+static void stmt_cache_clear(struct StmtCache *cache)
+{
+    for (int i = 0; i < cache->count; i++)
     {
-        fprintf(stderr, "[storage] Cannot create conversation_members table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        return -1;
+        sqlite3_finalize(cache->entries[i].stmt);
+        free(cache->entries[i].sql);
     }
+    free(cache->entries);
+    free(cache->slots);
+    free(cache->by_stmt);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static struct StmtCache *stmt_cache_for(sqlite3 *db)
+{
+    if (db == g_db)
+        return &g_writer_cache;
 
-    const char *sql_messages =
-        "CREATE TABLE IF NOT EXISTS messages ("
-        "  id              INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  conversation_id INTEGER NOT NULL,"
-        "  sender_id       INTEGER NOT NULL,"
-        "  content         TEXT NOT NULL,"
-        "  created_at      INTEGER NOT NULL"
-        ");";
+    struct StorageReader *r = g_reader_key_ok ? pthread_getspecific(g_reader_key) : NULL;
+    if (r && r->db == db)
+        return &r->cache;
+    return NULL;
+}
 
-    rc = sqlite3_exec(g_db, sql_messages, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+int storage_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt)
+{
+    *stmt = NULL;
+
+    struct StmtCache *cache = stmt_cache_for(db);
+    if (!cache)
     {
-        fprintf(stderr, "[storage] Cannot create messages table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        return -1;
+        atomic_fetch_add(&g_stmt_misses, 1);
+        return sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
     }
 
-    const char *sql_friends =
-        "CREATE TABLE IF NOT EXISTS friends ("
-        "  user_id   INTEGER NOT NULL,"
-        "  friend_id INTEGER NOT NULL,"
-        "  type      INTEGER NOT NULL,"
-        "  PRIMARY KEY (user_id, friend_id)"
-        ");";
-
-    rc = sqlite3_exec(g_db, sql_friends, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    uint32_t hash = stmt_hash(sql);
+    int idx = stmt_cache_find(cache, sql, hash);
+    if (idx >= 0)
     {
-        fprintf(stderr, "[storage] Cannot create friends table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        return -1;
+        struct StmtCacheEntry *e = &cache->entries[idx];
+
+        /* Same SQL already active further up the stack: use a private copy. */
+        if (e->in_use)
+        {
+            atomic_fetch_add(&g_stmt_misses, 1);
+            return sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
+        }
+
+        atomic_fetch_add(&g_stmt_hits, 1);
+        e->in_use = 1;
+        *stmt = e->stmt;
+        return SQLITE_OK;
     }
 
-    const char *sql_groups =
-        "CREATE TABLE IF NOT EXISTS groups ("
-        "  id        INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  name      TEXT UNIQUE NOT NULL,"
-        "  owner_id  INTEGER NOT NULL,"
-        "  is_public INTEGER NOT NULL"
-        ");";
+    atomic_fetch_add(&g_stmt_misses, 1);
+    int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+    if (rc != SQLITE_OK || !*stmt)
+        return rc;
 
-    rc = sqlite3_exec(g_db, sql_groups, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    stmt_cache_insert(cache, sql, hash, *stmt);
+    return SQLITE_OK;
+}
+
+int storage_finalize(sqlite3_stmt *stmt)
+{
+    if (!stmt)
+        return SQLITE_OK;
+
+    struct StmtCache *cache = stmt_cache_for(sqlite3_db_handle(stmt));
+    int idx = cache ? stmt_cache_find_stmt(cache, stmt) : -1;
+    if (idx >= 0)
     {
-        fprintf(stderr, "[storage] Cannot create groups table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        return -1;
+        int rc = sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        cache->entries[idx].in_use = 0;
+        return rc;
     }
 
-    const char *sql_group_members =
-        "CREATE TABLE IF NOT EXISTS group_members ("
-        "  group_id INTEGER NOT NULL,"
-        "  user_id  INTEGER NOT NULL,"
-        "  role     INTEGER NOT NULL,"
-        "  PRIMARY KEY (group_id, user_id)"
-        ");";
+    return sqlite3_finalize(stmt);
+}
 
-    rc = sqlite3_exec(g_db, sql_group_members, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+void storage_stmt_stats(unsigned long *hits, unsigned long *misses)
+{
+    if (hits)
+        *hits = atomic_load(&g_stmt_hits);
+    if (misses)
+        *misses = atomic_load(&g_stmt_misses);
+}
+
+void storage_log_stats(void)
+{
+    unsigned long hits, misses;
+    storage_stmt_stats(&hits, &misses);
+
+    unsigned long total = hits + misses;
+    printf("[storage] statement cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+           hits, misses, total ? 100.0 * (double)hits / (double)total : 0.0);
+    fflush(stdout);
+}
+
+static void storage_reader_destroy(void *arg)
+{
+    struct StorageReader *r = (struct StorageReader *)arg;
+    stmt_cache_clear(&r->cache);
+    sqlite3_close(r->db);
+    free(r);
+}
+
+sqlite3 *storage_read_begin(void)
+{
+    struct StorageReader *r = g_reader_key_ok ? pthread_getspecific(g_reader_key) : NULL;
+
+    if (!r && g_reader_key_ok)
     {
-        fprintf(stderr, "[storage] Cannot create group_members table: %s\n", errmsg);
-        sqlite3_free(errmsg);
-        return -1;
+        sqlite3 *db = NULL;
+        int rc = sqlite3_open_v2(g_db_path, &db,
+                                 SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+        if (rc == SQLITE_OK && (r = calloc(1, sizeof(*r))) != NULL)
+        {
+            sqlite3_busy_timeout(db, STORAGE_BUSY_TIMEOUT_MS);
+            r->db = db;
+            pthread_setspecific(g_reader_key, r);
+        }
+        else
+        {
+            fprintf(stderr, "[storage] Cannot open reader connection: %s\n", sqlite3_errmsg(db));
+            sqlite3_close(db);
+        }
     }
 
-    const char *sql_group_requests =
-        "CREATE TABLE IF NOT EXISTS group_requests ("
-        "  group_id INTEGER NOT NULL,"
-        "  user_id  INTEGER NOT NULL,"
-        "  PRIMARY KEY (group_id, user_id)"
-        ");";
+    if (r)
+        return r->db;
 
-    rc = sqlite3_exec(g_db, sql_group_requests, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    /* No private connection for this thread: fall back to the writer. */
+    pthread_mutex_lock(&db_mutex);
+    return g_db;
+}
+
+void storage_read_end(sqlite3 *db)
+{
+    if (db == g_db)
+        pthread_mutex_unlock(&db_mutex);
+}
+
+/*
+ * Write transactions on g_db; the caller holds db_mutex. storage_write_end()
+ * commits when rc is 0 and rolls back otherwise, and returns 0 only if the
+ * changes were committed.
+ */
+int storage_write_begin(void)
+{
+    if (sqlite3_exec(g_db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
     {
-        fprintf(stderr, "[storage] Cannot create group_requests table: %s\n", errmsg);
-        sqlite3_free(errmsg);
+        fprintf(stderr, "[storage] begin failed: %s\n", sqlite3_errmsg(g_db));
         return -1;
     }
+    return 0;
+}
 
-    const char *sql_group_messages =
-        "CREATE TABLE IF NOT EXISTS group_messages ("
-        "  id         INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  group_id   INTEGER NOT NULL,"
-        "  sender_id  INTEGER NOT NULL,"
-        "  content    TEXT    NOT NULL,"
-        "  created_at INTEGER NOT NULL"
-        ");";
+int storage_write_end(int rc)
+{
+    if (rc == 0 && sqlite3_exec(g_db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK)
+        return 0;
+
+    if (rc == 0)
+        fprintf(stderr, "[storage] commit failed: %s\n", sqlite3_errmsg(g_db));
+    sqlite3_exec(g_db, "ROLLBACK;", NULL, NULL, NULL);
+    return -1;
+}
+
+/*
+ * Asks for WAL and reports whether the database actually runs in it. The
+ * pragma answers with the resulting mode rather than failing, so a VFS
+ * without shared memory quietly keeps the rollback journal.
+ */
+static int storage_enable_wal(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int wal = 0;
 
-    rc = sqlite3_exec(g_db, sql_group_messages, NULL, NULL, &errmsg);
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode = WAL;", -1, &stmt, NULL) != SQLITE_OK)
+        return 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *mode = (const char *)sqlite3_column_text(stmt, 0);
+        wal = mode && sqlite3_stricmp(mode, "wal") == 0;
+    }
+    sqlite3_finalize(stmt);
+    return wal;
+}
+
+int storage_init(const char *path)
+{
+    int rc = sqlite3_open(path, &g_db);
     if (rc != SQLITE_OK)
     {
-        fprintf(stderr, "[storage] Cannot create group_messages table: %s\n", errmsg);
-        sqlite3_free(errmsg);
+        fprintf(stderr, "[storage] Cannot open DB: %s\n", sqlite3_errmsg(g_db));
         return -1;
     }
 
-    const char *sql_notifications =
-        "CREATE TABLE IF NOT EXISTS notifications ("
-        "id         INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "user_id    INTEGER NOT NULL,"
-        "type       TEXT    NOT NULL,"
-        "payload    TEXT    NOT NULL,"
-        "created_at INTEGER NOT NULL,"
-        "deleted    INTEGER NOT NULL DEFAULT 0,"
-        "FOREIGN KEY(user_id) REFERENCES users(id)"
-        ");";
+    snprintf(g_db_path, sizeof(g_db_path), "%s", path);
+    sqlite3_busy_timeout(g_db, STORAGE_BUSY_TIMEOUT_MS);
 
-    rc = sqlite3_exec(g_db, sql_notifications, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    if (pthread_mutex_init(&db_mutex, NULL) != 0)
     {
-        fprintf(stderr, "[storage] Cannot create notifications table: %s\n", errmsg);
-        sqlite3_free(errmsg);
+        fprintf(stderr, "[storage] Cannot init db_mutex\n");
+        sqlite3_close(g_db);
+        g_db = NULL;
         return -1;
     }
 
-    const char *sql_friend_requests =
-    "CREATE TABLE IF NOT EXISTS friend_requests ("
-    "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
-    "  from_id INTEGER NOT NULL,"
-    "  to_id INTEGER NOT NULL,"
-    "  created_at INTEGER NOT NULL,"
-    "  UNIQUE(from_id, to_id)"
-    ");";
+    if (!storage_enable_wal(g_db))
+    {
+        fprintf(stderr, "[storage] WAL unavailable, readers will share the writer lock.\n");
+    }
+    else
+    {
+        sqlite3_exec(g_db, "PRAGMA synchronous = NORMAL;", NULL, NULL, NULL);
+        if (pthread_key_create(&g_reader_key, storage_reader_destroy) == 0)
+            g_reader_key_ok = 1;
+    }
 
-    rc = sqlite3_exec(g_db, sql_friend_requests, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK)
+    if (storage_migrate(g_db) < 0)
     {
-        fprintf(stderr, "[storage] Cannot create friend_requests table: %s\n", errmsg);
-        sqlite3_free(errmsg);
+        if (g_reader_key_ok)
+        {
+            pthread_key_delete(g_reader_key);
+            g_reader_key_ok = 0;
+        }
+        stmt_cache_clear(&g_writer_cache);
+        sqlite3_close(g_db);
+        g_db = NULL;
+        pthread_mutex_destroy(&db_mutex);
         return -1;
     }
 
@@ -215,6 +407,20 @@ int storage_init(const char *path)
 
 void storage_close(void)
 {
+    storage_log_stats();
+
+    if (g_reader_key_ok)
+    {
+        struct StorageReader *r = pthread_getspecific(g_reader_key);
+        if (r)
+        {
+            storage_reader_destroy(r);
+            pthread_setspecific(g_reader_key, NULL);
+        }
+    }
+
+    stmt_cache_clear(&g_writer_cache);
+
     if (g_db) {
         sqlite3_close(g_db);
         g_db = NULL;
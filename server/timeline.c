@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "timeline.h"
+#include "storage.h"
+#include "models.h"
+
+/*
+ * Materialized home timelines (fan-out on write). Every post is copied, as a
+ * (user_id, created_at, post_id) key, into the timeline of each user allowed
+ * to see it in VIEW_FEED, so reading a feed is a range scan on one
+ * clustered key instead of a join over all posts.
+ *
+ *  - A public post of a public account is visible to everybody; it is
+ *    written once to the shared timeline 0 and merged in at read time.
+ *  - Any other post goes to its author's timeline and to every reader the
+ *    feed rules admit: mutual friends for VIS_PUBLIC/VIS_FRIENDS, users the
+ *    author marked FRIEND_CLOSE for VIS_CLOSE_FRIENDS.
+ *  - Authors with more than TIMELINE_FANOUT_MAX friends are listed in
+ *    timeline_pull and skip the per-reader copies; their posts are pulled
+ *    from posts(author_id, created_at) when a friend reads the feed.
+ *
+ * The SQL below spells the enum values out; keep it in step with models.h.
+ */
+_Static_assert(VIS_PUBLIC == 0 && VIS_FRIENDS == 1 && VIS_CLOSE_FRIENDS == 2, "timeline SQL");
+_Static_assert(USER_PUBLIC == 0 && FRIEND_CLOSE == 0, "timeline SQL");
+
+#define TL_INSERT \
+    "INSERT OR IGNORE INTO timeline(user_id, created_at, post_id, author_id) "
+
+#define TL_SHARED(scope) \
+    TL_INSERT \
+    "SELECT 0, p.created_at, p.id, p.author_id " \
+    "FROM posts p JOIN users u ON u.id = p.author_id " \
+    "WHERE " scope " AND p.visibility = 0 AND u.vis = 0;"
+
+#define TL_OWN(scope) \
+    TL_INSERT \
+    "SELECT p.author_id, p.created_at, p.id, p.author_id " \
+    "FROM posts p JOIN users u ON u.id = p.author_id " \
+    "WHERE " scope " AND NOT (p.visibility = 0 AND u.vis = 0);"
+
+#define TL_READERS(scope) \
+    TL_INSERT \
+    "SELECT f2.friend_id, p.created_at, p.id, p.author_id " \
+    "FROM posts p " \
+    "JOIN users u ON u.id = p.author_id " \
+    "JOIN friends f2 ON f2.user_id = p.author_id " \
+    "WHERE " scope " " \
+    "  AND NOT (p.visibility = 0 AND u.vis = 0) " \
+    "  AND p.author_id NOT IN (SELECT author_id FROM timeline_pull) " \
+    "  AND ((p.visibility = 2 AND f2.type = 0) " \
+    "    OR (p.visibility IN (0, 1) AND EXISTS (SELECT 1 FROM friends f1 " \
+    "         WHERE f1.user_id = f2.friend_id AND f1.friend_id = p.author_id)));"
+
+/* Runs one statement on the writer; params are bound as ints in order. */
+static int tl_exec(sqlite3 *db, const char *sql, int nparams, const int *params)
+{
+    sqlite3_stmt *stmt;
+
+    int rc = storage_prepare(db, sql, &stmt);
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "[timeline] prepare failed: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    for (int i = 0; i < nparams; i++)
+        sqlite3_bind_int(stmt, i + 1, params[i]);
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "[timeline] step failed: %s\n", sqlite3_errmsg(db));
+        storage_finalize(stmt);
+        return -1;
+    }
+
+    storage_finalize(stmt);
+    return 0;
+}
+
+int timeline_add_post(int post_id)
+{
+    const char *sql_author = "SELECT author_id FROM posts WHERE id = ?;";
+    sqlite3_stmt *stmt;
+    int author_id = -1;
+
+    if (storage_prepare(g_db, sql_author, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[timeline] prepare author failed: %s\n", sqlite3_errmsg(g_db));
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, post_id);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        author_id = sqlite3_column_int(stmt, 0);
+    storage_finalize(stmt);
+
+    if (author_id <= 0)
+        return -1;
+
+    if (timeline_check_degree(author_id) < 0)
+        return -1;
+
+    if (tl_exec(g_db, TL_SHARED("p.id = ?"), 1, &post_id) < 0 ||
+        tl_exec(g_db, TL_OWN("p.id = ?"), 1, &post_id) < 0 ||
+        tl_exec(g_db, TL_READERS("p.id = ?"), 1, &post_id) < 0)
+        return -1;
+
+    return 0;
+}
+
+int timeline_remove_post(int post_id)
+{
+    return tl_exec(g_db, "DELETE FROM timeline WHERE post_id = ?;", 1, &post_id);
+}
+
+/* Recomputes what each of the two users sees of the other after a friendship change. */
+int timeline_refresh_pair(int user_a, int user_b)
+{
+    int pairs[2][2] = { { user_a, user_b }, { user_b, user_a } };
+
+    for (int i = 0; i < 2; i++)
+    {
+        int author = pairs[i][0];
+        int reader = pairs[i][1];
+        const int del[] = { reader, author };
+        const int ins[] = { author, reader };
+
+        if (tl_exec(g_db, "DELETE FROM timeline WHERE author_id = ?2 AND user_id = ?1;", 2, del) < 0)
+            return -1;
+        if (tl_exec(g_db, TL_READERS("p.author_id = ?1 AND f2.friend_id = ?2"), 2, ins) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Redistributes every post of an author, e.g. after a profile visibility change. */
+int timeline_refresh_author(int author_id)
+{
+    if (tl_exec(g_db, "DELETE FROM timeline WHERE author_id = ?;", 1, &author_id) < 0 ||
+        tl_exec(g_db, TL_SHARED("p.author_id = ?"), 1, &author_id) < 0 ||
+        tl_exec(g_db, TL_OWN("p.author_id = ?"), 1, &author_id) < 0 ||
+        tl_exec(g_db, TL_READERS("p.author_id = ?"), 1, &author_id) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Keeps an author's timeline_pull membership in step with their friend
+ * count. Crossing TIMELINE_FANOUT_MAX either way redistributes the author's
+ * posts: a promoted author's reader copies are dropped, a demoted one's are
+ * written back.
+ */
+int timeline_check_degree(int author_id)
+{
+    const char *sql =
+        "SELECT (SELECT COUNT(*) FROM "
+        "          (SELECT 1 FROM friends WHERE user_id = ?1 LIMIT ?2 + 1)) > ?2, "
+        "       EXISTS (SELECT 1 FROM timeline_pull WHERE author_id = ?1);";
+    sqlite3_stmt *stmt;
+
+    if (storage_prepare(g_db, sql, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[timeline] prepare degree failed: %s\n", sqlite3_errmsg(g_db));
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, author_id);
+    sqlite3_bind_int(stmt, 2, TIMELINE_FANOUT_MAX);
+
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+        fprintf(stderr, "[timeline] degree failed: %s\n", sqlite3_errmsg(g_db));
+        storage_finalize(stmt);
+        return -1;
+    }
+    int pull = sqlite3_column_int(stmt, 0);
+    int listed = sqlite3_column_int(stmt, 1);
+    storage_finalize(stmt);
+
+    if (pull == listed)
+        return 0;
+
+    if (tl_exec(g_db, pull ? "INSERT INTO timeline_pull(author_id) VALUES (?);"
+                           : "DELETE FROM timeline_pull WHERE author_id = ?;",
+                1, &author_id) < 0)
+        return -1;
+
+    return timeline_refresh_author(author_id);
+}
+
+int timeline_remove_user(int user_id)
+{
+    if (tl_exec(g_db, "DELETE FROM timeline WHERE author_id = ?;", 1, &user_id) < 0 ||
+        tl_exec(g_db, "DELETE FROM timeline WHERE user_id = ?;", 1, &user_id) < 0 ||
+        tl_exec(g_db, "DELETE FROM timeline_pull WHERE author_id = ?;", 1, &user_id) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Rebuilds all timelines from posts and friends. Used by the migration that
+ * introduces them and by REBUILD_TIMELINES; the caller owns the transaction.
+ */
+int timeline_rebuild(sqlite3 *db)
+{
+    const int limit = TIMELINE_FANOUT_MAX;
+
+    if (tl_exec(db, "DELETE FROM timeline;", 0, NULL) < 0 ||
+        tl_exec(db, "DELETE FROM timeline_pull;", 0, NULL) < 0 ||
+        tl_exec(db,
+                "INSERT INTO timeline_pull(author_id) "
+                "SELECT user_id FROM friends GROUP BY user_id HAVING COUNT(*) > ?;",
+                1, &limit) < 0 ||
+        tl_exec(db, TL_SHARED("1"), 0, NULL) < 0 ||
+        tl_exec(db, TL_OWN("1"), 0, NULL) < 0 ||
+        tl_exec(db, TL_READERS("1"), 0, NULL) < 0)
+        return -1;
+
+    printf("[timeline] Rebuilt home timelines.\n");
+    return 0;
+}
+
+int timeline_rebuild_all(void)
+{
+    pthread_mutex_lock(&db_mutex);
+
+    int rc = storage_write_begin();
+    if (rc == 0)
+        rc = storage_write_end(timeline_rebuild(g_db));
+
+    pthread_mutex_unlock(&db_mutex);
+    return rc;
+}
+
+/*
+ * One feed page: the reader's own timeline, the shared timeline and the
+ * posts of high-degree friends, each read as a bounded range below the
+ * cursor and merged. UNION drops the posts that are in more than one.
+ */
+int timeline_for_each(int viewer_id, const struct PostCursor *after, int max_size, post_visit_fn fn, void *ctx)
+{
+    if (max_size <= 0)
+        return 0;
+
+    const char *sql =
+        "WITH page(id, created_at) AS ( "
+        "  SELECT * FROM (SELECT post_id, created_at FROM timeline "
+        "                 WHERE user_id = ?1 AND (created_at, post_id) < (?2, ?3) "
+        "                 ORDER BY created_at DESC, post_id DESC LIMIT ?4) "
+        "  UNION "
+        "  SELECT * FROM (SELECT post_id, created_at FROM timeline "
+        "                 WHERE user_id = 0 AND (created_at, post_id) < (?2, ?3) "
+        "                 ORDER BY created_at DESC, post_id DESC LIMIT ?4) "
+        "  UNION "
+        "  SELECT * FROM (SELECT p.id, p.created_at "
+        "                 FROM timeline_pull tp "
+        "                 JOIN friends f2 ON f2.user_id = tp.author_id AND f2.friend_id = ?1 "
+        "                 JOIN posts p ON p.author_id = tp.author_id "
+        "                 LEFT JOIN friends f1 ON f1.user_id = ?1 AND f1.friend_id = tp.author_id "
+        "                 WHERE (p.created_at, p.id) < (?2, ?3) "
+        "                   AND ((p.visibility = 2 AND f2.type = 0) "
+        "                     OR (p.visibility IN (0, 1) AND f1.user_id IS NOT NULL)) "
+        "                 ORDER BY p.created_at DESC, p.id DESC LIMIT ?4) "
+        ") "
+        "SELECT p.id, p.author_id, u.name, p.visibility, p.content, p.created_at "
+        "FROM page "
+        "JOIN posts p ON p.id = page.id "
+        "JOIN users u ON u.id = p.author_id "
+        "ORDER BY page.created_at DESC, page.id DESC "
+        "LIMIT ?4;";
+
+    sqlite3_stmt *stmt;
+    int rc;
+
+    sqlite3 *db = storage_read_begin();
+
+    rc = storage_prepare(db, sql, &stmt);
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "[timeline] read prepare failed: %s\n", sqlite3_errmsg(db));
+        storage_read_end(db);
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, viewer_id);
+    sqlite3_bind_int(stmt, 2, after ? after->created_at : INT_MAX);
+    sqlite3_bind_int(stmt, 3, after ? after->id : INT_MAX);
+    sqlite3_bind_int(stmt, 4, max_size);
+
+    int count = posts_visit_stmt(stmt, max_size, fn, ctx);
+    storage_read_end(db);
+    return count;
+}
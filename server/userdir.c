@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sqlite3.h>
+
+#include "userdir.h"
+#include "storage.h"
+#include "epoch.h"
+
+/*
+ * In-memory copy of the users table without the password hashes, so
+ * id <-> name resolution never reaches SQLite. A directory is an id-indexed
+ * array and an open-addressing name table, both holding pointers to
+ * immutable UserRecords. A record carries the full name in the same
+ * allocation, however long the users table lets it be.
+ *
+ * Readers never lock. A change allocates a new record, swaps it into both
+ * tables with atomic stores and frees the old one after epoch_synchronize().
+ * Removed names leave a tombstone so probes keep going. When a table runs
+ * out of room a bigger directory is built from the live records and
+ * published the same way; records themselves are shared, not copied.
+ */
+
+#define USERDIR_MIN_IDS   1024
+#define USERDIR_MIN_NAMES 2048
+
+struct UserRecord
+{
+    struct UserInfo info;
+    char name[];
+};
+
+struct UserDir
+{
+    int ids;                             /* by_id has ids slots */
+    int names;                           /* power of two */
+    _Atomic(struct UserRecord *) *by_id;
+    _Atomic(struct UserRecord *) *by_name;
+    int used;                            /* live + tombstones, writer only */
+};
+
+static _Atomic(struct UserDir *) g_dir;
+static pthread_mutex_t g_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct UserRecord g_tombstone;
+static atomic_uint g_dir_version;
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct UserRecord *record_new(const struct UserInfo *info, int user_id, const char *name)
+{
+    size_t len = strlen(name);
+    struct UserRecord *u = malloc(sizeof(*u) + len + 1);
+    if (!u)
+        return NULL;
+    u->info = *info;
+    u->info.id = user_id;
+    memcpy(u->name, name, len + 1);
+    return u;
+}
+
+static struct UserDir *dir_alloc(int ids, int names)
+{
+    struct UserDir *d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+
+    d->ids = ids;
+    d->names = names;
+    d->by_id = calloc((size_t)ids, sizeof(*d->by_id));
+    d->by_name = calloc((size_t)names, sizeof(*d->by_name));
+    if (!d->by_id || !d->by_name)
+    {
+        free(d->by_id);
+        free(d->by_name);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+/* Frees the tables only; records are owned by whichever directory is current. */
+static void dir_free(struct UserDir *d)
+{
+    if (!d)
+        return;
+    free(d->by_id);
+    free(d->by_name);
+    free(d);
+}
+
+static int dir_name_slot(const struct UserDir *d, const char *name)
+{
+    int mask = d->names - 1;
+    for (int i = (int)(name_hash(name) & (uint32_t)mask); ; i = (i + 1) & mask)
+    {
+        struct UserRecord *u = atomic_load_explicit(&d->by_name[i], memory_order_acquire);
+        if (!u)
+            return -1;
+        if (u != &g_tombstone && strcmp(u->name, name) == 0)
+            return i;
+    }
+}
+
+static struct UserRecord *dir_lookup_id(const struct UserDir *d, int user_id)
+{
+    if (!d || user_id < 0 || user_id >= d->ids)
+        return NULL;
+    return atomic_load_explicit(&d->by_id[user_id], memory_order_acquire);
+}
+
+/* Writer only; the caller made sure a free slot exists. */
+static void dir_link_name(struct UserDir *d, struct UserRecord *u)
+{
+    int mask = d->names - 1;
+    int i = (int)(name_hash(u->name) & (uint32_t)mask);
+    struct UserRecord *cur;
+    while ((cur = atomic_load(&d->by_name[i])) != NULL && cur != &g_tombstone)
+        i = (i + 1) & mask;
+    if (!cur)
+        d->used++;
+    atomic_store_explicit(&d->by_name[i], u, memory_order_release);
+}
+
+/* Builds a directory with room for user_id and publishes it. Writer only. */
+static struct UserDir *dir_grow(struct UserDir *old, int user_id)
+{
+    int ids = old->ids;
+    while (ids <= user_id)
+        ids *= 2;
+
+    int live = 0;
+    for (int i = 0; i < old->ids; i++)
+        if (atomic_load(&old->by_id[i]))
+            live++;
+
+    int names = old->names;
+    while ((live + 1) * 2 > names)
+        names *= 2;
+
+    struct UserDir *d = dir_alloc(ids, names);
+    if (!d)
+        return NULL;
+
+    for (int i = 0; i < old->ids; i++)
+    {
+        struct UserRecord *u = atomic_load(&old->by_id[i]);
+        if (!u)
+            continue;
+        atomic_store(&d->by_id[i], u);
+        dir_link_name(d, u);
+    }
+
+    atomic_store(&g_dir, d);
+    epoch_synchronize();
+    dir_free(old);
+    return d;
+}
+
+/* Replaces (or adds, or with info == NULL removes) the record of user_id. Writer only. */
+static int dir_replace(int user_id, const struct UserInfo *info, const char *name)
+{
+    struct UserDir *d = atomic_load(&g_dir);
+    if (!d || user_id <= 0)
+        return -1;
+
+    struct UserRecord *old = dir_lookup_id(d, user_id);
+    if (!info && !old)
+        return 0;
+
+    struct UserRecord *u = NULL;
+    if (info)
+    {
+        u = record_new(info, user_id, name);
+        if (!u)
+            return -1;
+
+        if (user_id >= d->ids || (d->used + 1) * 2 > d->names)
+        {
+            d = dir_grow(d, user_id);
+            if (!d)
+            {
+                free(u);
+                return -1;
+            }
+        }
+    }
+
+    int same_name = old && u && strcmp(old->name, u->name) == 0;
+    if (old)
+    {
+        int slot = dir_name_slot(d, old->name);
+        if (slot >= 0)
+            atomic_store_explicit(&d->by_name[slot], same_name ? u : &g_tombstone, memory_order_release);
+    }
+    if (u && !same_name)
+        dir_link_name(d, u);
+
+    atomic_store_explicit(&d->by_id[user_id], u, memory_order_release);
+
+    if (old)
+    {
+        atomic_fetch_add_explicit(&g_dir_version, 1, memory_order_release);
+        epoch_synchronize();
+        free(old);
+    }
+    return 0;
+}
+
+int userdir_put(const struct UserInfo *info, const char *name)
+{
+    if (!info || !name)
+        return -1;
+
+    pthread_mutex_lock(&g_dir_lock);
+    int rc = dir_replace(info->id, info, name);
+    pthread_mutex_unlock(&g_dir_lock);
+    return rc;
+}
+
+int userdir_remove(int user_id)
+{
+    pthread_mutex_lock(&g_dir_lock);
+    int rc = dir_replace(user_id, NULL, NULL);
+    pthread_mutex_unlock(&g_dir_lock);
+    return rc;
+}
+
+int userdir_set_type(int user_id, enum user_type type)
+{
+    pthread_mutex_lock(&g_dir_lock);
+    struct UserRecord *old = dir_lookup_id(atomic_load(&g_dir), user_id);
+    int rc = -1;
+    if (old)
+    {
+        struct UserInfo info = old->info;
+        info.type = type;
+        rc = dir_replace(user_id, &info, old->name);
+    }
+    pthread_mutex_unlock(&g_dir_lock);
+    return rc;
+}
+
+int userdir_set_vis(int user_id, enum user_vis vis)
+{
+    pthread_mutex_lock(&g_dir_lock);
+    struct UserRecord *old = dir_lookup_id(atomic_load(&g_dir), user_id);
+    int rc = -1;
+    if (old)
+    {
+        struct UserInfo info = old->info;
+        info.vis = vis;
+        rc = dir_replace(user_id, &info, old->name);
+    }
+    pthread_mutex_unlock(&g_dir_lock);
+    return rc;
+}
+
+int userdir_find_id(const char *name)
+{
+    if (!name || name[0] == '\0')
+        return -1;
+
+    unsigned e = epoch_enter();
+    struct UserDir *d = atomic_load(&g_dir);
+    int id = -1;
+    if (d)
+    {
+        int slot = dir_name_slot(d, name);
+        if (slot >= 0)
+            id = atomic_load_explicit(&d->by_name[slot], memory_order_acquire)->info.id;
+    }
+    epoch_exit(e);
+    return id;
+}
+
+int userdir_get(int user_id, struct UserInfo *out)
+{
+    unsigned e = epoch_enter();
+    struct UserRecord *u = dir_lookup_id(atomic_load(&g_dir), user_id);
+    if (u && out)
+        *out = u->info;
+    epoch_exit(e);
+    return u ? 0 : -1;
+}
+
+int userdir_get_name(int user_id, char *out, size_t out_size)
+{
+    if (!out || out_size == 0)
+        return -1;
+
+    unsigned e = epoch_enter();
+    struct UserRecord *u = dir_lookup_id(atomic_load(&g_dir), user_id);
+    if (u)
+        snprintf(out, out_size, "%s", u->name);
+    else
+        out[0] = '\0';
+    epoch_exit(e);
+    return u ? 0 : -1;
+}
+
+unsigned userdir_version(void)
+{
+    return atomic_load_explicit(&g_dir_version, memory_order_acquire);
+}
+
+int userdir_init(void)
+{
+    const char *sql_max = "SELECT COALESCE(MAX(id), 0), COUNT(*) FROM users;";
+    const char *sql_all = "SELECT id, name, type, vis FROM users;";
+
+    sqlite3_stmt *stmt;
+    int max_id = 0, count = 0;
+
+    pthread_mutex_lock(&db_mutex);
+
+    if (storage_prepare(g_db, sql_max, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[userdir] prepare failed: %s\n", sqlite3_errmsg(g_db));
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        max_id = sqlite3_column_int(stmt, 0);
+        count = sqlite3_column_int(stmt, 1);
+    }
+    storage_finalize(stmt);
+
+    int ids = USERDIR_MIN_IDS, names = USERDIR_MIN_NAMES;
+    while (ids <= max_id)
+        ids *= 2;
+    while (count * 2 >= names)
+        names *= 2;
+
+    struct UserDir *d = dir_alloc(ids, names);
+    if (!d)
+    {
+        pthread_mutex_unlock(&db_mutex);
+        return -1;
+    }
+
+    if (storage_prepare(g_db, sql_all, &stmt) != SQLITE_OK)
+    {
+        fprintf(stderr, "[userdir] prepare users failed: %s\n", sqlite3_errmsg(g_db));
+        pthread_mutex_unlock(&db_mutex);
+        dir_free(d);
+        return -1;
+    }
+
+    int loaded = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(stmt, 0);
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        if (id <= 0 || id >= d->ids || !name || (d->used + 1) * 2 > d->names)
+            continue;
+
+        struct UserInfo info = {
+            id,
+            (enum user_type)sqlite3_column_int(stmt, 2),
+            (enum user_vis)sqlite3_column_int(stmt, 3),
+        };
+        struct UserRecord *u = record_new(&info, id, name);
+        if (!u)
+            break;
+
+        atomic_store(&d->by_id[id], u);
+        dir_link_name(d, u);
+        loaded++;
+    }
+
+    storage_finalize(stmt);
+    pthread_mutex_unlock(&db_mutex);
+
+    atomic_store(&g_dir, d);
+    printf("[userdir] Loaded %d users.\n", loaded);
+    return 0;
+}
+
+void userdir_destroy(void)
+{
+    pthread_mutex_lock(&g_dir_lock);
+    struct UserDir *d = atomic_exchange(&g_dir, NULL);
+    epoch_synchronize();
+    if (d)
+    {
+        for (int i = 0; i < d->ids; i++)
+            free(atomic_load(&d->by_id[i]));
+    }
+    dir_free(d);
+    pthread_mutex_unlock(&g_dir_lock);
+}
@@ -0,0 +1,216 @@
+#include "common.h"
+#include "worker_pool.h"
+
+#include <stdatomic.h>
+
+/*
+ * Fixed-size pool. Every worker owns a bounded deque: jobs are pushed at the
+ * tail, the owner takes them from the head (oldest first) and idle workers
+ * steal from the tail of someone else's deque. A full pool rejects the job
+ * instead of growing, so overload turns into an immediate error for the client.
+ */
+
+struct Job
+{
+    worker_job_fn fn;
+    void *arg;
+};
+
+struct Worker
+{
+    pthread_t       th;
+    int             index;
+    pthread_mutex_t lock;
+    struct Job      ring[WORKER_QUEUE_DEPTH];
+    size_t          head;
+    size_t          count;
+};
+
+static struct Worker *g_workers = NULL;
+static int g_nworkers = 0;
+
+static atomic_int  g_pending;
+static atomic_int  g_sleepers;
+static atomic_uint g_next;
+static atomic_int  g_stop;
+
+static pthread_mutex_t g_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_idle_cond = PTHREAD_COND_INITIALIZER;
+
+int worker_pool_default_size(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > WORKER_POOL_MAX_THREADS)
+        n = WORKER_POOL_MAX_THREADS;
+    return (int)n;
+}
+
+static int deque_push_tail(struct Worker *w, struct Job job)
+{
+    int ok = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->count < WORKER_QUEUE_DEPTH)
+    {
+        w->ring[(w->head + w->count) % WORKER_QUEUE_DEPTH] = job;
+        w->count++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static int deque_pop_head(struct Worker *w, struct Job *out)
+{
+    int ok = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0)
+    {
+        *out = w->ring[w->head];
+        w->head = (w->head + 1) % WORKER_QUEUE_DEPTH;
+        w->count--;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static int deque_steal_tail(struct Worker *w, struct Job *out)
+{
+    int ok = 0;
+    if (pthread_mutex_trylock(&w->lock) != 0)
+        return 0;
+    if (w->count > 0)
+    {
+        w->count--;
+        *out = w->ring[(w->head + w->count) % WORKER_QUEUE_DEPTH];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static int worker_take(struct Worker *self, struct Job *out)
+{
+    if (deque_pop_head(self, out))
+        return 1;
+
+    for (int i = 1; i < g_nworkers; i++)
+    {
+        struct Worker *victim = &g_workers[(self->index + i) % g_nworkers];
+        if (deque_steal_tail(victim, out))
+            return 1;
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct Worker *self = (struct Worker *)arg;
+
+    while (!atomic_load(&g_stop))
+    {
+        struct Job job;
+        if (worker_take(self, &job))
+        {
+            atomic_fetch_sub(&g_pending, 1);
+            job.fn(job.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&g_idle_lock);
+        atomic_fetch_add(&g_sleepers, 1);
+        while (atomic_load(&g_pending) == 0 && !atomic_load(&g_stop))
+            pthread_cond_wait(&g_idle_cond, &g_idle_lock);
+        atomic_fetch_sub(&g_sleepers, 1);
+        pthread_mutex_unlock(&g_idle_lock);
+    }
+    return NULL;
+}
+
+int worker_pool_start(int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = worker_pool_default_size();
+    if (nthreads > WORKER_POOL_MAX_THREADS)
+        nthreads = WORKER_POOL_MAX_THREADS;
+
+    g_workers = calloc((size_t)nthreads, sizeof(struct Worker));
+    if (!g_workers)
+        return -1;
+
+    atomic_store(&g_pending, 0);
+    atomic_store(&g_sleepers, 0);
+    atomic_store(&g_next, 0);
+    atomic_store(&g_stop, 0);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        g_workers[i].index = i;
+        pthread_mutex_init(&g_workers[i].lock, NULL);
+    }
+    g_nworkers = nthreads;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&g_workers[i].th, NULL, worker_main, &g_workers[i]) != 0)
+        {
+            fprintf(stderr, "[pool] Cannot start worker %d\n", i);
+            g_nworkers = i;
+            worker_pool_stop();
+            return -1;
+        }
+    }
+
+    printf("[pool] Started %d workers (queue depth %d each)\n", nthreads, WORKER_QUEUE_DEPTH);
+    return 0;
+}
+
+int worker_pool_submit(worker_job_fn fn, void *arg)
+{
+    if (!fn || g_nworkers == 0 || atomic_load(&g_stop))
+        return -1;
+
+    struct Job job = { fn, arg };
+    unsigned start = atomic_fetch_add(&g_next, 1);
+
+    for (int i = 0; i < g_nworkers; i++)
+    {
+        struct Worker *w = &g_workers[(start + (unsigned)i) % (unsigned)g_nworkers];
+        if (!deque_push_tail(w, job))
+            continue;
+
+        atomic_fetch_add(&g_pending, 1);
+        if (atomic_load(&g_sleepers) > 0)
+        {
+            pthread_mutex_lock(&g_idle_lock);
+            pthread_cond_signal(&g_idle_cond);
+            pthread_mutex_unlock(&g_idle_lock);
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+void worker_pool_stop(void)
+{
+    if (!g_workers)
+        return;
+
+    pthread_mutex_lock(&g_idle_lock);
+    atomic_store(&g_stop, 1);
+    pthread_cond_broadcast(&g_idle_cond);
+    pthread_mutex_unlock(&g_idle_lock);
+
+    for (int i = 0; i < g_nworkers; i++)
+        pthread_join(g_workers[i].th, NULL);
+
+    for (int i = 0; i < g_nworkers; i++)
+        pthread_mutex_destroy(&g_workers[i].lock);
+
+    free(g_workers);
+    g_workers = NULL;
+    g_nworkers = 0;
+}